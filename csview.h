@@ -58,6 +58,50 @@
  * } // `csv_free(&doc)` is automatically called here.
  *
  *
+ * THREAD SAFETY
+ *
+ * A csv_document_t is never modified by the read-side API once csv_read()
+ * returns. Any number of threads may call csv_field(), csv_column_index(),
+ * csv_write(), csv_show() and csv_info() on the same document concurrently
+ * without locking. Structures that are built lazily (the header lookup table
+ * and the kernel selection) are published with a single compare-and-swap, so
+ * readers never block; a thread that loses the race discards its copy.
+ * csv_free() must not run concurrently with any other call on the document.
+ *
+ * These guarantees rely on real atomics: MSVC intrinsics, the GCC/Clang
+ * __atomic builtins, or C11 <stdatomic.h>. On a compiler with none of them
+ * the library still builds, but it is NOT thread-safe: use it from a single
+ * thread and do not use csv_versioned_t, the thread pool or the parallel
+ * readers and writers.
+ *
+ * To refresh a table while readers keep using it, wrap it in a csv_versioned_t.
+ * Readers pin the current version with csv_snapshot_acquire(); the writer
+ * builds the next version with csv_derive(), which shares every unchanged row,
+ * and swaps it in with csv_versioned_publish(). Reclamation is epoch based:
+ * the writer waits for readers of the old version, readers never wait.
+ *
+ *
+ * THREADS
+ *
+ * Parallel functions take a `const csv_executor_t*`. Create one csv_pool_t at
+ * startup and pass csv_pool_executor(pool) everywhere, or wrap your own
+ * scheduler in a csv_executor_t. On POSIX systems link with `-pthread`.
+ *
+ *
+ * SIMD KERNELS
+ *
+ * The tokenizer's inner scan is dispatched at runtime. On the first parse the
+ * library queries the CPU (cpuid) and selects the widest kernel it supports:
+ * AVX-512BW, AVX2, SSE4.2, NEON or the portable SWAR fallback. The choice is made
+ * once per process, so a single binary runs at full speed on every host.
+ * Define `CSVIEW_NO_SIMD` before including the implementation to compile only
+ * the portable kernel, which scans eight bytes per step in a 64-bit register.
+ *
+ * The NEON kernel can be exercised on an x86 Linux box under qemu-user:
+ *
+ * aarch64-linux-gnu-gcc -O2 -static app.c -o app && qemu-aarch64 ./app
+ *
+ *
  * =====================================================================================
  *
  * Library:  csview.h
@@ -76,6 +120,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // -------------------------------------------------------------------------------------
 // Compiler-Specific Macros for Automatic Cleanup
@@ -107,6 +152,7 @@
 typedef struct {
         char **fields;      // Array of strings, where each string is a field in the row.
         int num_fields;     // The number of fields in this row.
+        long shared;        // Internal: owners beyond the first when documents share the row.
 } csv_row_t;
 
 /**
@@ -117,8 +163,105 @@ typedef struct {
         int num_rows;       // The total number of rows in the CSV.
         char **header;      // Optional: stores the header row fields.
         int num_cols;       // The number of columns, typically based on the header or first row.
+        void* header_index; // Internal: name lookup table, built on first csv_column_index() call.
+        int row_capacity;   // Internal: allocated length of `rows`.
 } csv_document_t;
 
+/**
+ * @brief A unit of parallel work. `index` identifies the task within its batch.
+ */
+typedef void (*csv_task_fn)(void* arg, int index);
+
+/**
+ * @brief A callback interface through which every parallel API runs its tasks.
+ *
+ * Use csv_pool_executor() for the built-in pool, or fill this in to route
+ * work onto an existing executor. Passing NULL where an executor is expected
+ * runs the work on the calling thread.
+ */
+typedef struct {
+        void* ctx;  // Passed back as the first argument of every callback.
+
+        // Runs fn(arg, i) for every i in [0, count) and returns once all are done.
+        void (*parallel_for)(void* ctx, int count, csv_task_fn fn, void* arg);
+
+        // Queues fn(arg, index) to run later and returns immediately. 0 on success.
+        int (*submit)(void* ctx, csv_task_fn fn, void* arg, int index);
+
+        // The number of tasks that can run at once; used to size work splits.
+        int (*concurrency)(void* ctx);
+} csv_executor_t;
+
+
+/**
+ * @brief A lightweight subset of a document's rows.
+ *
+ * A view references its document instead of copying rows, so the document
+ * must outlive it. Filters and slices return views; sort, write and show
+ * accept them.
+ */
+typedef struct {
+        const csv_document_t* doc;  // The document the rows belong to; not owned.
+        int* rows;                  // Selected row indexes into doc->rows, or NULL for a contiguous range.
+        int num_rows;               // The number of selected rows.
+        int first_row;              // Start of the contiguous range when `rows` is NULL.
+        int* cols;                  // Projected column indexes, or NULL for all document columns.
+        int num_cols;               // The number of entries in `cols`.
+} csv_view_t;
+
+/**
+ * @brief A row predicate for csv_filter(). Return true to keep the row.
+ */
+typedef bool (*csv_row_pred_fn)(const csv_row_t* row, void* ctx);
+
+/**
+ * @brief The value type of a typed column.
+ */
+typedef enum {
+        CSV_TYPE_INT64,
+        CSV_TYPE_DOUBLE,
+        CSV_TYPE_STRING,        // Raw field text; columns of it come only from csv_read_typed().
+        CSV_TYPE_BOOL           // true/false, yes/no or 1/0 in any case, stored as int64_t 0/1.
+} csv_type_t;
+
+/**
+ * @brief Comparison operators for column scans.
+ */
+typedef enum {
+        CSV_CMP_EQ,
+        CSV_CMP_NE,
+        CSV_CMP_LT,
+        CSV_CMP_LE,
+        CSV_CMP_GT,
+        CSV_CMP_GE
+} csv_cmp_t;
+
+/**
+ * @brief One column converted to a packed array of native values.
+ */
+typedef struct {
+        csv_type_t type;        // The type of `values`.
+        int length;             // The number of values (rows).
+        int null_count;         // The number of missing or unparsable values.
+        void* values;           // int64_t[length] (INT64, BOOL), double[length] or
+                                // const char*[length] (STRING); nulls are stored as 0/NULL.
+        uint64_t* validity;     // Bit i set when value i is present, or NULL when none are null.
+} csv_column_t;
+
+/**
+ * @brief Results of csv_column_aggregate().
+ */
+typedef struct {
+        int count;              // The number of non-null values.
+        double sum;             // Sum of the values.
+        double min;             // Smallest value, NaN when `count` is 0.
+        double max;             // Largest value, NaN when `count` is 0.
+        double mean;            // sum / count, NaN when `count` is 0.
+        int64_t int_sum;        // Exact results for INT64 and BOOL columns (sum wraps
+        int64_t int_min;        // on overflow); 0 for other columns or when `count`
+        int64_t int_max;        // is 0.
+} csv_aggregate_t;
+
 
 // -------------------------------------------------------------------------------------
 // Function Prototypes
@@ -142,6 +285,25 @@ csv_document_t* csv_read(const char* file_path, bool has_header);
  */
 int csv_write(const csv_document_t* doc, const char* file_path);
 
+/**
+ * @brief Writes a csv_document_t to a file using several threads.
+ *
+ * Row ranges are measured in parallel, placed at precomputed offsets and
+ * formatted and written concurrently with pwrite(). Where pwrite() is not
+ * available the ranges are formatted in parallel and written in order. The
+ * output is byte-identical to csv_write().
+ *
+ * On 32-bit POSIX systems, build with `-D_FILE_OFFSET_BITS=64` so that off_t
+ * can address files past 2 GiB. Without it, an output that would not fit is
+ * written serially with csv_write() instead.
+ *
+ * @param doc The csv_document_t to write.
+ * @param file_path The path to the output file.
+ * @param exec The executor to run on, or NULL to run on the calling thread.
+ * @return 0 on success, -1 on failure.
+ */
+int csv_write_parallel(const csv_document_t* doc, const char* file_path, const csv_executor_t* exec);
+
 /**
  * @brief Frees all memory associated with a csv_document_t.
  *
@@ -164,252 +326,8763 @@ void csv_show(const csv_document_t* doc);
  */
 void csv_info(const csv_document_t* doc);
 
+/**
+ * @brief Returns a field of the document without copying it.
+ *
+ * @param doc The csv_document_t to read from.
+ * @param row The zero-based data row index.
+ * @param col The zero-based column index.
+ * @return The field string, or NULL if the row or column is out of range.
+ */
+const char* csv_field(const csv_document_t* doc, int row, int col);
+
+/**
+ * @brief Looks up a column by its header name.
+ *
+ * The lookup table is built on the first call and shared by later calls, so
+ * repeated lookups cost one hash probe.
+ *
+ * @param doc The csv_document_t to search.
+ * @param name The header name to find.
+ * @return The zero-based column index, or -1 if the document has no header
+ * or no column is named `name`. Duplicate names resolve to the first column.
+ */
+int csv_column_index(const csv_document_t* doc, const char* name);
+
 
 // -------------------------------------------------------------------------------------
-// Implementation
+// Streaming Reader
 // -------------------------------------------------------------------------------------
 
-#ifdef CSVIEW_IMPLEMENTATION
-
-// Internal helper to parse a single line
-static
-csv_row_t*
-_parse_csv_line(const char* line
-		)
-{
-        csv_row_t* row = (csv_row_t*)malloc(sizeof(csv_row_t));
-        if (!row) {
-                return NULL;
-        }
+/**
+ * @brief Reads a CSV file one row at a time without loading it into memory.
+ */
+typedef struct csv_reader csv_reader_t;
 
-        row->fields = NULL;
-        row->num_fields = 0;
-        
-        const char* ptr = line;
-        int field_capacity = 10;
-        row->fields = (char**)malloc(field_capacity * sizeof(char*));
+/**
+ * @brief Opens a CSV file for streaming.
+ *
+ * @param file_path The path to the CSV file.
+ * @param has_header True if the first line is a header row.
+ * @return A new reader, or NULL on failure.
+ */
+csv_reader_t* csv_reader_open(const char* file_path, bool has_header);
 
-        while (*ptr) {
-                const char* start = ptr;
-                const char* end = start;
-                bool in_quotes = false;
+/**
+ * @brief Returns the header row, or NULL if the file has none.
+ */
+const csv_row_t* csv_reader_header(const csv_reader_t* reader);
 
-                if (*ptr == '"') {
-                        in_quotes = true;
-                        start++;
-                        end = strchr(start, '"');
-                        if (!end) { // Malformed CSV
-                                end = start + strlen(start);
-                        }
-                } else {
-                        end = strchr(start, ',');
-                        if (!end) {
-                                end = start + strlen(start);
-                        }
-                }
+/**
+ * @brief Advances to the next non-empty row.
+ *
+ * @param reader The reader.
+ * @return The row, valid until the next call or csv_reader_close(), or NULL
+ * at the end of the file.
+ */
+const csv_row_t* csv_reader_next(csv_reader_t* reader);
 
-                int len = end - start;
-                char* field = (char*)malloc(len + 1);
-                strncpy(field, start, len);
-                field[len] = '\0';
-                
-                if (row->num_fields >= field_capacity) {
-                        field_capacity *= 2;
-                        row->fields = (char**)realloc(row->fields, field_capacity * sizeof(char*));
-                }
-                row->fields[row->num_fields++] = field;
-                
-                ptr = end;
-                if (in_quotes && *ptr == '"') {
-                        ptr++;
-                }
-                if (*ptr == ',') {
-                        ptr++;
-                }
-                while (*ptr == ' ' || *ptr == '\t') { // Skip whitespace
-                        ptr++;
-                }
-        }
+/**
+ * @brief Returns the fingerprint of everything read so far.
+ *
+ * The reader folds each row's hash in as it parses, so after the last row
+ * this equals csv_fingerprint() of the same file loaded with csv_read().
+ */
+uint64_t csv_reader_fingerprint(const csv_reader_t* reader);
 
-        return row;
-}
+/**
+ * @brief One column of a csv_batch_t.
+ *
+ * Value `i` starts at `data + offsets[i]` and is NUL-terminated; its length
+ * is `offsets[i + 1] - offsets[i] - 1`.
+ */
+typedef struct {
+        const size_t* offsets;  // num_rows + 1 entries.
+        const char* data;
+} csv_batch_column_t;
 
-csv_document_t*
-csv_read(const char* file_path,
-         bool has_header)
-{
-        FILE* file = fopen(file_path, "r");
-        if (!file) {
-                perror("Error opening file");
-                return NULL;
-        }
+/**
+ * @brief A block of rows stored column by column.
+ */
+typedef struct {
+        int num_rows;
+        int num_cols;
+        csv_batch_column_t* columns;
+} csv_batch_t;
 
-        csv_document_t* doc = (csv_document_t*)calloc(1, sizeof(csv_document_t));
-        if (!doc) {
-                fclose(file);
-                return NULL;
-        }
+/**
+ * @brief Reads up to `max_rows` rows at once into columnar form.
+ *
+ * Each column's values are packed back to back in one buffer, so a
+ * downstream operator walks a column with no per-row or per-field calls.
+ * The width is the header's, or the first row's if there is no header.
+ * Extra fields are dropped and missing fields are empty. Batch rows are
+ * folded into the fingerprint like csv_reader_next() rows.
+ *
+ * @param reader The reader.
+ * @param max_rows The most rows to return, e.g. 4096.
+ * @return The batch, valid until the next read or csv_reader_close(), or
+ * NULL at the end of the file.
+ */
+const csv_batch_t* csv_reader_next_batch(csv_reader_t* reader, int max_rows);
 
-        char line[1024];
-        int row_capacity = 10;
-        doc->rows = (csv_row_t**)malloc(row_capacity * sizeof(csv_row_t*));
+/**
+ * @brief Returns the value at (row, col) of a batch, or NULL if out of range.
+ */
+const char* csv_batch_field(const csv_batch_t* batch, int row, int col);
 
-        // Handle header
-        if (has_header && fgets(line, sizeof(line), file)) {
-                line[strcspn(line, "\r\n")] = 0; // Remove newline
-                csv_row_t* header_row = _parse_csv_line(line);
-                doc->header = header_row->fields;
-                doc->num_cols = header_row->num_fields;
-                free(header_row); // We only keep the fields
-        }
+/**
+ * @brief Closes a reader and frees its buffers.
+ *
+ * @param reader_ptr A pointer to the csv_reader_t* variable to close.
+ */
+void csv_reader_close(csv_reader_t** reader_ptr);
 
-        // Read data rows
-        while (fgets(line, sizeof(line), file)) {
-                line[strcspn(line, "\r\n")] = 0; // Remove newline
-                if (strlen(line) == 0) {
-                        continue; // Skip empty lines
-                }
 
-                if (doc->num_rows >= row_capacity) {
-                        row_capacity *= 2;
-                        doc->rows = (csv_row_t**)realloc(doc->rows, row_capacity * sizeof(csv_row_t*));
-                }
-                
-                csv_row_t* current_row = _parse_csv_line(line);
-                doc->rows[doc->num_rows++] = current_row;
-                if (doc->num_cols == 0) {
-                        doc->num_cols = current_row->num_fields;
-                }
-        }
+// -------------------------------------------------------------------------------------
+// Row Hashing
+// -------------------------------------------------------------------------------------
 
-        fclose(file);
-        return doc;
-}
+/**
+ * @brief Hashes a row's fields with 64-bit XXH64.
+ *
+ * Fields are hashed directly, with their lengths, so "a,bc" and "ab,c" differ
+ * and no string is built. The result is stable across platforms and runs but
+ * is not cryptographic. Missing columns hash as empty fields.
+ *
+ * @param row The row to hash.
+ * @param cols The columns to hash, in order, or NULL for the whole row.
+ * @param num_cols The number of entries in `cols`.
+ * @return The 64-bit hash.
+ */
+uint64_t csv_row_hash(const csv_row_t* row, const int* cols, int num_cols);
 
-int
-csv_write(const csv_document_t* doc,
-          const char* file_path)
-{
-        FILE* file = fopen(file_path, "w");
-        if (!file) {
-                perror("Error opening file for writing");
-                return -1;
-        }
+/**
+ * @brief Computes an order-sensitive fingerprint of a document's header and rows.
+ */
+uint64_t csv_fingerprint(const csv_document_t* doc);
 
-        // Write header
-        if (doc->header) {
-                for (int i = 0; i < doc->num_cols; i++) {
-                        fprintf(file, "%s%s", doc->header[i], (i == doc->num_cols - 1) ? "" : ",");
-                }
-                fprintf(file, "\n");
-        }
+/**
+ * @brief Computes csv_fingerprint() of a file by streaming it.
+ *
+ * @param file_path The CSV file.
+ * @param has_header True if the first line is a header row.
+ * @param fingerprint Receives the fingerprint.
+ * @return 0 on success, -1 on failure.
+ */
+int csv_file_fingerprint(const char* file_path, bool has_header, uint64_t* fingerprint);
 
-        // Write rows
-        for (int i = 0; i < doc->num_rows; i++) {
-                for (int j = 0; j < doc->rows[i]->num_fields; j++) {
-                        fprintf(file, "%s%s", doc->rows[i]->fields[j], (j == doc->rows[i]->num_fields - 1) ? "" : ",");
-                }
-                fprintf(file, "\n");
-        }
 
-        fclose(file);
-        return 0;
-}
+// -------------------------------------------------------------------------------------
+// Deduplication
+// -------------------------------------------------------------------------------------
 
-void
-csv_free(csv_document_t** doc_ptr)
-{
-        if (!doc_ptr || !*doc_ptr) {
-                return;
-        }
-        csv_document_t* doc = *doc_ptr;
+/**
+ * @brief Which row of a group of duplicates to keep.
+ */
+typedef enum {
+        CSV_KEEP_FIRST,
+        CSV_KEEP_LAST
+} csv_keep_t;
 
-        if (doc->header) {
-                for (int i = 0; i < doc->num_cols; i++) {
-                        free(doc->header[i]);
-                }
-                free(doc->header);
-        }
+/**
+ * @brief Selects one row per distinct key in a single hashing pass.
+ *
+ * Rows are hashed on their key fields and hash matches are verified field by
+ * field, so collisions never merge distinct rows.
+ *
+ * @param doc The document to deduplicate.
+ * @param key_cols The columns that form the key, or NULL to compare whole rows.
+ * @param num_keys The number of entries in `key_cols`.
+ * @param keep Whether the first or last occurrence of each key survives.
+ * @return A view of the surviving rows in document order, or NULL on failure.
+ */
+csv_view_t* csv_dedup(const csv_document_t* doc, const int* key_cols, int num_keys, csv_keep_t keep);
 
-        if (doc->rows) {
-                for (int i = 0; i < doc->num_rows; i++) {
-                        if (doc->rows[i]) {
-                                for (int j = 0; j < doc->rows[i]->num_fields; j++) {
-                                        free(doc->rows[i]->fields[j]);
-                                }
-                                free(doc->rows[i]->fields);
-                                free(doc->rows[i]);
-                        }
-                }
-                free(doc->rows);
-        }
-        free(doc);
-}
+/**
+ * @brief Streams a CSV file into `out_path`, dropping duplicate rows.
+ *
+ * Only one row and the set of distinct keys are held in memory. CSV_KEEP_LAST
+ * reads the input twice: once to find each key's last row, once to write.
+ * Kept records are copied byte for byte, quoting included.
+ *
+ * @param in_path The input CSV file.
+ * @param has_header True if the input has a header row; it is copied through.
+ * @param key_cols The columns that form the key, or NULL to compare whole rows.
+ * @param num_keys The number of entries in `key_cols`.
+ * @param keep Whether the first or last occurrence of each key survives.
+ * @param out_path The output CSV file.
+ * @return The number of rows written, or -1 on failure.
+ */
+long csv_dedup_file(const char* in_path, bool has_header, const int* key_cols, int num_keys, csv_keep_t keep, const char* out_path);
 
-void
-csv_show(const csv_document_t* doc)
-{
-        if (!doc) {
-                printf("CSV Document is NULL.\n");
-                return;
-        }
 
-        // Determine column widths
-        int* col_widths = (int*)calloc(doc->num_cols, sizeof(int));
-        if (doc->header) {
-                for (int i = 0; i < doc->num_cols; i++) {
-                        col_widths[i] = strlen(doc->header[i]);
-                }
-        }
-        for (int i = 0; i < doc->num_rows; i++) {
-                for (int j = 0; j < doc->rows[i]->num_fields; j++) {
-                        int len = strlen(doc->rows[i]->fields[j]);
-                        if (j < doc->num_cols && len > col_widths[j]) {
-                                col_widths[j] = len;
-                        }
-                }
-        }
+// -------------------------------------------------------------------------------------
+// Diff
+// -------------------------------------------------------------------------------------
 
-        // Print header
+/**
+ * @brief Compares two CSV files row by row on a key and writes the differences.
+ *
+ * The smaller file is loaded into a hash index and the larger one is streamed
+ * against it, so memory is bounded by the smaller input. Both files are
+ * assumed to share a column layout. Each output row is the differing row
+ * prefixed with a `_diff` column:
+ * - `added`: the key is only in `new_path`.
+ * - `removed`: the key is only in `old_path`.
+ * - `changed`: the key is in both but a non-key field differs; the row from
+ *   `new_path` is written.
+ * Repeated keys are paired in file order.
+ *
+ * @param old_path The earlier snapshot.
+ * @param new_path The later snapshot.
+ * @param has_header True if both files have a header row; the output gets
+ * `_diff` followed by the header of `new_path`.
+ * @param key_cols The columns that form the key, or NULL to use whole rows.
+ * @param num_keys The number of entries in `key_cols`.
+ * @param out_path The output CSV file.
+ * @return The number of difference rows written, or -1 on failure.
+ */
+long csv_diff(const char* old_path, const char* new_path, bool has_header, const int* key_cols, int num_keys, const char* out_path);
+
+
+// -------------------------------------------------------------------------------------
+// File Tools
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief Shards a CSV file into `num_parts` files by the hash of one column.
+ *
+ * The input is streamed once and each record is copied unchanged into the
+ * buffered writer of part csv_row_hash(key) % num_parts, so rows with equal
+ * keys always land in the same part. Every part gets the header, even if it
+ * receives no rows.
+ *
+ * @param in_path The input CSV file.
+ * @param has_header True if the input has a header row.
+ * @param key_col The column to route on.
+ * @param num_parts The number of output files.
+ * @param out_pattern A printf pattern with exactly one `%d` (and optional
+ * `%%`), e.g. "part-%03d.csv", expanded with the part number from 0.
+ * @return The number of rows written, or -1 on failure.
+ */
+long csv_partition(const char* in_path, bool has_header, int key_col, int num_parts, const char* out_pattern);
+
+/**
+ * @brief Concatenates CSV files into one.
+ *
+ * When every header is identical (or there are none) and all files end
+ * their lines the same way, the record bytes are block-copied without
+ * tokenizing, and the header and any missing final newline use that line
+ * ending. Otherwise each file's rows are parsed and rewritten with '\n'
+ * endings: with headers, the output header is the union of all column names
+ * in first-seen order, and rows are reordered into it with missing columns
+ * left empty; without headers, columns stay in place.
+ *
+ * @param paths The input files, in output order.
+ * @param num_paths The number of input files.
+ * @param has_header True if every input has a header row.
+ * @param out_path The output CSV file.
+ * @return 0 on success, -1 on failure.
+ */
+int csv_concat(const char* const* paths, int num_paths, bool has_header, const char* out_path);
+
+/**
+ * @brief Splits a CSV file into chunks at record boundaries.
+ *
+ * Boundaries are found with a quote-aware scan, so newlines inside quoted
+ * fields never split a record, and record bytes are written in large block
+ * copies. A chunk is closed before a record that would take it past
+ * `max_bytes` (a single larger record gets a chunk of its own) or after
+ * `max_rows` records. Each chunk starts with the header.
+ *
+ * @param in_path The input CSV file.
+ * @param has_header True if the input has a header row.
+ * @param max_bytes The byte limit per chunk, header included, or 0 for none.
+ * @param max_rows The record limit per chunk, or 0 for none.
+ * @param out_pattern A printf pattern with exactly one `%d`, expanded with the
+ * chunk number from 0.
+ * @return The number of chunks written, or -1 on failure.
+ */
+int csv_split(const char* in_path, bool has_header, long max_bytes, long max_rows, const char* out_pattern);
+
+/**
+ * @brief One key of a multi-column sort order.
+ *
+ * Values are compared as `type`, as in csv_view_sort(); fields that do not
+ * parse as that type sort last in either direction.
+ */
+typedef struct {
+        int col;
+        csv_type_t type;
+        bool descending;
+} csv_sort_key_t;
+
+/**
+ * @brief Merges files that are each sorted by `keys` into one sorted file.
+ *
+ * The inputs are streamed through one reader each and merged with a loser
+ * tree, so each output row costs about log2(num_paths) key comparisons and
+ * memory does not grow with the input size. Ties keep the order of `paths`,
+ * and records are copied unchanged. The output header is taken from the first
+ * input.
+ *
+ * @param paths The sorted input files.
+ * @param num_paths The number of input files.
+ * @param has_header True if every input has a header row.
+ * @param keys The sort keys, most significant first.
+ * @param num_keys The number of keys.
+ * @param out_path The output CSV file.
+ * @return The number of rows written, or -1 on failure.
+ */
+long csv_merge_sorted(const char* const* paths, int num_paths, bool has_header, const csv_sort_key_t* keys, int num_keys, const char* out_path);
+
+/**
+ * @brief Selects, reorders and renames columns of a CSV file by header name.
+ *
+ * The input is streamed, and each line is split into field spans. Spans for
+ * the chosen columns are copied straight into the output buffer, so no field
+ * is allocated. Tokenizing stops after the last column that is needed. Rows
+ * missing a column get an empty field.
+ *
+ * @param in_path The input CSV file, which must have a header row.
+ * @param columns Input column names, in output order. A name may repeat.
+ * @param names Output column names, parallel to `columns`, or NULL to keep the
+ * input names. A NULL entry also keeps its input name.
+ * @param num_columns The number of output columns.
+ * @param out_path The output CSV file.
+ * @return The number of rows written, or -1 on failure (including an unknown
+ * column name).
+ */
+long csv_transform(const char* in_path, const char* const* columns, const char* const* names, int num_columns, const char* out_path);
+
+
+// -------------------------------------------------------------------------------------
+// Typed Columns & Scans
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief Converts one column of a document into a packed typed array.
+ *
+ * Fields that are missing, empty or do not parse completely as the requested
+ * type (including "nan" for doubles) become nulls.
+ *
+ * @param doc The source document.
+ * @param col The zero-based column index.
+ * @param type CSV_TYPE_INT64, CSV_TYPE_DOUBLE or CSV_TYPE_BOOL.
+ * @return A new column (free with csv_column_free()), or NULL on failure.
+ */
+csv_column_t* csv_column_build(const csv_document_t* doc, int col, csv_type_t type);
+
+/**
+ * @brief Frees a column created by csv_column_build().
+ *
+ * @param col_ptr A pointer to the csv_column_t* variable to free.
+ */
+void csv_column_free(csv_column_t** col_ptr);
+
+/**
+ * @brief Returns true if value `i` of the column is present.
+ */
+bool csv_column_is_valid(const csv_column_t* col, int i);
+
+/**
+ * @brief Computes count, sum, min, max and mean of the non-null values in one pass.
+ *
+ * @param col The column to scan.
+ * @param out Receives the results.
+ * @return 0 on success, -1 on failure or for CSV_TYPE_STRING columns.
+ */
+int csv_column_aggregate(const csv_column_t* col, csv_aggregate_t* out);
+
+/**
+ * @brief Counts the non-null values for which `value_i op value` holds.
+ *
+ * For CSV_TYPE_INT64 columns the comparison is exact for every int64 value.
+ * CSV_TYPE_BOOL columns compare as 0/1; CSV_TYPE_STRING columns are rejected.
+ *
+ * @return The number of matching values, or -1 on failure.
+ */
+int csv_column_count_if(const csv_column_t* col, csv_cmp_t op, double value);
+
+/**
+ * @brief Writes the indexes of non-null values for which `value_i op value` holds.
+ *
+ * @param col The column to scan.
+ * @param op The comparison operator.
+ * @param value The right-hand side of the comparison.
+ * @param sel Receives the matching row indexes in ascending order. Must have
+ * room for `col->length` entries.
+ * @return The number of indexes written, or -1 on failure.
+ */
+int csv_column_select(const csv_column_t* col, csv_cmp_t op, double value, int* sel);
+
+
+// -------------------------------------------------------------------------------------
+// Packed Columns
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief How csv_column_pack() encodes each block of 256 values.
+ */
+typedef enum {
+        CSV_PACK_FOR,           // Frame of reference: each value minus the block minimum.
+        CSV_PACK_DELTA          // Differences between neighbours; best for sorted ids and timestamps.
+} csv_packing_t;
+
+/**
+ * @brief A compressed, read-only int64 column.
+ */
+typedef struct csv_packed_column csv_packed_column_t;
+
+/**
+ * @brief Compresses an integer column into bit-packed blocks.
+ *
+ * Each block stores its residuals in the fewest bits that hold the largest
+ * one, plus its min and max. Ids and timestamps typically need 4-16 bits
+ * per value instead of 64.
+ *
+ * @param col A CSV_TYPE_INT64 or CSV_TYPE_BOOL column.
+ * @param packing The block encoding.
+ * @return A new packed column (free with csv_packed_free()), or NULL on failure.
+ */
+csv_packed_column_t* csv_column_pack(const csv_column_t* col, csv_packing_t packing);
+
+/**
+ * @brief Decodes values begin..begin+count-1 into `out`. Nulls decode as 0.
+ *
+ * @return `count`, or -1 if the range is out of bounds.
+ */
+int csv_packed_decode(const csv_packed_column_t* packed, int begin, int count, int64_t* out);
+
+/**
+ * @brief Decodes a whole packed column back into a csv_column_t.
+ *
+ * @return A new column (free with csv_column_free()), or NULL on failure.
+ */
+csv_column_t* csv_packed_unpack(const csv_packed_column_t* packed);
+
+/**
+ * @brief Returns the number of values in a packed column.
+ */
+int csv_packed_length(const csv_packed_column_t* packed);
+
+/**
+ * @brief Returns the bytes held by a packed column, headers and bitmap included.
+ */
+size_t csv_packed_size(const csv_packed_column_t* packed);
+
+/**
+ * @brief csv_column_aggregate() over a packed column, decoding one block at a time.
+ */
+int csv_packed_aggregate(const csv_packed_column_t* packed, csv_aggregate_t* out);
+
+/**
+ * @brief csv_column_count_if() over a packed column.
+ *
+ * Blocks whose min/max settle the comparison are counted without decoding.
+ */
+int csv_packed_count_if(const csv_packed_column_t* packed, csv_cmp_t op, double value);
+
+/**
+ * @brief csv_column_select() over a packed column.
+ */
+int csv_packed_select(const csv_packed_column_t* packed, csv_cmp_t op, double value, int* sel);
+
+/**
+ * @brief Frees a packed column.
+ *
+ * @param packed_ptr A pointer to the csv_packed_column_t* variable to free.
+ */
+void csv_packed_free(csv_packed_column_t** packed_ptr);
+
+
+// -------------------------------------------------------------------------------------
+// Schemas
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief The declared type and constraints of one column.
+ */
+typedef struct {
+        const char* name;               // Header name to bind to, or NULL to bind by position.
+        csv_type_t type;                // The storage type of the column.
+        bool nullable;                  // Whether empty and missing fields are allowed.
+        int max_length;                 // Longest allowed field in bytes, or 0 for no limit.
+        const char* const* enum_values; // The allowed values, or NULL to allow any.
+        int num_enum_values;
+} csv_schema_column_t;
+
+/**
+ * @brief A declared schema: the columns to read, in output order.
+ */
+typedef struct {
+        const csv_schema_column_t* columns;
+        int num_columns;
+} csv_schema_t;
+
+/**
+ * @brief What a field did wrong.
+ */
+typedef enum {
+        CSV_VIOLATION_NULL,     // Empty or missing field in a column that is not nullable.
+        CSV_VIOLATION_TYPE,     // The field does not parse as the column's type.
+        CSV_VIOLATION_LENGTH,   // The field is longer than max_length.
+        CSV_VIOLATION_ENUM      // The field is not one of enum_values.
+} csv_violation_kind_t;
+
+/**
+ * @brief One schema violation, as passed to a csv_violation_fn.
+ */
+typedef struct {
+        csv_violation_kind_t kind;
+        int column;             // Index into the schema's columns.
+        long row;               // Zero-based data row.
+        long offset;            // Byte offset of the field in the file; the line's end for missing fields.
+        const char* value;      // The field text, valid only during the callback.
+} csv_violation_t;
+
+/**
+ * @brief Receives schema violations. Return false to stop reading.
+ */
+typedef bool (*csv_violation_fn)(const csv_violation_t* violation, void* ctx);
+
+/**
+ * @brief Typed columns read under a schema.
+ */
+typedef struct {
+        int num_rows;
+        int num_columns;
+        long num_violations;
+        csv_column_t** columns; // One per schema column, in schema order.
+} csv_table_t;
+
+/**
+ * @brief Streams a file into typed columns, validating each field as it is parsed.
+ *
+ * Lines are tokenized only up to the last column the schema uses, and each
+ * field is checked and converted straight from the line buffer, so no row
+ * is ever materialized. A field that violates its column's constraints is
+ * reported and stored as null. Empty fields in nullable columns are nulls
+ * without a report.
+ *
+ * @param file_path The path to the CSV file.
+ * @param has_header True if the first line is a header row. Named schema
+ * columns need one.
+ * @param schema The declared columns.
+ * @param on_violation Called for each violation, or NULL to only count them.
+ * @param ctx Passed through to `on_violation`.
+ * @return A new table (free with csv_table_free()), or NULL on failure, on
+ * an unknown column name, or when `on_violation` returned false.
+ */
+csv_table_t* csv_read_typed(const char* file_path, bool has_header, const csv_schema_t* schema, csv_violation_fn on_violation, void* ctx);
+
+/**
+ * @brief Frees a table created by csv_read_typed() and all of its columns.
+ *
+ * @param table_ptr A pointer to the csv_table_t* variable to free.
+ */
+void csv_table_free(csv_table_t** table_ptr);
+
+/**
+ * @brief What csv_infer_schema() learned about one column.
+ */
+typedef struct {
+        char* name;                 // The header name.
+        csv_type_t type;            // Narrowest type that at least 95% of the non-empty values parse as.
+        double confidence;          // Fraction of non-empty values that parse as `type`; 0 if all were empty.
+        bool nullable;              // True if the sample had empty or missing values.
+        long null_count;            // Empty or missing values in the sample.
+        long distinct_estimate;     // Estimated number of distinct non-empty values.
+        int max_length;             // Longest value in the sample, in bytes.
+        int num_examples;
+        char* examples[3];          // The first distinct non-empty values.
+} csv_column_info_t;
+
+/**
+ * @brief The result of csv_infer_schema().
+ */
+typedef struct {
+        long rows_sampled;
+        int num_columns;
+        csv_column_info_t* columns;
+        csv_schema_t schema;        // The inferred names, types and nullability, for csv_read_typed().
+} csv_schema_report_t;
+
+/**
+ * @brief Infers column types from the first rows of a file with a header.
+ *
+ * Rows are tokenized in place by the streaming reader and values are
+ * classified without allocating, so the cost is bounded by `sample_rows`
+ * whatever the file size. Distinct counts are HyperLogLog estimates
+ * (about 3% error). The embedded schema only reflects the sample: a
+ * column whose nulls all fall after it is inferred as not nullable.
+ *
+ * @param file_path The path to the CSV file.
+ * @param sample_rows The most data rows to read, or 0 for all of them.
+ * @return A new report (free with csv_schema_report_free()), or NULL on failure.
+ */
+csv_schema_report_t* csv_infer_schema(const char* file_path, int sample_rows);
+
+/**
+ * @brief Frees a report created by csv_infer_schema().
+ *
+ * @param report_ptr A pointer to the csv_schema_report_t* variable to free.
+ */
+void csv_schema_report_free(csv_schema_report_t** report_ptr);
+
+
+// -------------------------------------------------------------------------------------
+// Views & Selection Vectors
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief Creates a view over the given rows of a document.
+ *
+ * @param doc The document to view.
+ * @param rows Row indexes into doc->rows (copied), or NULL for all rows.
+ * @param num_rows The number of entries in `rows`; ignored when `rows` is NULL.
+ * @return A new view (free with csv_view_free()), or NULL on failure, if
+ * `num_rows` is negative, or if any index is outside [0, doc->num_rows).
+ */
+csv_view_t* csv_view_create(const csv_document_t* doc, const int* rows, int num_rows);
+
+/**
+ * @brief Returns a zero-copy window onto a range of rows and a subset of columns.
+ *
+ * The slice shares the document's storage: a row range needs no selection
+ * vector, and only the column list is copied. The result works with
+ * csv_view_write(), csv_view_show() and the other view functions.
+ *
+ * @param doc The document to slice.
+ * @param row_begin The first row of the slice (clamped to the document).
+ * @param row_end One past the last row of the slice (clamped to the document).
+ * @param cols Column indexes in output order (copied; may repeat), or NULL
+ * for all columns.
+ * @param num_cols The number of entries in `cols`.
+ * @return A new view, or NULL if `num_cols` is negative, a column is out of
+ * range, or allocation fails.
+ */
+csv_view_t* csv_slice(const csv_document_t* doc, int row_begin, int row_end, const int* cols, int num_cols);
+
+/**
+ * @brief Frees a view. The underlying document is not touched.
+ *
+ * @param view_ptr A pointer to the csv_view_t* variable to free.
+ */
+void csv_view_free(csv_view_t** view_ptr);
+
+/**
+ * @brief Selects the rows of `doc` for which `pred` returns true.
+ *
+ * @return A new view, or NULL on failure.
+ */
+csv_view_t* csv_filter(const csv_document_t* doc, csv_row_pred_fn pred, void* ctx);
+
+/**
+ * @brief Narrows an existing view to the rows for which `pred` returns true.
+ *
+ * @return A new view over the same document, or NULL on failure.
+ */
+csv_view_t* csv_view_filter(const csv_view_t* view, csv_row_pred_fn pred, void* ctx);
+
+/**
+ * @brief Selects the rows whose value in a typed column satisfies `value_i op value`.
+ *
+ * The selection vector comes straight from csv_column_select(), so no field
+ * is re-parsed. Null values never match.
+ *
+ * @param doc The document `column` was built from.
+ * @param column A column built from `doc` with csv_column_build().
+ * @return A new view, or NULL on failure.
+ */
+csv_view_t* csv_filter_column(const csv_document_t* doc, const csv_column_t* column, csv_cmp_t op, double value);
+
+/**
+ * @brief Reorders a view's rows by one column. The document is not modified.
+ *
+ * The sort is stable. Fields that are missing or do not parse as `type` sort
+ * after all other values in either direction.
+ *
+ * @param view The view to reorder in place.
+ * @param col The zero-based column of the view to sort by.
+ * @param type How to compare the field text.
+ * @param descending True for largest-first order.
+ * @return 0 on success, -1 on failure.
+ */
+int csv_view_sort(csv_view_t* view, int col, csv_type_t type, bool descending);
+
+/**
+ * @brief Writes the header and the view's rows to a file in csv_write() format.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int csv_view_write(const csv_view_t* view, const char* file_path);
+
+/**
+ * @brief Prints the header and the view's rows in the csv_show() format.
+ */
+void csv_view_show(const csv_view_t* view);
+
+/**
+ * @brief Turns a view into a standalone document.
+ *
+ * Rows are shared with the source document (see csv_derive()), so this costs
+ * one pointer per row rather than a copy of every field.
+ *
+ * @return A new csv_document_t (free with csv_free()), or NULL on failure.
+ */
+csv_document_t* csv_view_materialize(const csv_view_t* view);
+
+
+// -------------------------------------------------------------------------------------
+// Expressions
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief A compiled expression over the columns of a document.
+ *
+ * Expressions compile to register bytecode. Evaluation runs each instruction
+ * over a batch of 256 rows at a time, not row by row. A compiled expression
+ * is immutable, so threads may evaluate it concurrently.
+ *
+ * Syntax:
+ * - Values: column names, "quoted column names", `$N` for the zero-based
+ *   column N, numbers, 'strings' ('' escapes a quote), and true/false.
+ * - Operators: `+ - * / %`, `= == != <> < <= > >=`, and `and or not`,
+ *   all case-insensitive. Parentheses group.
+ * - Functions: len(s), abs(x), contains(s, t), starts_with(s, t) and
+ *   ends_with(s, t).
+ *
+ * Columns are text. They are converted to numbers when they meet
+ * arithmetic or a numeric operand, and text that is not a number becomes
+ * null. Null compares false and makes arithmetic null. Two text operands
+ * (e.g. two columns) compare as numbers when both values are numbers, so
+ * `cost < price` works on numeric columns, and bytewise otherwise.
+ */
+typedef struct csv_expr csv_expr_t;
+
+/**
+ * @brief Compiles an expression against a header.
+ *
+ * Errors are reported on stderr with the offending position.
+ *
+ * @param text The expression source.
+ * @param header The column names (e.g. doc->header), or NULL to allow only `$N`.
+ * @param num_cols The number of entries in `header`.
+ * @return A compiled expression (free with csv_expr_free()), or NULL on error.
+ */
+csv_expr_t* csv_expr_compile(const char* text, char* const* header, int num_cols);
+
+/**
+ * @brief Frees a compiled expression.
+ *
+ * @param expr_ptr A pointer to the csv_expr_t* variable to free.
+ */
+void csv_expr_free(csv_expr_t** expr_ptr);
+
+/**
+ * @brief Selects the rows of `doc` for which a boolean expression is true.
+ *
+ * @return A new view, or NULL on failure or if `expr` is not boolean.
+ */
+csv_view_t* csv_filter_expr(const csv_document_t* doc, const csv_expr_t* expr);
+
+/**
+ * @brief Narrows a view to the rows for which a boolean expression is true.
+ *
+ * Column references resolve against the document, not the view's projection.
+ *
+ * @return A new view over the same document, or NULL on failure.
+ */
+csv_view_t* csv_view_filter_expr(const csv_view_t* view, const csv_expr_t* expr);
+
+/**
+ * @brief Evaluates an expression for every row of a view into a typed column.
+ *
+ * Numeric results give a CSV_TYPE_DOUBLE column whose nulls are marked in the
+ * validity bitmap. Boolean results give a CSV_TYPE_INT64 column of 0/1. The
+ * column works with csv_column_aggregate() and the other column scans.
+ *
+ * @return A new column (free with csv_column_free()), or NULL on failure or
+ * for text results.
+ */
+csv_column_t* csv_view_eval(const csv_view_t* view, const csv_expr_t* expr);
+
+/**
+ * @brief Runs a small SQL-like query over a CSV file with a header row.
+ *
+ * The grammar is:
+ *
+ *     SELECT * | item [, item ...]
+ *     [FROM name]                       -- ignored; the source is `path`
+ *     [WHERE expr]
+ *     [GROUP BY expr [, expr ...]]
+ *     [ORDER BY column [ASC | DESC] [, ...]]
+ *     [LIMIT n]
+ *
+ * An item is an expression (see csv_expr_t) or one of count(*), count(expr),
+ * sum(expr), avg(expr), min(expr) and max(expr), optionally followed by
+ * `AS name`. Non-aggregate items in a grouped query take their value from the
+ * first row of each group. ORDER BY names an output column by name or by
+ * 1-based position. Numeric output columns sort numerically, and so do text
+ * columns whose every value is a number.
+ *
+ * The file is streamed in batches. Lines are tokenized only up to the last
+ * column the query uses. WHERE runs on the raw field spans before anything
+ * is copied. Without ORDER BY or grouping, reading stops once LIMIT rows
+ * have been produced.
+ *
+ * @param path The CSV file.
+ * @param sql The query.
+ * @return The result (free with csv_free()), or NULL on a syntax or I/O error.
+ */
+csv_document_t* csv_query(const char* path, const char* sql);
+
+
+// -------------------------------------------------------------------------------------
+// Copy-on-Write Versions
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief A published document that readers snapshot and a single writer replaces.
+ */
+typedef struct {
+        void* current;      // Internal: the live csv_document_t.
+        long epoch;         // Internal: bumped on every publish.
+        long readers[2];    // Internal: active readers per epoch parity.
+} csv_versioned_t;
+
+/**
+ * @brief A reader's pinned view of a csv_versioned_t.
+ */
+typedef struct {
+        const csv_document_t* doc;  // The document version; valid until release.
+        long epoch;                 // Internal: the epoch the reader registered in.
+} csv_snapshot_t;
+
+/**
+ * @brief Creates a new document that shares every row of `base`.
+ *
+ * Rows are reference counted and never modified in place, so the copy costs
+ * one pointer per row. Use csv_set_row() and csv_append_row() to change the
+ * new version; `base` is unaffected.
+ *
+ * @param base The document to derive from.
+ * @return A new csv_document_t (free with csv_free()), or NULL on failure.
+ */
+csv_document_t* csv_derive(const csv_document_t* base);
+
+/**
+ * @brief Replaces a row of a document with a freshly allocated copy of `fields`.
+ *
+ * @param doc The document to modify. It must not be visible to readers yet.
+ * @param row The zero-based data row index.
+ * @param fields The new field strings, copied by the call.
+ * @param num_fields The number of entries in `fields`.
+ * @return 0 on success, -1 on failure.
+ */
+int csv_set_row(csv_document_t* doc, int row, const char* const* fields, int num_fields);
+
+/**
+ * @brief Appends a copy of `fields` as a new row.
+ *
+ * @param doc The document to modify. It must not be visible to readers yet.
+ * @param fields The field strings, copied by the call.
+ * @param num_fields The number of entries in `fields`.
+ * @return 0 on success, -1 on failure.
+ */
+int csv_append_row(csv_document_t* doc, const char* const* fields, int num_fields);
+
+/**
+ * @brief Creates a versioned handle whose first version is `initial`.
+ *
+ * @param initial The first version. The handle takes ownership.
+ * @return A new handle, or NULL on failure.
+ */
+csv_versioned_t* csv_versioned_create(csv_document_t* initial);
+
+/**
+ * @brief Pins the current version for reading. Never blocks.
+ *
+ * @param v The versioned handle.
+ * @return A snapshot whose `doc` stays valid until csv_snapshot_release().
+ */
+csv_snapshot_t csv_snapshot_acquire(csv_versioned_t* v);
+
+/**
+ * @brief Unpins a snapshot taken with csv_snapshot_acquire().
+ *
+ * @param v The versioned handle.
+ * @param snap The snapshot to release. Its `doc` is set to NULL.
+ */
+void csv_snapshot_release(csv_versioned_t* v, csv_snapshot_t* snap);
+
+/**
+ * @brief Makes `next` the current version and reclaims the previous one.
+ *
+ * New readers see `next` immediately. The call then waits until every reader
+ * still holding the previous version releases it, and frees it. Only one
+ * thread may publish at a time.
+ *
+ * @param v The versioned handle.
+ * @param next The new version, typically built with csv_derive(). The handle
+ * takes ownership.
+ */
+void csv_versioned_publish(csv_versioned_t* v, csv_document_t* next);
+
+/**
+ * @brief Frees a versioned handle and its current version.
+ *
+ * @param v_ptr A pointer to the csv_versioned_t* variable to free. No
+ * snapshots may be outstanding.
+ */
+void csv_versioned_free(csv_versioned_t** v_ptr);
+
+
+// -------------------------------------------------------------------------------------
+// Thread Pool & Executors
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief A fixed-size work-stealing thread pool.
+ */
+typedef struct csv_pool csv_pool_t;
+
+/**
+ * @brief Starts a thread pool.
+ *
+ * Each worker owns a deque: it pushes and pops its own tasks at one end and
+ * steals from the other end of its peers' deques when idle.
+ *
+ * @param num_threads The number of workers, or 0 for one per online CPU.
+ * @return A new pool, or NULL on failure.
+ */
+csv_pool_t* csv_pool_create(int num_threads);
+
+/**
+ * @brief Finishes all queued tasks, stops the workers and frees the pool.
+ *
+ * @param pool_ptr A pointer to the csv_pool_t* variable to free.
+ */
+void csv_pool_destroy(csv_pool_t** pool_ptr);
+
+/**
+ * @brief Returns the number of worker threads in the pool.
+ */
+int csv_pool_size(const csv_pool_t* pool);
+
+/**
+ * @brief Queues a single task. It runs on a worker at some later point.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int csv_pool_submit(csv_pool_t* pool, csv_task_fn fn, void* arg, int index);
+
+/**
+ * @brief Runs fn(arg, i) for i in [0, count) on the pool and waits for all.
+ *
+ * The calling thread helps run tasks while it waits, so this may be called
+ * from inside a pool task.
+ */
+void csv_pool_parallel_for(csv_pool_t* pool, int count, csv_task_fn fn, void* arg);
+
+/**
+ * @brief Returns an executor that runs work on `pool`.
+ */
+csv_executor_t csv_pool_executor(csv_pool_t* pool);
+
+/**
+ * @brief Runs fn(arg, i) for i in [0, count) on `exec`, or serially if it is NULL.
+ */
+void csv_parallel_for(const csv_executor_t* exec, int count, csv_task_fn fn, void* arg);
+
+/**
+ * @brief Frees a document in the background and returns immediately.
+ *
+ * The teardown is queued on `exec`, which also frees large documents in
+ * parallel row ranges. With a NULL executor a detached thread does the work.
+ * If neither can be started the document is freed before returning.
+ *
+ * @param doc_ptr A pointer to the csv_document_t* variable to free. It is set
+ * to NULL.
+ * @param exec The executor to run the teardown on, or NULL. It is copied, so
+ * it need not outlive the call.
+ */
+void csv_free_async(csv_document_t** doc_ptr, const csv_executor_t* exec);
+
+
+// -------------------------------------------------------------------------------------
+// CPU Feature Detection
+// -------------------------------------------------------------------------------------
+
+/**
+ * @brief Feature bits reported by csv_cpu_features().
+ */
+enum {
+        CSV_CPU_SSE42  = 1 << 0,    // SSE4.2 string instructions.
+        CSV_CPU_AVX2   = 1 << 1,    // AVX2 with OS support for YMM state.
+        CSV_CPU_AVX512 = 1 << 2,    // AVX-512F + AVX-512BW with OS support for ZMM state.
+        CSV_CPU_NEON   = 1 << 3     // ARM Advanced SIMD (always present on AArch64).
+};
+
+/**
+ * @brief Returns the SIMD features detected on the running CPU.
+ *
+ * @return A bitmask of CSV_CPU_* flags. Always 0 on targets without a SIMD
+ * kernel or when the library is built with CSVIEW_NO_SIMD.
+ */
+unsigned csv_cpu_features(void);
+
+/**
+ * @brief Returns the name of the tokenizer kernel selected for this process.
+ *
+ * @return A static string such as "avx2" or "swar".
+ */
+const char* csv_kernel_name(void);
+
+
+// -------------------------------------------------------------------------------------
+// Implementation
+// -------------------------------------------------------------------------------------
+
+#ifdef CSVIEW_IMPLEMENTATION
+
+#include <errno.h>
+#include <math.h>
+
+#ifdef _WIN32
+        #ifndef WIN32_LEAN_AND_MEAN
+                #define WIN32_LEAN_AND_MEAN
+        #endif
+        #include <windows.h>
+#else
+        #include <fcntl.h>
+        #include <pthread.h>
+        #include <sched.h>
+        #include <unistd.h>
+        // pwrite() needs POSIX.1-2008 or XSI; strict C99 builds fall back to stdio.
+        #if defined(_POSIX_VERSION) && (_POSIX_VERSION >= 200809L || (defined(_XOPEN_VERSION) && _XOPEN_VERSION >= 500))
+                #define _CSV_HAVE_PWRITE 1
+        #endif
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+        #include <intrin.h>
+#endif
+
+#if !defined(CSVIEW_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+        #define _CSV_X86 1
+        #include <immintrin.h>
+        #if defined(_MSC_VER) && !defined(__clang__)
+                #define _CSV_TARGET(isa)
+        #else
+                #include <cpuid.h>
+                #define _CSV_TARGET(isa) __attribute__((target(isa)))
+        #endif
+#endif
+
+#if !defined(CSVIEW_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64))
+        #define _CSV_NEON 1
+        #include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+        #define _CSV_LITTLE_ENDIAN 1
+#endif
+
+// Compilers without MSVC or GNU atomic builtins use C11 <stdatomic.h> when it
+// exists; with neither, the wrappers below are plain accesses and the library
+// is only safe to use from one thread.
+#if !defined(_MSC_VER) && !defined(__GNUC__) && !defined(__clang__) && !defined(__cplusplus) && \
+    defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+        #define _CSV_C11_ATOMICS 1
+        #include <stdatomic.h>
+#endif
+
+// -------------------------------------------------------------------------------------
+// Atomics
+// -------------------------------------------------------------------------------------
+
+// Minimal acquire/release wrappers used to publish lazily built structures.
+// MSVC's Interlocked intrinsics are full barriers, which is stronger than needed.
+// The C11 branch views plain objects through `_Atomic` pointers, which every
+// implementation with lock-free pointer and long atomics lays out identically.
+// The final #else branches are not atomic; see THREAD SAFETY.
+
+static inline
+void*
+_csv_atomic_load_ptr(void* const* p)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        return _InterlockedCompareExchangePointer((void* volatile*)p, NULL, NULL);
+#elif defined(__GNUC__) || defined(__clang__)
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#elif defined(_CSV_C11_ATOMICS)
+        return atomic_load_explicit((_Atomic(void*)*)p, memory_order_acquire);
+#else
+        return *(void* const volatile*)p;
+#endif
+}
+
+static inline
+void
+_csv_atomic_store_ptr(void** p,
+                      void* value)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        _InterlockedExchangePointer((void* volatile*)p, value);
+#elif defined(__GNUC__) || defined(__clang__)
+        __atomic_store_n(p, value, __ATOMIC_RELEASE);
+#elif defined(_CSV_C11_ATOMICS)
+        atomic_store_explicit((_Atomic(void*)*)p, value, memory_order_release);
+#else
+        *(void* volatile*)p = value;
+#endif
+}
+
+// Returns true if *p was `expected` and now holds `desired`.
+static inline
+bool
+_csv_atomic_cas_ptr(void** p,
+                    void* expected,
+                    void* desired)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        return _InterlockedCompareExchangePointer((void* volatile*)p, desired, expected) == expected;
+#elif defined(__GNUC__) || defined(__clang__)
+        return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#elif defined(_CSV_C11_ATOMICS)
+        return atomic_compare_exchange_strong_explicit((_Atomic(void*)*)p, &expected, desired,
+                                                       memory_order_acq_rel, memory_order_acquire);
+#else
+        if (*p != expected) {
+                return false;
+        }
+        *p = desired;
+        return true;
+#endif
+}
+
+// Sequentially consistent counter operations; fetch_add returns the old value.
+static inline
+long
+_csv_atomic_fetch_add_long(long* p,
+                           long delta)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        return _InterlockedExchangeAdd((long volatile*)p, delta);
+#elif defined(__GNUC__) || defined(__clang__)
+        return __atomic_fetch_add(p, delta, __ATOMIC_SEQ_CST);
+#elif defined(_CSV_C11_ATOMICS)
+        return atomic_fetch_add((_Atomic(long)*)p, delta);
+#else
+        long old = *p;
+        *p += delta;
+        return old;
+#endif
+}
+
+static inline
+long
+_csv_atomic_load_long(const long* p)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        return _InterlockedCompareExchange((long volatile*)p, 0, 0);
+#elif defined(__GNUC__) || defined(__clang__)
+        return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#elif defined(_CSV_C11_ATOMICS)
+        return atomic_load((_Atomic(long)*)p);
+#else
+        return *(const volatile long*)p;
+#endif
+}
+
+static inline
+void*
+_csv_atomic_exchange_ptr(void** p,
+                         void* value)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        return _InterlockedExchangePointer((void* volatile*)p, value);
+#elif defined(__GNUC__) || defined(__clang__)
+        return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+#elif defined(_CSV_C11_ATOMICS)
+        return atomic_exchange((_Atomic(void*)*)p, value);
+#else
+        void* old = *p;
+        *p = value;
+        return old;
+#endif
+}
+
+// Gives up the rest of the time slice while a writer waits on readers.
+static
+void
+_csv_yield(void)
+{
+#ifdef _WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+}
+
+// -------------------------------------------------------------------------------------
+// Threads
+// -------------------------------------------------------------------------------------
+
+#if defined(_MSC_VER) && !defined(__clang__)
+        #define _CSV_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+        #define _CSV_THREAD_LOCAL __thread
+#else
+        #define _CSV_THREAD_LOCAL _Thread_local
+#endif
+
+#ifdef _WIN32
+typedef HANDLE _csv_thread_t;
+typedef SRWLOCK _csv_mutex_t;
+typedef CONDITION_VARIABLE _csv_cond_t;
+#else
+typedef pthread_t _csv_thread_t;
+typedef pthread_mutex_t _csv_mutex_t;
+typedef pthread_cond_t _csv_cond_t;
+#endif
+
+typedef void (*_csv_thread_fn)(void* arg);
+
+typedef struct {
+        _csv_thread_fn fn;
+        void* arg;
+} _csv_thread_start_t;
+
+#ifdef _WIN32
+static
+DWORD WINAPI
+_csv_thread_entry(LPVOID param)
+#else
+static
+void*
+_csv_thread_entry(void* param)
+#endif
+{
+        _csv_thread_start_t start = *(_csv_thread_start_t*)param;
+        free(param);
+        start.fn(start.arg);
+        return 0;
+}
+
+static
+int
+_csv_thread_create(_csv_thread_t* thread,
+                   _csv_thread_fn fn,
+                   void* arg)
+{
+        _csv_thread_start_t* start = (_csv_thread_start_t*)malloc(sizeof(_csv_thread_start_t));
+        if (!start) {
+                return -1;
+        }
+        start->fn = fn;
+        start->arg = arg;
+#ifdef _WIN32
+        *thread = CreateThread(NULL, 0, _csv_thread_entry, start, 0, NULL);
+        if (!*thread) {
+                free(start);
+                return -1;
+        }
+#else
+        if (pthread_create(thread, NULL, _csv_thread_entry, start) != 0) {
+                free(start);
+                return -1;
+        }
+#endif
+        return 0;
+}
+
+static
+void
+_csv_thread_join(_csv_thread_t thread)
+{
+#ifdef _WIN32
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+#else
+        pthread_join(thread, NULL);
+#endif
+}
+
+// Lets a thread run to completion without anyone joining it.
+static
+void
+_csv_thread_detach(_csv_thread_t thread)
+{
+#ifdef _WIN32
+        CloseHandle(thread);
+#else
+        pthread_detach(thread);
+#endif
+}
+
+static
+void
+_csv_mutex_init(_csv_mutex_t* m)
+{
+#ifdef _WIN32
+        InitializeSRWLock(m);
+#else
+        pthread_mutex_init(m, NULL);
+#endif
+}
+
+static
+void
+_csv_mutex_destroy(_csv_mutex_t* m)
+{
+#ifdef _WIN32
+        (void)m;
+#else
+        pthread_mutex_destroy(m);
+#endif
+}
+
+static
+void
+_csv_mutex_lock(_csv_mutex_t* m)
+{
+#ifdef _WIN32
+        AcquireSRWLockExclusive(m);
+#else
+        pthread_mutex_lock(m);
+#endif
+}
+
+static
+void
+_csv_mutex_unlock(_csv_mutex_t* m)
+{
+#ifdef _WIN32
+        ReleaseSRWLockExclusive(m);
+#else
+        pthread_mutex_unlock(m);
+#endif
+}
+
+static
+void
+_csv_cond_init(_csv_cond_t* c)
+{
+#ifdef _WIN32
+        InitializeConditionVariable(c);
+#else
+        pthread_cond_init(c, NULL);
+#endif
+}
+
+static
+void
+_csv_cond_destroy(_csv_cond_t* c)
+{
+#ifdef _WIN32
+        (void)c;
+#else
+        pthread_cond_destroy(c);
+#endif
+}
+
+static
+void
+_csv_cond_wait(_csv_cond_t* c,
+               _csv_mutex_t* m)
+{
+#ifdef _WIN32
+        SleepConditionVariableSRW(c, m, INFINITE, 0);
+#else
+        pthread_cond_wait(c, m);
+#endif
+}
+
+static
+void
+_csv_cond_signal(_csv_cond_t* c)
+{
+#ifdef _WIN32
+        WakeConditionVariable(c);
+#else
+        pthread_cond_signal(c);
+#endif
+}
+
+static
+void
+_csv_cond_broadcast(_csv_cond_t* c)
+{
+#ifdef _WIN32
+        WakeAllConditionVariable(c);
+#else
+        pthread_cond_broadcast(c);
+#endif
+}
+
+static
+int
+_csv_cpu_count(void)
+{
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (int)info.dwNumberOfProcessors;
+#else
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? (int)n : 1;
+#endif
+}
+
+// -------------------------------------------------------------------------------------
+// Kernel Dispatch
+// -------------------------------------------------------------------------------------
+
+// A find kernel returns a pointer to the first byte equal to `c` in [p, end),
+// or `end` when there is none.
+typedef const char* (*_csv_find_fn)(const char* p, const char* end, char c);
+
+// Running totals for the aggregate scan kernels.
+typedef struct {
+        int count;
+        double sum;
+        double min;
+        double max;
+        uint64_t int_sum;   // Unsigned so overflow wraps instead of being undefined.
+        int64_t int_min;
+        int64_t int_max;
+} _csv_agg_acc_t;
+
+// Aggregate kernels fold `n` valid values into `acc`. Compare kernels set bit
+// i % 64 of masks[i / 64] for every i in [0, n) where `v[i] op t` holds.
+typedef void (*_csv_agg_f64_fn)(const double* v, int n, _csv_agg_acc_t* acc);
+typedef void (*_csv_agg_i64_fn)(const int64_t* v, int n, _csv_agg_acc_t* acc);
+typedef void (*_csv_cmp_f64_fn)(const double* v, int n, csv_cmp_t op, double t, uint64_t* masks);
+typedef void (*_csv_cmp_i64_fn)(const int64_t* v, int n, csv_cmp_t op, int64_t t, uint64_t* masks);
+
+typedef struct {
+        const char* name;
+        _csv_find_fn find;
+        _csv_agg_f64_fn agg_f64;
+        _csv_agg_i64_fn agg_i64;
+        _csv_cmp_f64_fn cmp_f64;
+        _csv_cmp_i64_fn cmp_i64;
+} _csv_kernel_t;
+
+static inline
+int
+_csv_ctz32(uint32_t x)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long idx;
+        _BitScanForward(&idx, x);
+        return (int)idx;
+#elif defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctz(x);
+#else
+        int n = 0;
+        while (!(x & 1u)) {
+                x >>= 1;
+                n++;
+        }
+        return n;
+#endif
+}
+
+static inline
+int
+_csv_ctz64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(x);
+#else
+        if ((uint32_t)x) {
+                return _csv_ctz32((uint32_t)x);
+        }
+        return _csv_ctz32((uint32_t)(x >> 32)) + 32;
+#endif
+}
+
+static
+const char*
+_csv_find_scalar(const char* p,
+                 const char* end,
+                 char c)
+{
+        while (p < end && *p != c) {
+                p++;
+        }
+        return p;
+}
+
+// SWAR ("SIMD within a register") kernel: compares eight bytes per step using
+// the classic has-zero-byte trick on `word ^ pattern`. The lowest flagged byte
+// is always a true match, so on little-endian targets its index is ctz / 8.
+static
+const char*
+_csv_find_swar(const char* p,
+               const char* end,
+               char c)
+{
+        const uint64_t ones = 0x0101010101010101ULL;
+        const uint64_t highs = 0x8080808080808080ULL;
+        const uint64_t pattern = ones * (uint8_t)c;
+
+        while (end - p >= 8) {
+                uint64_t word;
+                memcpy(&word, p, sizeof(word));
+                uint64_t x = word ^ pattern;
+                uint64_t hit = (x - ones) & ~x & highs;
+                if (hit) {
+#ifdef _CSV_LITTLE_ENDIAN
+                        return p + (_csv_ctz64(hit) >> 3);
+#else
+                        return _csv_find_scalar(p, p + 8, c);
+#endif
+                }
+                p += 8;
+        }
+        return _csv_find_scalar(p, end, c);
+}
+
+#ifdef _CSV_X86
+
+static
+void
+_csv_cpuid(unsigned leaf,
+           unsigned subleaf,
+           unsigned regs[4])
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        int r[4];
+        __cpuidex(r, (int)leaf, (int)subleaf);
+        for (int i = 0; i < 4; i++) {
+                regs[i] = (unsigned)r[i];
+        }
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static
+uint64_t
+_csv_xgetbv(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        return _xgetbv(0);
+#else
+        uint32_t eax, edx;
+        __asm__ volatile (".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+_CSV_TARGET("sse4.2")
+static
+const char*
+_csv_find_sse42(const char* p,
+                const char* end,
+                char c)
+{
+        const __m128i needle = _mm_set1_epi8(c);
+        while (end - p >= 16) {
+                __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+                int idx = _mm_cmpestri(needle, 1, chunk, 16,
+                                       _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+                if (idx < 16) {
+                        return p + idx;
+                }
+                p += 16;
+        }
+        return _csv_find_swar(p, end, c);
+}
+
+_CSV_TARGET("avx2")
+static
+const char*
+_csv_find_avx2(const char* p,
+               const char* end,
+               char c)
+{
+        const __m256i needle = _mm256_set1_epi8(c);
+        while (end - p >= 32) {
+                __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+                uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+                if (mask) {
+                        return p + _csv_ctz32(mask);
+                }
+                p += 32;
+        }
+        return _csv_find_swar(p, end, c);
+}
+
+_CSV_TARGET("avx512f,avx512bw")
+static
+const char*
+_csv_find_avx512(const char* p,
+                 const char* end,
+                 char c)
+{
+        const __m512i needle = _mm512_set1_epi8(c);
+        while (end - p >= 64) {
+                __m512i chunk = _mm512_loadu_si512((const void*)p);
+                uint64_t mask = (uint64_t)_mm512_cmpeq_epi8_mask(chunk, needle);
+                if (mask) {
+                        return p + _csv_ctz64(mask);
+                }
+                p += 64;
+        }
+        return _csv_find_swar(p, end, c);
+}
+
+#endif // _CSV_X86
+
+#ifdef _CSV_NEON
+
+// NEON has no movemask, so the 16 compare lanes are narrowed to a 64-bit
+// mask with 4 bits per byte (vshrn by 4); ctz / 4 is then the byte index.
+static
+const char*
+_csv_find_neon(const char* p,
+               const char* end,
+               char c)
+{
+        const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+        while (end - p >= 16) {
+                uint8x16_t chunk = vld1q_u8((const uint8_t*)p);
+                uint8x16_t eq = vceqq_u8(chunk, needle);
+                uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+                uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+                if (mask) {
+#ifdef _CSV_LITTLE_ENDIAN
+                        return p + (_csv_ctz64(mask) >> 2);
+#else
+                        return _csv_find_scalar(p, p + 16, c);
+#endif
+                }
+                p += 16;
+        }
+        return _csv_find_swar(p, end, c);
+}
+
+#endif // _CSV_NEON
+
+unsigned
+csv_cpu_features(void)
+{
+        unsigned features = 0;
+#ifdef _CSV_X86
+        unsigned regs[4];
+        _csv_cpuid(0, 0, regs);
+        unsigned max_leaf = regs[0];
+        if (max_leaf < 1) {
+                return 0;
+        }
+
+        _csv_cpuid(1, 0, regs);
+        if (regs[2] & (1u << 20)) {
+                features |= CSV_CPU_SSE42;
+        }
+
+        // AVX state must be enabled by the OS (OSXSAVE + XCR0) before YMM/ZMM use.
+        bool osxsave = (regs[2] & (1u << 27)) && (regs[2] & (1u << 28));
+        if (!osxsave || max_leaf < 7) {
+                return features;
+        }
+        uint64_t xcr0 = _csv_xgetbv();
+        bool ymm_ok = (xcr0 & 0x06) == 0x06;
+        bool zmm_ok = (xcr0 & 0xE6) == 0xE6;
+
+        _csv_cpuid(7, 0, regs);
+        if (ymm_ok && (regs[1] & (1u << 5))) {
+                features |= CSV_CPU_AVX2;
+        }
+        if (zmm_ok && (regs[1] & (1u << 16)) && (regs[1] & (1u << 30))) {
+                features |= CSV_CPU_AVX512;
+        }
+#endif
+#ifdef _CSV_NEON
+        // NEON is part of the AArch64 baseline; on 32-bit ARM it is only used
+        // when the compiler was told the target has it (-mfpu=neon).
+        features |= CSV_CPU_NEON;
+#endif
+        return features;
+}
+
+// -------------------------------------------------------------------------------------
+// Column Scan Kernels
+// -------------------------------------------------------------------------------------
+
+static
+void
+_csv_agg_f64_scalar(const double* v,
+                    int n,
+                    _csv_agg_acc_t* acc)
+{
+        // Four independent lanes so the compiler can keep them in one vector.
+        double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+        double lo = acc->min;
+        double hi = acc->max;
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+                for (int k = 0; k < 4; k++) {
+                        double x = v[i + k];
+                        sum[k] += x;
+                        lo = x < lo ? x : lo;
+                        hi = x > hi ? x : hi;
+                }
+        }
+        for (; i < n; i++) {
+                sum[0] += v[i];
+                lo = v[i] < lo ? v[i] : lo;
+                hi = v[i] > hi ? v[i] : hi;
+        }
+        acc->sum += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+        acc->min = lo;
+        acc->max = hi;
+        acc->count += n;
+}
+
+static
+void
+_csv_agg_i64_scalar(const int64_t* v,
+                    int n,
+                    _csv_agg_acc_t* acc)
+{
+        uint64_t sum = 0;
+        int64_t lo = acc->int_min;
+        int64_t hi = acc->int_max;
+        for (int i = 0; i < n; i++) {
+                sum += (uint64_t)v[i];
+                lo = v[i] < lo ? v[i] : lo;
+                hi = v[i] > hi ? v[i] : hi;
+        }
+        acc->int_sum += sum;
+        acc->int_min = lo;
+        acc->int_max = hi;
+        acc->count += n;
+}
+
+// Expands to one branch-free loop per operator so the compare is hoisted.
+#define _CSV_CMP_SCALAR_LOOPS(v, n, op, t, masks)                                               \
+        switch (op) {                                                                           \
+        case CSV_CMP_EQ: for (int i = 0; i < n; i++) masks[i >> 6] |= (uint64_t)(v[i] == t) << (i & 63); break; \
+        case CSV_CMP_NE: for (int i = 0; i < n; i++) masks[i >> 6] |= (uint64_t)(v[i] != t) << (i & 63); break; \
+        case CSV_CMP_LT: for (int i = 0; i < n; i++) masks[i >> 6] |= (uint64_t)(v[i] < t) << (i & 63); break;  \
+        case CSV_CMP_LE: for (int i = 0; i < n; i++) masks[i >> 6] |= (uint64_t)(v[i] <= t) << (i & 63); break; \
+        case CSV_CMP_GT: for (int i = 0; i < n; i++) masks[i >> 6] |= (uint64_t)(v[i] > t) << (i & 63); break;  \
+        case CSV_CMP_GE: for (int i = 0; i < n; i++) masks[i >> 6] |= (uint64_t)(v[i] >= t) << (i & 63); break; \
+        }
+
+static
+void
+_csv_cmp_f64_scalar(const double* v,
+                    int n,
+                    csv_cmp_t op,
+                    double t,
+                    uint64_t* masks)
+{
+        memset(masks, 0, ((size_t)n + 63) / 64 * sizeof(uint64_t));
+        _CSV_CMP_SCALAR_LOOPS(v, n, op, t, masks)
+}
+
+static
+void
+_csv_cmp_i64_scalar(const int64_t* v,
+                    int n,
+                    csv_cmp_t op,
+                    int64_t t,
+                    uint64_t* masks)
+{
+        memset(masks, 0, ((size_t)n + 63) / 64 * sizeof(uint64_t));
+        _CSV_CMP_SCALAR_LOOPS(v, n, op, t, masks)
+}
+
+#ifdef _CSV_X86
+
+_CSV_TARGET("avx2")
+static
+void
+_csv_agg_f64_avx2(const double* v,
+                  int n,
+                  _csv_agg_acc_t* acc)
+{
+        __m256d sum = _mm256_setzero_pd();
+        __m256d lo = _mm256_set1_pd(acc->min);
+        __m256d hi = _mm256_set1_pd(acc->max);
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+                __m256d x = _mm256_loadu_pd(v + i);
+                sum = _mm256_add_pd(sum, x);
+                lo = _mm256_min_pd(lo, x);
+                hi = _mm256_max_pd(hi, x);
+        }
+        double s[4], l[4], h[4];
+        _mm256_storeu_pd(s, sum);
+        _mm256_storeu_pd(l, lo);
+        _mm256_storeu_pd(h, hi);
+        acc->sum += (s[0] + s[1]) + (s[2] + s[3]);
+        for (int k = 0; k < 4; k++) {
+                acc->min = l[k] < acc->min ? l[k] : acc->min;
+                acc->max = h[k] > acc->max ? h[k] : acc->max;
+        }
+        acc->count += i;
+        _csv_agg_f64_scalar(v + i, n - i, acc);
+}
+
+_CSV_TARGET("avx2")
+static
+void
+_csv_agg_i64_avx2(const int64_t* v,
+                  int n,
+                  _csv_agg_acc_t* acc)
+{
+        __m256i sum = _mm256_setzero_si256();
+        __m256i lo = _mm256_set1_epi64x(acc->int_min);
+        __m256i hi = _mm256_set1_epi64x(acc->int_max);
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+                __m256i x = _mm256_loadu_si256((const __m256i*)(v + i));
+                sum = _mm256_add_epi64(sum, x);
+                lo = _mm256_blendv_epi8(lo, x, _mm256_cmpgt_epi64(lo, x));
+                hi = _mm256_blendv_epi8(hi, x, _mm256_cmpgt_epi64(x, hi));
+        }
+        int64_t s[4], l[4], h[4];
+        _mm256_storeu_si256((__m256i*)s, sum);
+        _mm256_storeu_si256((__m256i*)l, lo);
+        _mm256_storeu_si256((__m256i*)h, hi);
+        for (int k = 0; k < 4; k++) {
+                acc->int_sum += (uint64_t)s[k];
+                acc->int_min = l[k] < acc->int_min ? l[k] : acc->int_min;
+                acc->int_max = h[k] > acc->int_max ? h[k] : acc->int_max;
+        }
+        acc->count += i;
+        _csv_agg_i64_scalar(v + i, n - i, acc);
+}
+
+_CSV_TARGET("avx2")
+static
+void
+_csv_cmp_f64_avx2(const double* v,
+                  int n,
+                  csv_cmp_t op,
+                  double t,
+                  uint64_t* masks)
+{
+        memset(masks, 0, ((size_t)n + 63) / 64 * sizeof(uint64_t));
+        const __m256d tv = _mm256_set1_pd(t);
+        int i = 0;
+        // The predicate must be an immediate, so each operator gets its own loop.
+        #define _CSV_CMP_PD_LOOP(pred)                                                          \
+                for (; i + 4 <= n; i += 4) {                                                    \
+                        __m256d m = _mm256_cmp_pd(_mm256_loadu_pd(v + i), tv, pred);            \
+                        masks[i >> 6] |= (uint64_t)_mm256_movemask_pd(m) << (i & 63);           \
+                }
+        switch (op) {
+        case CSV_CMP_EQ: _CSV_CMP_PD_LOOP(_CMP_EQ_OQ) break;
+        case CSV_CMP_NE: _CSV_CMP_PD_LOOP(_CMP_NEQ_UQ) break;
+        case CSV_CMP_LT: _CSV_CMP_PD_LOOP(_CMP_LT_OQ) break;
+        case CSV_CMP_LE: _CSV_CMP_PD_LOOP(_CMP_LE_OQ) break;
+        case CSV_CMP_GT: _CSV_CMP_PD_LOOP(_CMP_GT_OQ) break;
+        case CSV_CMP_GE: _CSV_CMP_PD_LOOP(_CMP_GE_OQ) break;
+        }
+        #undef _CSV_CMP_PD_LOOP
+        for (; i < n; i++) {
+                double x = v[i];
+                bool hit = false;
+                switch (op) {
+                case CSV_CMP_EQ: hit = x == t; break;
+                case CSV_CMP_NE: hit = x != t; break;
+                case CSV_CMP_LT: hit = x < t; break;
+                case CSV_CMP_LE: hit = x <= t; break;
+                case CSV_CMP_GT: hit = x > t; break;
+                case CSV_CMP_GE: hit = x >= t; break;
+                }
+                masks[i >> 6] |= (uint64_t)hit << (i & 63);
+        }
+}
+
+_CSV_TARGET("avx2")
+static
+void
+_csv_cmp_i64_avx2(const int64_t* v,
+                  int n,
+                  csv_cmp_t op,
+                  int64_t t,
+                  uint64_t* masks)
+{
+        memset(masks, 0, ((size_t)n + 63) / 64 * sizeof(uint64_t));
+        const __m256i tv = _mm256_set1_epi64x(t);
+        // AVX2 only has == and >, so the other operators swap or negate them.
+        bool swap = op == CSV_CMP_LT || op == CSV_CMP_GE;
+        bool equal = op == CSV_CMP_EQ || op == CSV_CMP_NE;
+        unsigned invert = (op == CSV_CMP_NE || op == CSV_CMP_LE || op == CSV_CMP_GE) ? 0xF : 0;
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+                __m256i x = _mm256_loadu_si256((const __m256i*)(v + i));
+                __m256i m = equal ? _mm256_cmpeq_epi64(x, tv)
+                          : swap ? _mm256_cmpgt_epi64(tv, x)
+                          : _mm256_cmpgt_epi64(x, tv);
+                unsigned bits = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(m)) ^ invert;
+                masks[i >> 6] |= (uint64_t)bits << (i & 63);
+        }
+        for (; i < n; i++) {
+                int64_t x = v[i];
+                bool hit = false;
+                switch (op) {
+                case CSV_CMP_EQ: hit = x == t; break;
+                case CSV_CMP_NE: hit = x != t; break;
+                case CSV_CMP_LT: hit = x < t; break;
+                case CSV_CMP_LE: hit = x <= t; break;
+                case CSV_CMP_GT: hit = x > t; break;
+                case CSV_CMP_GE: hit = x >= t; break;
+                }
+                masks[i >> 6] |= (uint64_t)hit << (i & 63);
+        }
+}
+
+#endif // _CSV_X86
+
+#define _CSV_SCAN_SCALAR _csv_agg_f64_scalar, _csv_agg_i64_scalar, _csv_cmp_f64_scalar, _csv_cmp_i64_scalar
+#define _CSV_SCAN_AVX2 _csv_agg_f64_avx2, _csv_agg_i64_avx2, _csv_cmp_f64_avx2, _csv_cmp_i64_avx2
+
+static const _csv_kernel_t _csv_kernel_swar = { "swar", _csv_find_swar, _CSV_SCAN_SCALAR };
+#ifdef _CSV_X86
+static const _csv_kernel_t _csv_kernel_sse42 = { "sse4.2", _csv_find_sse42, _CSV_SCAN_SCALAR };
+static const _csv_kernel_t _csv_kernel_avx2 = { "avx2", _csv_find_avx2, _CSV_SCAN_AVX2 };
+static const _csv_kernel_t _csv_kernel_avx512 = { "avx512", _csv_find_avx512, _CSV_SCAN_AVX2 };
+#endif
+#ifdef _CSV_NEON
+static const _csv_kernel_t _csv_kernel_neon = { "neon", _csv_find_neon, _CSV_SCAN_SCALAR };
+#endif
+
+// Picks the best kernel for the running CPU. Only called on first use.
+static
+const _csv_kernel_t*
+_csv_select_kernel(void)
+{
+        const _csv_kernel_t* kernel = &_csv_kernel_swar;
+#ifdef _CSV_X86
+        unsigned features = csv_cpu_features();
+        if (features & CSV_CPU_AVX512) {
+                kernel = &_csv_kernel_avx512;
+        } else if (features & CSV_CPU_AVX2) {
+                kernel = &_csv_kernel_avx2;
+        } else if (features & CSV_CPU_SSE42) {
+                kernel = &_csv_kernel_sse42;
+        }
+#endif
+#ifdef _CSV_NEON
+        if (csv_cpu_features() & CSV_CPU_NEON) {
+                kernel = &_csv_kernel_neon;
+        }
+#endif
+        return kernel;
+}
+
+static const _csv_kernel_t* _csv_kernel = NULL;
+
+// Racing first callers all compute the same answer, so a plain atomic store
+// is enough to publish it; later calls are a single acquire load.
+static
+const _csv_kernel_t*
+_csv_get_kernel(void)
+{
+        const _csv_kernel_t* kernel = (const _csv_kernel_t*)_csv_atomic_load_ptr((void* const*)&_csv_kernel);
+        if (!kernel) {
+                kernel = _csv_select_kernel();
+                _csv_atomic_store_ptr((void**)&_csv_kernel, (void*)kernel);
+        }
+        return kernel;
+}
+
+const char*
+csv_kernel_name(void)
+{
+        return _csv_get_kernel()->name;
+}
+
+// -------------------------------------------------------------------------------------
+// Hash Table
+// -------------------------------------------------------------------------------------
+
+// Open-addressing multimap from 64-bit hashes to integer payloads. It stores
+// only hashes, so callers verify candidates against their own data. A hash of
+// 0 marks an empty slot; _csv_htab_key() remaps real hashes away from it.
+typedef struct {
+        uint64_t* hashes;
+        int64_t* values;
+        size_t cap;         // Always a power of two.
+        size_t count;
+} _csv_htab_t;
+
+// XXH64. Input is read as little-endian so hashes match across platforms.
+#define _CSV_XXH_P1 0x9E3779B185EBCA87ULL
+#define _CSV_XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define _CSV_XXH_P3 0x165667B19E3779F9ULL
+#define _CSV_XXH_P4 0x85EBCA77C2B2AE63ULL
+#define _CSV_XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline
+uint64_t
+_csv_rotl64(uint64_t x,
+            int r)
+{
+        return (x << r) | (x >> (64 - r));
+}
+
+static inline
+uint64_t
+_csv_read_le64(const unsigned char* p)
+{
+#ifdef _CSV_LITTLE_ENDIAN
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+#else
+        return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+               (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+#endif
+}
+
+static inline
+uint32_t
+_csv_read_le32(const unsigned char* p)
+{
+        return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline
+uint64_t
+_csv_xxh_round(uint64_t acc,
+               uint64_t input)
+{
+        acc += input * _CSV_XXH_P2;
+        return _csv_rotl64(acc, 31) * _CSV_XXH_P1;
+}
+
+// Folds one 64-bit value into a running hash, order-sensitively.
+static inline
+uint64_t
+_csv_xxh_fold(uint64_t h,
+              uint64_t value)
+{
+        h ^= _csv_xxh_round(0, value);
+        return _csv_rotl64(h, 27) * _CSV_XXH_P1 + _CSV_XXH_P4;
+}
+
+static inline
+uint64_t
+_csv_xxh_avalanche(uint64_t h)
+{
+        h ^= h >> 33;
+        h *= _CSV_XXH_P2;
+        h ^= h >> 29;
+        h *= _CSV_XXH_P3;
+        h ^= h >> 32;
+        return h;
+}
+
+static
+uint64_t
+_csv_hash_bytes(const void* data,
+                size_t len,
+                uint64_t seed)
+{
+        const unsigned char* p = (const unsigned char*)data;
+        const unsigned char* end = p + len;
+        uint64_t h;
+
+        if (len >= 32) {
+                uint64_t v1 = seed + _CSV_XXH_P1 + _CSV_XXH_P2;
+                uint64_t v2 = seed + _CSV_XXH_P2;
+                uint64_t v3 = seed;
+                uint64_t v4 = seed - _CSV_XXH_P1;
+                do {
+                        v1 = _csv_xxh_round(v1, _csv_read_le64(p));
+                        v2 = _csv_xxh_round(v2, _csv_read_le64(p + 8));
+                        v3 = _csv_xxh_round(v3, _csv_read_le64(p + 16));
+                        v4 = _csv_xxh_round(v4, _csv_read_le64(p + 24));
+                        p += 32;
+                } while (end - p >= 32);
+                h = _csv_rotl64(v1, 1) + _csv_rotl64(v2, 7) + _csv_rotl64(v3, 12) + _csv_rotl64(v4, 18);
+                h = (h ^ _csv_xxh_round(0, v1)) * _CSV_XXH_P1 + _CSV_XXH_P4;
+                h = (h ^ _csv_xxh_round(0, v2)) * _CSV_XXH_P1 + _CSV_XXH_P4;
+                h = (h ^ _csv_xxh_round(0, v3)) * _CSV_XXH_P1 + _CSV_XXH_P4;
+                h = (h ^ _csv_xxh_round(0, v4)) * _CSV_XXH_P1 + _CSV_XXH_P4;
+        } else {
+                h = seed + _CSV_XXH_P5;
+        }
+        h += (uint64_t)len;
+
+        while (end - p >= 8) {
+                h = _csv_xxh_fold(h, _csv_read_le64(p));
+                p += 8;
+        }
+        if (end - p >= 4) {
+                h ^= (uint64_t)_csv_read_le32(p) * _CSV_XXH_P1;
+                h = _csv_rotl64(h, 23) * _CSV_XXH_P2 + _CSV_XXH_P3;
+                p += 4;
+        }
+        while (p < end) {
+                h ^= (uint64_t)*p * _CSV_XXH_P5;
+                h = _csv_rotl64(h, 11) * _CSV_XXH_P1;
+                p++;
+        }
+        return _csv_xxh_avalanche(h);
+}
+
+static inline
+uint64_t
+_csv_htab_key(uint64_t hash)
+{
+        return hash ? hash : 1;
+}
+
+static
+bool
+_csv_htab_init(_csv_htab_t* t,
+               size_t expected)
+{
+        size_t cap = 16;
+        while (cap < expected * 2) {
+                cap *= 2;
+        }
+        t->hashes = (uint64_t*)calloc(cap, sizeof(uint64_t));
+        t->values = (int64_t*)malloc(cap * sizeof(int64_t));
+        t->cap = cap;
+        t->count = 0;
+        if (!t->hashes || !t->values) {
+                free(t->hashes);
+                free(t->values);
+                t->hashes = NULL;
+                t->values = NULL;
+                return false;
+        }
+        return true;
+}
+
+static
+void
+_csv_htab_free(_csv_htab_t* t)
+{
+        free(t->hashes);
+        free(t->values);
+        t->hashes = NULL;
+        t->values = NULL;
+        t->cap = 0;
+        t->count = 0;
+}
+
+static
+bool
+_csv_htab_insert(_csv_htab_t* t,
+                 uint64_t hash,
+                 int64_t value)
+{
+        if ((t->count + 1) * 2 > t->cap) {
+                _csv_htab_t grown;
+                if (!_csv_htab_init(&grown, t->cap)) {
+                        return false;
+                }
+                // Walk round from an empty slot (the table is at most half full),
+                // so clusters that wrap past the end keep their insertion order.
+                size_t mask = t->cap - 1;
+                size_t start = 0;
+                while (t->hashes[start]) {
+                        start++;
+                }
+                for (size_t k = 1; k <= t->cap; k++) {
+                        size_t i = (start + k) & mask;
+                        if (t->hashes[i]) {
+                                _csv_htab_insert(&grown, t->hashes[i], t->values[i]);
+                        }
+                }
+                _csv_htab_free(t);
+                *t = grown;
+        }
+        hash = _csv_htab_key(hash);
+        size_t mask = t->cap - 1;
+        size_t i = (size_t)hash & mask;
+        while (t->hashes[i]) {
+                i = (i + 1) & mask;
+        }
+        t->hashes[i] = hash;
+        t->values[i] = value;
+        t->count++;
+        return true;
+}
+
+// Starts a probe for `hash`; pass the returned cursor to _csv_htab_next().
+static inline
+size_t
+_csv_htab_probe(const _csv_htab_t* t,
+                uint64_t hash)
+{
+        return (size_t)_csv_htab_key(hash) & (t->cap - 1);
+}
+
+// Returns the next payload stored under `hash`, in insertion order, or NULL
+// once the probe sequence reaches an empty slot.
+static
+int64_t*
+_csv_htab_next(const _csv_htab_t* t,
+               uint64_t hash,
+               size_t* cursor)
+{
+        hash = _csv_htab_key(hash);
+        size_t mask = t->cap - 1;
+        while (t->hashes[*cursor]) {
+                size_t i = *cursor;
+                *cursor = (i + 1) & mask;
+                if (t->hashes[i] == hash) {
+                        return &t->values[i];
+                }
+        }
+        return NULL;
+}
+
+// -------------------------------------------------------------------------------------
+// Byte Buffer
+// -------------------------------------------------------------------------------------
+
+typedef struct {
+        char* data;
+        size_t len;
+        size_t cap;
+} _csv_buf_t;
+
+static
+bool
+_csv_buf_reserve(_csv_buf_t* buf,
+                 size_t extra)
+{
+        if (buf->len + extra <= buf->cap) {
+                return true;
+        }
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap < buf->len + extra) {
+                cap *= 2;
+        }
+        char* data = (char*)realloc(buf->data, cap);
+        if (!data) {
+                return false;
+        }
+        buf->data = data;
+        buf->cap = cap;
+        return true;
+}
+
+static
+bool
+_csv_buf_append(_csv_buf_t* buf,
+                const char* bytes,
+                size_t len)
+{
+        if (len == 0) {
+                return true;
+        }
+        if (!_csv_buf_reserve(buf, len)) {
+                return false;
+        }
+        memcpy(buf->data + buf->len, bytes, len);
+        buf->len += len;
+        return true;
+}
+
+static
+void
+_csv_buf_free(_csv_buf_t* buf)
+{
+        free(buf->data);
+        buf->data = NULL;
+        buf->len = 0;
+        buf->cap = 0;
+}
+
+// Appends one record in csv_write()'s format: fields joined by ',' plus '\n'.
+static
+bool
+_csv_buf_append_record(_csv_buf_t* buf,
+                       char* const* fields,
+                       int num_fields)
+{
+        for (int i = 0; i < num_fields; i++) {
+                if (i > 0 && !_csv_buf_append(buf, ",", 1)) {
+                        return false;
+                }
+                if (!_csv_buf_append(buf, fields[i], strlen(fields[i]))) {
+                        return false;
+                }
+        }
+        return _csv_buf_append(buf, "\n", 1);
+}
+
+// Grows `*array` (of `size`-byte elements) to hold one more than `count`.
+static
+bool
+_csv_grow(void** array,
+          int count,
+          size_t size)
+{
+        void* grown = realloc(*array, (size_t)(count + 1) * size);
+        if (grown) {
+                *array = grown;
+        }
+        return grown != NULL;
+}
+
+// strdup() is POSIX, not C99.
+static
+char*
+_csv_strdup(const char* str)
+{
+        size_t len = strlen(str) + 1;
+        char* copy = (char*)malloc(len);
+        if (copy) {
+                memcpy(copy, str, len);
+        }
+        return copy;
+}
+
+// Reads one line of any length into `buf` as a NUL-terminated string with the
+// line ending (and anything after a stray '\r') removed. Returns the number of
+// bytes consumed, line ending included, or 0 at EOF.
+static
+size_t
+_csv_read_line(FILE* file,
+               _csv_buf_t* buf)
+{
+        buf->len = 0;
+        for (;;) {
+                if (!_csv_buf_reserve(buf, 256)) {
+                        return 0;
+                }
+                char* chunk = buf->data + buf->len;
+                int room = (int)(buf->cap - buf->len < 1 << 20 ? buf->cap - buf->len : 1 << 20);
+                if (!fgets(chunk, room, file)) {
+                        if (buf->len == 0) {
+                                return 0;
+                        }
+                        break;
+                }
+                size_t n = strlen(chunk);
+                buf->len += n;
+                if (n > 0 && chunk[n - 1] == '\n') {
+                        break;
+                }
+        }
+        size_t consumed = buf->len;
+        buf->len = strcspn(buf->data, "\r\n"); // Remove newline
+        buf->data[buf->len] = 0;
+        return consumed;
+}
+
+// A field located in its line without copying it. A quoted field's span
+// excludes the quotes; `quoted` records that they were there.
+typedef struct {
+        const char* start;
+        int len;
+        bool quoted;
+} _csv_span_t;
+
+// Locates the field at `ptr` and returns the start of the next one.
+static inline
+const char*
+_csv_next_span(const char* ptr,
+               const char* line_end,
+               _csv_find_fn find,
+               _csv_span_t* span)
+{
+        const char* start = ptr;
+        const char* end;
+        span->quoted = *ptr == '"';
+        if (span->quoted) {
+                start++;
+                end = find(start, line_end, '"'); // Malformed CSV if it hits line_end
+        } else {
+                end = find(start, line_end, ',');
+        }
+        span->start = start;
+        span->len = (int)(end - start);
+
+        ptr = end;
+        if (span->quoted && ptr < line_end && *ptr == '"') {
+                ptr++;
+        }
+        if (ptr < line_end && *ptr == ',') {
+                ptr++;
+        }
+        while (ptr < line_end && (*ptr == ' ' || *ptr == '\t')) { // Skip whitespace
+                ptr++;
+        }
+        return ptr;
+}
+
+// A reusable array of spans for one line.
+typedef struct {
+        _csv_span_t* data;
+        int count;
+        int cap;
+} _csv_spans_t;
+
+// Splits [line, line_end) into spans, stopping after `max_fields` fields
+// (0 for all) so callers that need only leading columns skip the rest.
+static
+bool
+_csv_tokenize(const char* line,
+              const char* line_end,
+              int max_fields,
+              _csv_spans_t* spans)
+{
+        _csv_find_fn find = _csv_get_kernel()->find;
+        spans->count = 0;
+        while (line < line_end && (max_fields <= 0 || spans->count < max_fields)) {
+                if (spans->count == spans->cap) {
+                        int cap = spans->cap ? spans->cap * 2 : 16;
+                        _csv_span_t* data = (_csv_span_t*)realloc(spans->data, cap * sizeof(_csv_span_t));
+                        if (!data) {
+                                return false;
+                        }
+                        spans->data = data;
+                        spans->cap = cap;
+                }
+                line = _csv_next_span(line, line_end, find, &spans->data[spans->count++]);
+        }
+        return true;
+}
+
+// Appends a span as a field: quoted spans get their quotes back, so the
+// output re-parses to the same value.
+static
+bool
+_csv_buf_append_span(_csv_buf_t* buf,
+                     const _csv_span_t* span)
+{
+        if (span->quoted) {
+                return _csv_buf_append(buf, "\"", 1) &&
+                       _csv_buf_append(buf, span->start, span->len) &&
+                       _csv_buf_append(buf, "\"", 1);
+        }
+        return _csv_buf_append(buf, span->start, span->len);
+}
+
+// Internal helper to parse a single line
+static
+csv_row_t*
+_parse_csv_line(const char* line
+		)
+{
+        csv_row_t* row = (csv_row_t*)malloc(sizeof(csv_row_t));
+        if (!row) {
+                return NULL;
+        }
+
+        row->fields = NULL;
+        row->num_fields = 0;
+        row->shared = 0;
+        
+        const char* ptr = line;
+        const char* line_end = line + strlen(line);
+        _csv_find_fn find = _csv_get_kernel()->find;
+        int field_capacity = 10;
+        row->fields = (char**)malloc(field_capacity * sizeof(char*));
+
+        while (ptr < line_end) {
+                _csv_span_t span;
+                ptr = _csv_next_span(ptr, line_end, find, &span);
+
+                char* field = (char*)malloc(span.len + 1);
+                memcpy(field, span.start, span.len);
+                field[span.len] = '\0';
+                
+                if (row->num_fields >= field_capacity) {
+                        field_capacity *= 2;
+                        row->fields = (char**)realloc(row->fields, field_capacity * sizeof(char*));
+                }
+                row->fields[row->num_fields++] = field;
+        }
+
+        return row;
+}
+
+csv_document_t*
+csv_read(const char* file_path,
+         bool has_header)
+{
+        FILE* file = fopen(file_path, "r");
+        if (!file) {
+                perror("Error opening file");
+                return NULL;
+        }
+
+        csv_document_t* doc = (csv_document_t*)calloc(1, sizeof(csv_document_t));
+        if (!doc) {
+                fclose(file);
+                return NULL;
+        }
+
+        _csv_buf_t buf = { NULL, 0, 0 };
+        doc->row_capacity = 10;
+        doc->rows = (csv_row_t**)malloc(doc->row_capacity * sizeof(csv_row_t*));
+
+        // Handle header
+        if (has_header && _csv_read_line(file, &buf)) {
+                csv_row_t* header_row = _parse_csv_line(buf.data);
+                doc->header = header_row->fields;
+                doc->num_cols = header_row->num_fields;
+                free(header_row); // We only keep the fields
+        }
+
+        // Read data rows
+        while (_csv_read_line(file, &buf)) {
+                const char* line = buf.data;
+                if (strlen(line) == 0) {
+                        continue; // Skip empty lines
+                }
+
+                if (doc->num_rows >= doc->row_capacity) {
+                        doc->row_capacity *= 2;
+                        doc->rows = (csv_row_t**)realloc(doc->rows, doc->row_capacity * sizeof(csv_row_t*));
+                }
+                
+                csv_row_t* current_row = _parse_csv_line(line);
+                doc->rows[doc->num_rows++] = current_row;
+                if (doc->num_cols == 0) {
+                        doc->num_cols = current_row->num_fields;
+                }
+        }
+
+        _csv_buf_free(&buf);
+        fclose(file);
+        return doc;
+}
+
+// The document row index at position `i` of a view.
+static inline
+int
+_csv_view_row_index(const csv_view_t* view,
+                    int i)
+{
+        return view->rows ? view->rows[i] : view->first_row + i;
+}
+
+// The row at position `i` of a view.
+static inline
+const csv_row_t*
+_csv_view_row(const csv_view_t* view,
+              int i)
+{
+        return view->doc->rows[_csv_view_row_index(view, i)];
+}
+
+static inline
+int
+_csv_view_num_cols(const csv_view_t* view)
+{
+        return view->cols ? view->num_cols : view->doc->num_cols;
+}
+
+// Field `j` of a view row; missing fields of a projection read as "".
+static inline
+const char*
+_csv_view_field(const csv_view_t* view,
+                const csv_row_t* row,
+                int j)
+{
+        int col = view->cols ? view->cols[j] : j;
+        return col < row->num_fields ? row->fields[col] : "";
+}
+
+// A view over every row of `doc`, in order, without allocating.
+static
+csv_view_t
+_csv_view_identity(const csv_document_t* doc)
+{
+        csv_view_t view;
+        view.doc = doc;
+        view.rows = NULL;
+        view.num_rows = doc->num_rows;
+        view.first_row = 0;
+        view.cols = NULL;
+        view.num_cols = 0;
+        return view;
+}
+
+static
+int
+_csv_write_view(const csv_view_t* view,
+                const char* file_path)
+{
+        const csv_document_t* doc = view->doc;
+        FILE* file = fopen(file_path, "w");
+        if (!file) {
+                perror("Error opening file for writing");
+                return -1;
+        }
+
+        // Write header
+        int num_cols = _csv_view_num_cols(view);
+        if (doc->header) {
+                for (int i = 0; i < num_cols; i++) {
+                        int col = view->cols ? view->cols[i] : i;
+                        fprintf(file, "%s%s", doc->header[col], (i == num_cols - 1) ? "" : ",");
+                }
+                fprintf(file, "\n");
+        }
+
+        // Write rows; an unprojected view keeps every field, even ragged ones.
+        for (int i = 0; i < view->num_rows; i++) {
+                const csv_row_t* row = _csv_view_row(view, i);
+                int num_fields = view->cols ? view->num_cols : row->num_fields;
+                for (int j = 0; j < num_fields; j++) {
+                        fprintf(file, "%s%s", _csv_view_field(view, row, j), (j == num_fields - 1) ? "" : ",");
+                }
+                fprintf(file, "\n");
+        }
+
+        fclose(file);
+        return 0;
+}
+
+int
+csv_write(const csv_document_t* doc,
+          const char* file_path)
+{
+        csv_view_t view = _csv_view_identity(doc);
+        return _csv_write_view(&view, file_path);
+}
+
+// Drops one owner of a row; the last owner frees it.
+static
+void
+_csv_row_release(csv_row_t* row)
+{
+        if (!row) {
+                return;
+        }
+        if (_csv_atomic_fetch_add_long(&row->shared, -1) > 0) {
+                return;
+        }
+        for (int j = 0; j < row->num_fields; j++) {
+                free(row->fields[j]);
+        }
+        free(row->fields);
+        free(row);
+}
+
+void
+csv_free(csv_document_t** doc_ptr)
+{
+        if (!doc_ptr || !*doc_ptr) {
+                return;
+        }
+        csv_document_t* doc = *doc_ptr;
+
+        if (doc->header) {
+                for (int i = 0; i < doc->num_cols; i++) {
+                        free(doc->header[i]);
+                }
+                free(doc->header);
+        }
+
+        if (doc->rows) {
+                for (int i = 0; i < doc->num_rows; i++) {
+                        _csv_row_release(doc->rows[i]);
+                }
+                free(doc->rows);
+        }
+
+        if (doc->header_index) {
+                _csv_htab_free((_csv_htab_t*)doc->header_index);
+                free(doc->header_index);
+        }
+        free(doc);
+}
+
+static
+void
+_csv_show_view(const csv_view_t* view)
+{
+        const csv_document_t* doc = view->doc;
+        int num_cols = _csv_view_num_cols(view);
+
+        // Determine column widths
+        int* col_widths = (int*)calloc(num_cols > 0 ? num_cols : 1, sizeof(int));
+        if (doc->header) {
+                for (int i = 0; i < num_cols; i++) {
+                        col_widths[i] = strlen(doc->header[view->cols ? view->cols[i] : i]);
+                }
+        }
+        for (int i = 0; i < view->num_rows; i++) {
+                const csv_row_t* row = _csv_view_row(view, i);
+                int num_fields = view->cols ? view->num_cols : row->num_fields;
+                for (int j = 0; j < num_fields; j++) {
+                        int len = strlen(_csv_view_field(view, row, j));
+                        if (j < num_cols && len > col_widths[j]) {
+                                col_widths[j] = len;
+                        }
+                }
+        }
+
+        // Print header
+        if (doc->header) {
+                for (int i = 0; i < num_cols; i++) {
+                        printf("%-*s | ", col_widths[i], doc->header[view->cols ? view->cols[i] : i]);
+                }
+                printf("\n");
+                for (int i = 0; i < num_cols; i++) {
+                        for(int j = 0; j < col_widths[i]; j++) {
+                                putchar('-');
+                        }
+                        printf("-+-");
+                }
+                printf("\n");
+        }
+        
+        // Print rows
+        for (int i = 0; i < view->num_rows; i++) {
+                const csv_row_t* row = _csv_view_row(view, i);
+                int num_fields = view->cols ? view->num_cols : row->num_fields;
+                for (int j = 0; j < num_fields; j++) {
+                        if (j < num_cols) {
+                                printf("%-*s | ", col_widths[j], _csv_view_field(view, row, j));
+                        }
+                }
+                printf("\n");
+        }
+
+        free(col_widths);
+}
+
+void
+csv_show(const csv_document_t* doc)
+{
+        if (!doc) {
+                printf("CSV Document is NULL.\n");
+                return;
+        }
+        csv_view_t view = _csv_view_identity(doc);
+        _csv_show_view(&view);
+}
+
+const char*
+csv_field(const csv_document_t* doc,
+          int row,
+          int col)
+{
+        if (!doc || row < 0 || row >= doc->num_rows || col < 0) {
+                return NULL;
+        }
+        const csv_row_t* r = doc->rows[row];
+        if (!r || col >= r->num_fields) {
+                return NULL;
+        }
+        return r->fields[col];
+}
+
+static
+_csv_htab_t*
+_csv_build_header_index(const csv_document_t* doc)
+{
+        _csv_htab_t* index = (_csv_htab_t*)malloc(sizeof(_csv_htab_t));
+        if (!index) {
+                return NULL;
+        }
+        if (!_csv_htab_init(index, (size_t)doc->num_cols)) {
+                free(index);
+                return NULL;
+        }
+        for (int i = 0; i < doc->num_cols; i++) {
+                const char* name = doc->header[i];
+                if (!_csv_htab_insert(index, _csv_hash_bytes(name, strlen(name), 0), i)) {
+                        _csv_htab_free(index);
+                        free(index);
+                        return NULL;
+                }
+        }
+        return index;
+}
+
+int
+csv_column_index(const csv_document_t* doc,
+                 const char* name)
+{
+        if (!doc || !doc->header || !name) {
+                return -1;
+        }
+
+        // The document is logically const; the index is a cache published once.
+        void** slot = (void**)&doc->header_index;
+        _csv_htab_t* index = (_csv_htab_t*)_csv_atomic_load_ptr(slot);
+        if (!index) {
+                _csv_htab_t* built = _csv_build_header_index(doc);
+                if (!built) {
+                        return -1;
+                }
+                if (_csv_atomic_cas_ptr(slot, NULL, built)) {
+                        index = built;
+                } else {
+                        _csv_htab_free(built);
+                        free(built);
+                        index = (_csv_htab_t*)_csv_atomic_load_ptr(slot);
+                }
+        }
+
+        uint64_t hash = _csv_hash_bytes(name, strlen(name), 0);
+        size_t cursor = _csv_htab_probe(index, hash);
+        int64_t* col;
+        while ((col = _csv_htab_next(index, hash, &cursor))) {
+                if (strcmp(doc->header[*col], name) == 0) {
+                        return (int)*col;
+                }
+        }
+        return -1;
+}
+
+void
+csv_info(const csv_document_t* doc)
+{
+        if (!doc) {
+                printf("CSV Document is NULL.\n");
+                return;
+        }
+        printf("--- CSV Info ---\n");
+        printf("Rows:    %d\n", doc->num_rows);
+        printf("Columns: %d\n", doc->num_cols);
+        printf("Header:  %s\n", doc->header ? "Yes" : "No");
+        printf("----------------\n");
+}
+
+static
+csv_row_t*
+_csv_row_copy(const char* const* fields,
+              int num_fields)
+{
+        csv_row_t* row = (csv_row_t*)malloc(sizeof(csv_row_t));
+        if (!row) {
+                return NULL;
+        }
+        row->num_fields = 0;
+        row->shared = 0;
+        row->fields = (char**)malloc((num_fields > 0 ? num_fields : 1) * sizeof(char*));
+        if (!row->fields) {
+                free(row);
+                return NULL;
+        }
+        for (int i = 0; i < num_fields; i++) {
+                const char* src = fields[i] ? fields[i] : "";
+                size_t len = strlen(src);
+                char* field = (char*)malloc(len + 1);
+                if (!field) {
+                        _csv_row_release(row);
+                        return NULL;
+                }
+                memcpy(field, src, len + 1);
+                row->fields[row->num_fields++] = field;
+        }
+        return row;
+}
+
+// Builds a document holding the view's rows, shared rather than copied, and
+// a private copy of the header.
+static
+csv_document_t*
+_csv_share_rows(const csv_view_t* view)
+{
+        const csv_document_t* base = view->doc;
+        csv_document_t* doc = (csv_document_t*)calloc(1, sizeof(csv_document_t));
+        if (!doc) {
+                return NULL;
+        }
+
+        doc->row_capacity = view->num_rows > 10 ? view->num_rows : 10;
+        doc->rows = (csv_row_t**)malloc(doc->row_capacity * sizeof(csv_row_t*));
+        if (!doc->rows) {
+                free(doc);
+                return NULL;
+        }
+
+        int num_cols = _csv_view_num_cols(view);
+        if (base->header) {
+                doc->header = (char**)calloc(num_cols > 0 ? num_cols : 1, sizeof(char*));
+                if (!doc->header) {
+                        csv_free(&doc);
+                        return NULL;
+                }
+                for (int i = 0; i < num_cols; i++) {
+                        const char* name = base->header[view->cols ? view->cols[i] : i];
+                        size_t len = strlen(name);
+                        doc->header[i] = (char*)malloc(len + 1);
+                        if (!doc->header[i]) {
+                                doc->num_cols = i;
+                                csv_free(&doc);
+                                return NULL;
+                        }
+                        memcpy(doc->header[i], name, len + 1);
+                }
+        }
+        doc->num_cols = num_cols;
+
+        // Whole rows are shared; a column projection needs its own narrower rows.
+        const char** fields = NULL;
+        if (view->cols) {
+                fields = (const char**)malloc((num_cols > 0 ? num_cols : 1) * sizeof(char*));
+                if (!fields) {
+                        csv_free(&doc);
+                        return NULL;
+                }
+        }
+        for (int i = 0; i < view->num_rows; i++) {
+                csv_row_t* row = (csv_row_t*)_csv_view_row(view, i);
+                if (fields) {
+                        for (int j = 0; j < num_cols; j++) {
+                                fields[j] = _csv_view_field(view, row, j);
+                        }
+                        row = _csv_row_copy(fields, num_cols);
+                        if (!row) {
+                                free(fields);
+                                csv_free(&doc);
+                                return NULL;
+                        }
+                } else {
+                        _csv_atomic_fetch_add_long(&row->shared, 1);
+                }
+                doc->rows[doc->num_rows++] = row;
+        }
+        free(fields);
+        return doc;
+}
+
+csv_document_t*
+csv_derive(const csv_document_t* base)
+{
+        if (!base) {
+                return NULL;
+        }
+        csv_view_t all = _csv_view_identity(base);
+        return _csv_share_rows(&all);
+}
+
+int
+csv_set_row(csv_document_t* doc,
+            int row,
+            const char* const* fields,
+            int num_fields)
+{
+        if (!doc || row < 0 || row >= doc->num_rows) {
+                return -1;
+        }
+        csv_row_t* copy = _csv_row_copy(fields, num_fields);
+        if (!copy) {
+                return -1;
+        }
+        _csv_row_release(doc->rows[row]);
+        doc->rows[row] = copy;
+        return 0;
+}
+
+int
+csv_append_row(csv_document_t* doc,
+               const char* const* fields,
+               int num_fields)
+{
+        if (!doc) {
+                return -1;
+        }
+        if (doc->num_rows >= doc->row_capacity) {
+                int capacity = doc->row_capacity > 0 ? doc->row_capacity * 2 : 10;
+                csv_row_t** rows = (csv_row_t**)realloc(doc->rows, capacity * sizeof(csv_row_t*));
+                if (!rows) {
+                        return -1;
+                }
+                doc->rows = rows;
+                doc->row_capacity = capacity;
+        }
+        csv_row_t* copy = _csv_row_copy(fields, num_fields);
+        if (!copy) {
+                return -1;
+        }
+        doc->rows[doc->num_rows++] = copy;
+        if (doc->num_cols == 0) {
+                doc->num_cols = num_fields;
+        }
+        return 0;
+}
+
+csv_versioned_t*
+csv_versioned_create(csv_document_t* initial)
+{
+        csv_versioned_t* v = (csv_versioned_t*)calloc(1, sizeof(csv_versioned_t));
+        if (!v) {
+                return NULL;
+        }
+        v->current = initial;
+        return v;
+}
+
+csv_snapshot_t
+csv_snapshot_acquire(csv_versioned_t* v)
+{
+        csv_snapshot_t snap;
+        for (;;) {
+                // Register in the current epoch, then confirm no publish slipped
+                // in between; otherwise the writer may not be waiting on us.
+                long epoch = _csv_atomic_load_long(&v->epoch);
+                _csv_atomic_fetch_add_long(&v->readers[epoch & 1], 1);
+                if (_csv_atomic_load_long(&v->epoch) == epoch) {
+                        snap.doc = (const csv_document_t*)_csv_atomic_load_ptr(&v->current);
+                        snap.epoch = epoch;
+                        return snap;
+                }
+                _csv_atomic_fetch_add_long(&v->readers[epoch & 1], -1);
+        }
+}
+
+void
+csv_snapshot_release(csv_versioned_t* v,
+                     csv_snapshot_t* snap)
+{
+        if (!snap->doc) {
+                return;
+        }
+        _csv_atomic_fetch_add_long(&v->readers[snap->epoch & 1], -1);
+        snap->doc = NULL;
+}
+
+void
+csv_versioned_publish(csv_versioned_t* v,
+                      csv_document_t* next)
+{
+        csv_document_t* old = (csv_document_t*)_csv_atomic_exchange_ptr(&v->current, next);
+        long epoch = _csv_atomic_fetch_add_long(&v->epoch, 1);
+
+        // Readers registered in `epoch` may hold `old`; later readers see `next`.
+        while (_csv_atomic_load_long(&v->readers[epoch & 1]) != 0) {
+                _csv_yield();
+        }
+        csv_free(&old);
+}
+
+void
+csv_versioned_free(csv_versioned_t** v_ptr)
+{
+        if (!v_ptr || !*v_ptr) {
+                return;
+        }
+        csv_document_t* doc = (csv_document_t*)(*v_ptr)->current;
+        csv_free(&doc);
+        free(*v_ptr);
+        *v_ptr = NULL;
+}
+
+// Completion tracking for csv_pool_parallel_for(). The counter is only
+// touched under the lock so the waiter cannot free the group while the last
+// task is still signalling it.
+typedef struct {
+        _csv_mutex_t lock;
+        _csv_cond_t done;
+        int remaining;
+} _csv_task_group_t;
+
+typedef struct {
+        csv_task_fn fn;
+        void* arg;
+        int index;
+        _csv_task_group_t* group;
+} _csv_task_t;
+
+// A worker's task deque. The owner pushes and pops at the bottom; thieves
+// take from the top, so they pick up the oldest (usually largest) work.
+typedef struct {
+        _csv_mutex_t lock;
+        _csv_task_t* items;
+        int capacity;
+        int top;            // Index of the oldest task.
+        int count;
+} _csv_deque_t;
+
+struct csv_pool {
+        _csv_thread_t* threads;
+        _csv_deque_t* deques;
+        int num_threads;
+        int started;        // Workers actually running; joined on destroy.
+        long pending;       // Tasks queued but not yet taken.
+        long next_deque;    // Round-robin target for submissions from outside the pool.
+        bool stopping;
+        _csv_mutex_t lock;
+        _csv_cond_t wake;
+};
+
+typedef struct {
+        csv_pool_t* pool;
+        int index;
+} _csv_worker_arg_t;
+
+static _CSV_THREAD_LOCAL csv_pool_t* _csv_current_pool = NULL;
+static _CSV_THREAD_LOCAL int _csv_current_worker = -1;
+
+static
+bool
+_csv_deque_push(_csv_deque_t* dq,
+                const _csv_task_t* task)
+{
+        _csv_mutex_lock(&dq->lock);
+        if (dq->count == dq->capacity) {
+                int capacity = dq->capacity ? dq->capacity * 2 : 64;
+                _csv_task_t* items = (_csv_task_t*)malloc(capacity * sizeof(_csv_task_t));
+                if (!items) {
+                        _csv_mutex_unlock(&dq->lock);
+                        return false;
+                }
+                for (int i = 0; i < dq->count; i++) {
+                        items[i] = dq->items[(dq->top + i) % dq->capacity];
+                }
+                free(dq->items);
+                dq->items = items;
+                dq->capacity = capacity;
+                dq->top = 0;
+        }
+        dq->items[(dq->top + dq->count) % dq->capacity] = *task;
+        dq->count++;
+        _csv_mutex_unlock(&dq->lock);
+        return true;
+}
+
+static
+bool
+_csv_deque_pop(_csv_deque_t* dq,
+               _csv_task_t* task)
+{
+        bool ok = false;
+        _csv_mutex_lock(&dq->lock);
+        if (dq->count > 0) {
+                dq->count--;
+                *task = dq->items[(dq->top + dq->count) % dq->capacity];
+                ok = true;
+        }
+        _csv_mutex_unlock(&dq->lock);
+        return ok;
+}
+
+static
+bool
+_csv_deque_steal(_csv_deque_t* dq,
+                 _csv_task_t* task)
+{
+        bool ok = false;
+        _csv_mutex_lock(&dq->lock);
+        if (dq->count > 0) {
+                *task = dq->items[dq->top];
+                dq->top = (dq->top + 1) % dq->capacity;
+                dq->count--;
+                ok = true;
+        }
+        _csv_mutex_unlock(&dq->lock);
+        return ok;
+}
+
+static
+int
+_csv_pool_push(csv_pool_t* pool,
+               const _csv_task_t* task)
+{
+        int target;
+        if (_csv_current_pool == pool) {
+                target = _csv_current_worker;
+        } else {
+                target = (int)((unsigned long)_csv_atomic_fetch_add_long(&pool->next_deque, 1) % (unsigned long)pool->num_threads);
+        }
+        if (!_csv_deque_push(&pool->deques[target], task)) {
+                return -1;
+        }
+        _csv_atomic_fetch_add_long(&pool->pending, 1);
+
+        _csv_mutex_lock(&pool->lock);
+        _csv_cond_signal(&pool->wake);
+        _csv_mutex_unlock(&pool->lock);
+        return 0;
+}
+
+// Takes a task from `self`'s deque, or steals one. `self` is -1 for threads
+// outside the pool, which only steal.
+static
+bool
+_csv_pool_take(csv_pool_t* pool,
+               int self,
+               _csv_task_t* task)
+{
+        if (_csv_atomic_load_long(&pool->pending) == 0) {
+                return false;
+        }
+        if (self >= 0 && _csv_deque_pop(&pool->deques[self], task)) {
+                _csv_atomic_fetch_add_long(&pool->pending, -1);
+                return true;
+        }
+        int start = self >= 0 ? self + 1 : 0;
+        for (int i = 0; i < pool->num_threads; i++) {
+                int victim = (start + i) % pool->num_threads;
+                if (victim != self && _csv_deque_steal(&pool->deques[victim], task)) {
+                        _csv_atomic_fetch_add_long(&pool->pending, -1);
+                        return true;
+                }
+        }
+        return false;
+}
+
+static
+void
+_csv_task_run(const _csv_task_t* task)
+{
+        task->fn(task->arg, task->index);
+        if (task->group) {
+                _csv_task_group_t* group = task->group;
+                _csv_mutex_lock(&group->lock);
+                if (--group->remaining == 0) {
+                        _csv_cond_broadcast(&group->done);
+                }
+                _csv_mutex_unlock(&group->lock);
+        }
+}
+
+static
+void
+_csv_pool_worker(void* param)
+{
+        _csv_worker_arg_t worker = *(_csv_worker_arg_t*)param;
+        free(param);
+        csv_pool_t* pool = worker.pool;
+        _csv_current_pool = pool;
+        _csv_current_worker = worker.index;
+
+        for (;;) {
+                _csv_task_t task;
+                if (_csv_pool_take(pool, worker.index, &task)) {
+                        _csv_task_run(&task);
+                        continue;
+                }
+
+                _csv_mutex_lock(&pool->lock);
+                while (_csv_atomic_load_long(&pool->pending) == 0 && !pool->stopping) {
+                        _csv_cond_wait(&pool->wake, &pool->lock);
+                }
+                bool done = pool->stopping && _csv_atomic_load_long(&pool->pending) == 0;
+                _csv_mutex_unlock(&pool->lock);
+                if (done) {
+                        break;
+                }
+        }
+}
+
+csv_pool_t*
+csv_pool_create(int num_threads)
+{
+        if (num_threads <= 0) {
+                num_threads = _csv_cpu_count();
+        }
+        csv_pool_t* pool = (csv_pool_t*)calloc(1, sizeof(csv_pool_t));
+        if (!pool) {
+                return NULL;
+        }
+        pool->threads = (_csv_thread_t*)calloc(num_threads, sizeof(_csv_thread_t));
+        pool->deques = (_csv_deque_t*)calloc(num_threads, sizeof(_csv_deque_t));
+        if (!pool->threads || !pool->deques) {
+                free(pool->threads);
+                free(pool->deques);
+                free(pool);
+                return NULL;
+        }
+        _csv_mutex_init(&pool->lock);
+        _csv_cond_init(&pool->wake);
+        for (int i = 0; i < num_threads; i++) {
+                _csv_mutex_init(&pool->deques[i].lock);
+        }
+
+        pool->num_threads = num_threads;
+        for (int i = 0; i < num_threads; i++) {
+                _csv_worker_arg_t* arg = (_csv_worker_arg_t*)malloc(sizeof(_csv_worker_arg_t));
+                if (!arg) {
+                        csv_pool_destroy(&pool);
+                        return NULL;
+                }
+                arg->pool = pool;
+                arg->index = i;
+                if (_csv_thread_create(&pool->threads[i], _csv_pool_worker, arg) != 0) {
+                        free(arg);
+                        csv_pool_destroy(&pool);
+                        return NULL;
+                }
+                pool->started++;
+        }
+        return pool;
+}
+
+void
+csv_pool_destroy(csv_pool_t** pool_ptr)
+{
+        if (!pool_ptr || !*pool_ptr) {
+                return;
+        }
+        csv_pool_t* pool = *pool_ptr;
+
+        _csv_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        _csv_cond_broadcast(&pool->wake);
+        _csv_mutex_unlock(&pool->lock);
+
+        for (int i = 0; i < pool->started; i++) {
+                _csv_thread_join(pool->threads[i]);
+        }
+        for (int i = 0; i < pool->num_threads; i++) {
+                _csv_mutex_destroy(&pool->deques[i].lock);
+                free(pool->deques[i].items);
+        }
+        _csv_cond_destroy(&pool->wake);
+        _csv_mutex_destroy(&pool->lock);
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        *pool_ptr = NULL;
+}
+
+int
+csv_pool_size(const csv_pool_t* pool)
+{
+        return pool ? pool->num_threads : 0;
+}
+
+int
+csv_pool_submit(csv_pool_t* pool,
+                csv_task_fn fn,
+                void* arg,
+                int index)
+{
+        _csv_task_t task;
+        task.fn = fn;
+        task.arg = arg;
+        task.index = index;
+        task.group = NULL;
+        return _csv_pool_push(pool, &task);
+}
+
+void
+csv_pool_parallel_for(csv_pool_t* pool,
+                      int count,
+                      csv_task_fn fn,
+                      void* arg)
+{
+        if (count <= 0) {
+                return;
+        }
+        _csv_task_group_t group;
+        _csv_mutex_init(&group.lock);
+        _csv_cond_init(&group.done);
+        group.remaining = count;
+
+        // Tasks that cannot be queued run inline, so the group always completes.
+        _csv_task_t task;
+        task.fn = fn;
+        task.arg = arg;
+        task.group = &group;
+        for (int i = 0; i < count; i++) {
+                task.index = i;
+                if (_csv_pool_push(pool, &task) != 0) {
+                        _csv_task_run(&task);
+                }
+        }
+
+        // Help until the queues are empty, then sleep until the stragglers finish.
+        int self = _csv_current_pool == pool ? _csv_current_worker : -1;
+        _csv_task_t other;
+        _csv_mutex_lock(&group.lock);
+        while (group.remaining > 0) {
+                _csv_mutex_unlock(&group.lock);
+                bool ran = _csv_pool_take(pool, self, &other);
+                if (ran) {
+                        _csv_task_run(&other);
+                }
+                _csv_mutex_lock(&group.lock);
+                if (!ran && group.remaining > 0) {
+                        _csv_cond_wait(&group.done, &group.lock);
+                }
+        }
+        _csv_mutex_unlock(&group.lock);
+
+        _csv_cond_destroy(&group.done);
+        _csv_mutex_destroy(&group.lock);
+}
+
+static
+void
+_csv_pool_exec_for(void* ctx,
+                   int count,
+                   csv_task_fn fn,
+                   void* arg)
+{
+        csv_pool_parallel_for((csv_pool_t*)ctx, count, fn, arg);
+}
+
+static
+int
+_csv_pool_exec_submit(void* ctx,
+                      csv_task_fn fn,
+                      void* arg,
+                      int index)
+{
+        return csv_pool_submit((csv_pool_t*)ctx, fn, arg, index);
+}
+
+static
+int
+_csv_pool_exec_concurrency(void* ctx)
+{
+        return csv_pool_size((const csv_pool_t*)ctx);
+}
+
+csv_executor_t
+csv_pool_executor(csv_pool_t* pool)
+{
+        csv_executor_t exec;
+        exec.ctx = pool;
+        exec.parallel_for = _csv_pool_exec_for;
+        exec.submit = _csv_pool_exec_submit;
+        exec.concurrency = _csv_pool_exec_concurrency;
+        return exec;
+}
+
+void
+csv_parallel_for(const csv_executor_t* exec,
+                 int count,
+                 csv_task_fn fn,
+                 void* arg)
+{
+        if (!exec || !exec->parallel_for) {
+                for (int i = 0; i < count; i++) {
+                        fn(arg, i);
+                }
+                return;
+        }
+        exec->parallel_for(exec->ctx, count, fn, arg);
+}
+
+#define _CSV_FREE_CHUNK_ROWS 16384
+
+typedef struct {
+        csv_document_t* doc;
+        csv_executor_t exec;
+        bool has_exec;
+} _csv_free_job_t;
+
+static
+void
+_csv_free_rows_chunk(void* arg,
+                     int chunk)
+{
+        csv_document_t* doc = (csv_document_t*)arg;
+        int begin = chunk * _CSV_FREE_CHUNK_ROWS;
+        int end = begin + _CSV_FREE_CHUNK_ROWS < doc->num_rows ? begin + _CSV_FREE_CHUNK_ROWS : doc->num_rows;
+        for (int i = begin; i < end; i++) {
+                _csv_row_release(doc->rows[i]);
+                doc->rows[i] = NULL;
+        }
+}
+
+static
+void
+_csv_free_job_run(void* arg,
+                  int index)
+{
+        (void)index;
+        _csv_free_job_t* job = (_csv_free_job_t*)arg;
+        int chunks = (job->doc->num_rows + _CSV_FREE_CHUNK_ROWS - 1) / _CSV_FREE_CHUNK_ROWS;
+        if (job->has_exec && chunks > 1) {
+                csv_parallel_for(&job->exec, chunks, _csv_free_rows_chunk, job->doc);
+        }
+        csv_free(&job->doc); // Rows released above are NULL and skipped.
+        free(job);
+}
+
+static
+void
+_csv_free_job_thread(void* arg)
+{
+        _csv_free_job_run(arg, 0);
+}
+
+void
+csv_free_async(csv_document_t** doc_ptr,
+               const csv_executor_t* exec)
+{
+        if (!doc_ptr || !*doc_ptr) {
+                return;
+        }
+        csv_document_t* doc = *doc_ptr;
+        *doc_ptr = NULL;
+
+        _csv_free_job_t* job = (_csv_free_job_t*)malloc(sizeof(_csv_free_job_t));
+        if (!job) {
+                csv_free(&doc);
+                return;
+        }
+        job->doc = doc;
+        job->has_exec = exec && exec->submit;
+        if (job->has_exec) {
+                job->exec = *exec;
+                if (exec->submit(exec->ctx, _csv_free_job_run, job, 0) == 0) {
+                        return;
+                }
+        } else {
+                _csv_thread_t thread;
+                if (_csv_thread_create(&thread, _csv_free_job_thread, job) == 0) {
+                        _csv_thread_detach(thread);
+                        return;
+                }
+        }
+        free(job);
+        csv_free(&doc);
+}
+
+#define _CSV_WRITE_CHUNK_MIN_ROWS 4096
+
+typedef struct {
+        const csv_document_t* doc;
+        int rows_per_chunk;
+        size_t* sizes;          // Byte length of each chunk; offsets after the prefix sum.
+        _csv_buf_t* buffers;    // Formatted chunks, only used without pwrite().
+        int fd;
+        long failed;
+} _csv_write_job_t;
+
+static
+void
+_csv_write_chunk_bounds(const _csv_write_job_t* job,
+                        int chunk,
+                        int* begin,
+                        int* end)
+{
+        *begin = chunk * job->rows_per_chunk;
+        *end = *begin + job->rows_per_chunk < job->doc->num_rows ? *begin + job->rows_per_chunk : job->doc->num_rows;
+}
+
+static
+bool
+_csv_write_format_chunk(const _csv_write_job_t* job,
+                        int chunk,
+                        _csv_buf_t* out)
+{
+        int begin, end;
+        _csv_write_chunk_bounds(job, chunk, &begin, &end);
+        for (int i = begin; i < end; i++) {
+                const csv_row_t* row = job->doc->rows[i];
+                if (!_csv_buf_append_record(out, row->fields, row->num_fields)) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+#ifdef _CSV_HAVE_PWRITE
+
+// Pre-pass: the exact byte length of a chunk, so offsets are known up front.
+static
+void
+_csv_write_measure_chunk(void* arg,
+                         int chunk)
+{
+        _csv_write_job_t* job = (_csv_write_job_t*)arg;
+        int begin, end;
+        _csv_write_chunk_bounds(job, chunk, &begin, &end);
+        size_t size = 0;
+        for (int i = begin; i < end; i++) {
+                const csv_row_t* row = job->doc->rows[i];
+                for (int j = 0; j < row->num_fields; j++) {
+                        size += strlen(row->fields[j]);
+                }
+                size += row->num_fields > 0 ? (size_t)row->num_fields : 1; // Commas plus newline.
+        }
+        job->sizes[chunk] = size;
+}
+
+static
+bool
+_csv_pwrite_all(int fd,
+                const char* data,
+                size_t len,
+                off_t offset)
+{
+        while (len > 0) {
+                ssize_t n = pwrite(fd, data, len, offset);
+                if (n < 0 && errno == EINTR) {
+                        continue; // Interrupted before writing anything.
+                }
+                if (n <= 0) {
+                        return false; // A 0-byte write would otherwise loop forever.
+                }
+                data += n;
+                len -= (size_t)n;
+                offset += n;
+        }
+        return true;
+}
+
+static
+void
+_csv_write_emit_chunk(void* arg,
+                      int chunk)
+{
+        _csv_write_job_t* job = (_csv_write_job_t*)arg;
+        _csv_buf_t buf = { NULL, 0, 0 };
+        if (!_csv_write_format_chunk(job, chunk, &buf) ||
+            !_csv_pwrite_all(job->fd, buf.data, buf.len, (off_t)job->sizes[chunk])) {
+                _csv_atomic_fetch_add_long(&job->failed, 1);
+        }
+        _csv_buf_free(&buf);
+}
+
+#else
+
+static
+void
+_csv_write_buffer_chunk(void* arg,
+                        int chunk)
+{
+        _csv_write_job_t* job = (_csv_write_job_t*)arg;
+        if (!_csv_write_format_chunk(job, chunk, &job->buffers[chunk])) {
+                _csv_atomic_fetch_add_long(&job->failed, 1);
+        }
+}
+
+#endif // _CSV_HAVE_PWRITE
+
+int
+csv_write_parallel(const csv_document_t* doc,
+                   const char* file_path,
+                   const csv_executor_t* exec)
+{
+        if (!doc) {
+                return -1;
+        }
+
+        _csv_buf_t header = { NULL, 0, 0 };
+        if (doc->header && !_csv_buf_append_record(&header, doc->header, doc->num_cols)) {
+                _csv_buf_free(&header);
+                return -1;
+        }
+
+        // A few chunks per thread keeps workers busy when row widths vary.
+        int threads = exec && exec->concurrency ? exec->concurrency(exec->ctx) : 1;
+        _csv_write_job_t job;
+        job.doc = doc;
+        job.rows_per_chunk = doc->num_rows / (threads * 4 > 0 ? threads * 4 : 1);
+        if (job.rows_per_chunk < _CSV_WRITE_CHUNK_MIN_ROWS) {
+                job.rows_per_chunk = _CSV_WRITE_CHUNK_MIN_ROWS;
+        }
+        int chunks = (doc->num_rows + job.rows_per_chunk - 1) / job.rows_per_chunk;
+        job.sizes = (size_t*)calloc(chunks > 0 ? chunks : 1, sizeof(size_t));
+        job.buffers = NULL;
+        job.fd = -1;
+        job.failed = 0;
+        if (!job.sizes) {
+                _csv_buf_free(&header);
+                return -1;
+        }
+
+        int result = 0;
+#ifdef _CSV_HAVE_PWRITE
+        job.fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (job.fd < 0) {
+                perror("Error opening file for writing");
+                result = -1;
+        } else {
+                csv_parallel_for(exec, chunks, _csv_write_measure_chunk, &job);
+                // Offsets must fit both size_t and off_t; a 32-bit off_t (no
+                // _FILE_OFFSET_BITS=64) would wrap past 2 GiB and overwrite
+                // the start of the file, so larger outputs go through csv_write().
+                const uint64_t off_max = ((uint64_t)1 << (sizeof(off_t) * 8 - 1)) - 1;
+                uint64_t offset = header.len;
+                bool fits = true;
+                for (int i = 0; i < chunks; i++) {
+                        uint64_t size = job.sizes[i];
+                        job.sizes[i] = (size_t)offset;
+                        offset += size;
+                        fits = fits && offset <= off_max && offset <= SIZE_MAX;
+                }
+                if (!fits) {
+                        close(job.fd);
+                        free(job.sizes);
+                        _csv_buf_free(&header);
+                        return csv_write(doc, file_path);
+                }
+                if (!_csv_pwrite_all(job.fd, header.data, header.len, 0)) {
+                        job.failed = 1;
+                } else {
+                        csv_parallel_for(exec, chunks, _csv_write_emit_chunk, &job);
+                }
+                if (close(job.fd) != 0 || job.failed) {
+                        perror("Error writing file");
+                        result = -1;
+                }
+        }
+#else
+        job.buffers = (_csv_buf_t*)calloc(chunks > 0 ? chunks : 1, sizeof(_csv_buf_t));
+        FILE* file = job.buffers ? fopen(file_path, "wb") : NULL;
+        if (!file) {
+                perror("Error opening file for writing");
+                result = -1;
+        } else {
+                csv_parallel_for(exec, chunks, _csv_write_buffer_chunk, &job);
+                if (!job.failed && header.len) {
+                        job.failed = fwrite(header.data, 1, header.len, file) != header.len;
+                }
+                for (int i = 0; i < chunks && !job.failed; i++) {
+                        job.failed = fwrite(job.buffers[i].data, 1, job.buffers[i].len, file) != job.buffers[i].len;
+                }
+                if (fclose(file) != 0 || job.failed) {
+                        perror("Error writing file");
+                        result = -1;
+                }
+        }
+        if (job.buffers) {
+                for (int i = 0; i < chunks; i++) {
+                        _csv_buf_free(&job.buffers[i]);
+                }
+                free(job.buffers);
+        }
+#endif
+        free(job.sizes);
+        _csv_buf_free(&header);
+        return result;
+}
+
+// -------------------------------------------------------------------------------------
+// Typed Columns
+// -------------------------------------------------------------------------------------
+
+static inline
+int
+_csv_popcount64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcountll(x);
+#else
+        x = x - ((x >> 1) & 0x5555555555555555ULL);
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static inline
+int
+_csv_clz64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+        return x ? __builtin_clzll(x) : 64;
+#else
+        int n = 0;
+        while (n < 64 && !(x & (1ULL << 63))) {
+                x <<= 1;
+                n++;
+        }
+        return n;
+#endif
+}
+
+// Parses a whole field, allowing surrounding blanks. Returns false for
+// empty or partially numeric fields.
+static
+bool
+_csv_parse_int64(const char* s,
+                 int64_t* out)
+{
+        if (!s) {
+                return false;
+        }
+        char* end;
+        errno = 0;
+        long long v = strtoll(s, &end, 10);
+        if (end == s || errno == ERANGE) {
+                return false;
+        }
+        while (*end == ' ' || *end == '\t') {
+                end++;
+        }
+        if (*end) {
+                return false;
+        }
+        *out = (int64_t)v;
+        return true;
+}
+
+static
+bool
+_csv_parse_double(const char* s,
+                  double* out)
+{
+        if (!s) {
+                return false;
+        }
+        char* end;
+        double v = strtod(s, &end);
+        if (end == s || v != v) { // Reject "nan" so NaN never reaches the kernels.
+                return false;
+        }
+        while (*end == ' ' || *end == '\t') {
+                end++;
+        }
+        if (*end) {
+                return false;
+        }
+        *out = v;
+        return true;
+}
+
+// Accepts true/false, yes/no and 1/0 in any case, allowing surrounding blanks.
+static
+bool
+_csv_parse_bool(const char* s,
+                size_t len,
+                int64_t* out)
+{
+        static const char* const names[] = { "false", "true", "no", "yes", "0", "1" };
+        if (!s) {
+                return false;
+        }
+        while (len > 0 && (*s == ' ' || *s == '\t')) {
+                s++;
+                len--;
+        }
+        while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t')) {
+                len--;
+        }
+        for (int i = 0; i < 6; i++) {
+                size_t n = strlen(names[i]);
+                size_t k = 0;
+                while (k < n && k < len) {
+                        char c = s[k] >= 'A' && s[k] <= 'Z' ? (char)(s[k] - 'A' + 'a') : s[k];
+                        if (c != names[i][k]) {
+                                break;
+                        }
+                        k++;
+                }
+                if (k == n && n == len) {
+                        *out = i & 1;
+                        return true;
+                }
+        }
+        return false;
+}
+
+csv_column_t*
+csv_column_build(const csv_document_t* doc,
+                 int col,
+                 csv_type_t type)
+{
+        if (!doc || col < 0 || (type != CSV_TYPE_INT64 && type != CSV_TYPE_DOUBLE && type != CSV_TYPE_BOOL)) {
+                return NULL;
+        }
+        csv_column_t* column = (csv_column_t*)calloc(1, sizeof(csv_column_t));
+        if (!column) {
+                return NULL;
+        }
+        size_t n = (size_t)doc->num_rows;
+        size_t words = (n + 63) / 64;
+        column->type = type;
+        column->length = doc->num_rows;
+        column->values = calloc(n ? n : 1, type == CSV_TYPE_DOUBLE ? sizeof(double) : sizeof(int64_t));
+        column->validity = (uint64_t*)calloc(words ? words : 1, sizeof(uint64_t));
+        if (!column->values || !column->validity) {
+                csv_column_free(&column);
+                return NULL;
+        }
+
+        for (int i = 0; i < doc->num_rows; i++) {
+                const char* field = csv_field(doc, i, col);
+                bool ok;
+                if (type == CSV_TYPE_INT64) {
+                        ok = _csv_parse_int64(field, &((int64_t*)column->values)[i]);
+                } else if (type == CSV_TYPE_BOOL) {
+                        ok = field && _csv_parse_bool(field, strlen(field), &((int64_t*)column->values)[i]);
+                } else {
+                        ok = _csv_parse_double(field, &((double*)column->values)[i]);
+                }
+                if (ok) {
+                        column->validity[i >> 6] |= 1ULL << (i & 63);
+                } else {
+                        column->null_count++;
+                }
+        }
+
+        // A column without nulls skips the bitmap entirely on the fast path.
+        if (column->null_count == 0) {
+                free(column->validity);
+                column->validity = NULL;
+        }
+        return column;
+}
+
+void
+csv_column_free(csv_column_t** col_ptr)
+{
+        if (!col_ptr || !*col_ptr) {
+                return;
+        }
+        free((*col_ptr)->values);
+        free((*col_ptr)->validity);
+        free(*col_ptr);
+        *col_ptr = NULL;
+}
+
+bool
+csv_column_is_valid(const csv_column_t* col,
+                    int i)
+{
+        if (!col || i < 0 || i >= col->length) {
+                return false;
+        }
+        return !col->validity || (col->validity[i >> 6] >> (i & 63)) & 1;
+}
+
+// Folds a block of up to 64 values with nulls. Nulls are stored as 0, so
+// they add nothing to the sum; min/max select only valid lanes.
+static
+void
+_csv_agg_f64_masked(const double* v,
+                    int n,
+                    uint64_t valid,
+                    _csv_agg_acc_t* acc)
+{
+        double sum = 0.0;
+        double lo = acc->min;
+        double hi = acc->max;
+        for (int k = 0; k < n; k++) {
+                bool ok = (valid >> k) & 1;
+                double x = v[k];
+                sum += x;
+                lo = ok && x < lo ? x : lo;
+                hi = ok && x > hi ? x : hi;
+        }
+        acc->sum += sum;
+        acc->min = lo;
+        acc->max = hi;
+        acc->count += _csv_popcount64(valid);
+}
+
+static
+void
+_csv_agg_i64_masked(const int64_t* v,
+                    int n,
+                    uint64_t valid,
+                    _csv_agg_acc_t* acc)
+{
+        uint64_t sum = 0;
+        int64_t lo = acc->int_min;
+        int64_t hi = acc->int_max;
+        for (int k = 0; k < n; k++) {
+                bool ok = (valid >> k) & 1;
+                int64_t x = v[k];
+                sum += (uint64_t)x;
+                lo = ok && x < lo ? x : lo;
+                hi = ok && x > hi ? x : hi;
+        }
+        acc->int_sum += sum;
+        acc->int_min = lo;
+        acc->int_max = hi;
+        acc->count += _csv_popcount64(valid);
+}
+
+static
+void
+_csv_agg_range(const _csv_kernel_t* kernel,
+               const csv_column_t* col,
+               int begin,
+               int end,
+               _csv_agg_acc_t* acc)
+{
+        if (end <= begin) {
+                return;
+        }
+        if (col->type != CSV_TYPE_DOUBLE) {
+                kernel->agg_i64((const int64_t*)col->values + begin, end - begin, acc);
+        } else {
+                kernel->agg_f64((const double*)col->values + begin, end - begin, acc);
+        }
+}
+
+static
+void
+_csv_agg_init(_csv_agg_acc_t* acc)
+{
+        acc->count = 0;
+        acc->sum = 0.0;
+        acc->min = INFINITY;
+        acc->max = -INFINITY;
+        acc->int_sum = 0;
+        acc->int_min = INT64_MAX;
+        acc->int_max = INT64_MIN;
+}
+
+static
+void
+_csv_agg_finish(const _csv_agg_acc_t* acc,
+                bool is_int,
+                csv_aggregate_t* out)
+{
+        out->count = acc->count;
+        if (is_int) {
+                out->int_sum = (int64_t)acc->int_sum;
+                out->int_min = acc->count ? acc->int_min : 0;
+                out->int_max = acc->count ? acc->int_max : 0;
+                out->sum = (double)out->int_sum;
+                out->min = acc->count ? (double)acc->int_min : NAN;
+                out->max = acc->count ? (double)acc->int_max : NAN;
+        } else {
+                out->int_sum = 0;
+                out->int_min = 0;
+                out->int_max = 0;
+                out->sum = acc->sum;
+                out->min = acc->count ? acc->min : NAN;
+                out->max = acc->count ? acc->max : NAN;
+        }
+        out->mean = acc->count ? out->sum / acc->count : NAN;
+}
+
+int
+csv_column_aggregate(const csv_column_t* col,
+                     csv_aggregate_t* out)
+{
+        if (!col || !out || col->type == CSV_TYPE_STRING) {
+                return -1;
+        }
+        const _csv_kernel_t* kernel = _csv_get_kernel();
+        _csv_agg_acc_t acc;
+        _csv_agg_init(&acc);
+
+        bool is_int = col->type != CSV_TYPE_DOUBLE;
+        // Runs of fully valid 64-value blocks go to the kernel in one call;
+        // partially valid blocks are folded value by value.
+        int run_start = 0;
+        for (int base = 0; base < col->length; base += 64) {
+                int n = col->length - base < 64 ? col->length - base : 64;
+                uint64_t full = n == 64 ? ~0ULL : (1ULL << n) - 1;
+                uint64_t word = col->validity ? col->validity[base >> 6] : full;
+                if (word == full) {
+                        continue;
+                }
+                _csv_agg_range(kernel, col, run_start, base, &acc);
+                if (is_int) {
+                        _csv_agg_i64_masked((const int64_t*)col->values + base, n, word, &acc);
+                } else {
+                        _csv_agg_f64_masked((const double*)col->values + base, n, word, &acc);
+                }
+                run_start = base + n;
+        }
+        _csv_agg_range(kernel, col, run_start, col->length, &acc);
+        _csv_agg_finish(&acc, is_int, out);
+        return 0;
+}
+
+// Rewrites `x op value` over int64 x as an exact integer comparison. Returns
+// 1 if it holds for every x, -1 if for none, 0 if *op_out / *t_out apply.
+static
+int
+_csv_int_threshold(csv_cmp_t op,
+                   double value,
+                   csv_cmp_t* op_out,
+                   int64_t* t_out)
+{
+        const double limit = 9223372036854775808.0; // 2^63
+        *op_out = op;
+        if (value != value) {
+                return op == CSV_CMP_NE ? 1 : -1;
+        }
+        if (value >= limit) {
+                return (op == CSV_CMP_LT || op == CSV_CMP_LE || op == CSV_CMP_NE) ? 1 : -1;
+        }
+        if (value < -limit) {
+                return (op == CSV_CMP_GT || op == CSV_CMP_GE || op == CSV_CMP_NE) ? 1 : -1;
+        }
+        int64_t t = (int64_t)value; // Truncates toward zero.
+        if ((double)t == value) {
+                *t_out = t;
+                return 0;
+        }
+        if (op == CSV_CMP_EQ) {
+                return -1;
+        }
+        if (op == CSV_CMP_NE) {
+                return 1;
+        }
+        // Non-integral threshold: compare against its floor.
+        if (value < 0) {
+                t -= 1;
+        }
+        *t_out = t;
+        *op_out = (op == CSV_CMP_LT || op == CSV_CMP_LE) ? CSV_CMP_LE : CSV_CMP_GT;
+        return 0;
+}
+
+#define _CSV_SCAN_BLOCK 4096
+
+// Fills the masks of an n-value block whose outcome is known up front.
+static
+void
+_csv_scan_fill(uint64_t* masks,
+               int n,
+               bool all)
+{
+        int words = (n + 63) / 64;
+        for (int w = 0; w < words; w++) {
+                masks[w] = all ? ~0ULL : 0;
+        }
+        if (n & 63) {
+                masks[words - 1] &= (1ULL << (n & 63)) - 1;
+        }
+}
+
+// Masks the compare results of the block at `base` with the validity bitmap,
+// then counts them or appends their indexes to `sel`. Returns the new count.
+static
+int
+_csv_scan_emit(const uint64_t* masks,
+               int words,
+               const uint64_t* validity,
+               int base,
+               int* sel,
+               int count)
+{
+        for (int w = 0; w < words; w++) {
+                uint64_t m = masks[w];
+                if (validity) {
+                        m &= validity[(base >> 6) + w];
+                }
+                if (!sel) {
+                        count += _csv_popcount64(m);
+                        continue;
+                }
+                while (m) {
+                        sel[count++] = base + w * 64 + _csv_ctz64(m);
+                        m &= m - 1;
+                }
+        }
+        return count;
+}
+
+// Shared driver for count_if and select: compares 4096 values per kernel
+// call and masks the result with the validity bitmap.
+static
+int
+_csv_column_scan(const csv_column_t* col,
+                 csv_cmp_t op,
+                 double value,
+                 int* sel)
+{
+        if (!col || (unsigned)op > CSV_CMP_GE || col->type == CSV_TYPE_STRING) {
+                return -1;
+        }
+        const _csv_kernel_t* kernel = _csv_get_kernel();
+        csv_cmp_t int_op = op;
+        int64_t int_t = 0;
+        int constant = 0;
+        if (col->type != CSV_TYPE_DOUBLE) {
+                constant = _csv_int_threshold(op, value, &int_op, &int_t);
+        }
+
+        uint64_t masks[_CSV_SCAN_BLOCK / 64];
+        int count = 0;
+        for (int base = 0; base < col->length; base += _CSV_SCAN_BLOCK) {
+                int n = col->length - base < _CSV_SCAN_BLOCK ? col->length - base : _CSV_SCAN_BLOCK;
+                int words = (n + 63) / 64;
+                if (constant != 0) {
+                        _csv_scan_fill(masks, n, constant > 0);
+                } else if (col->type != CSV_TYPE_DOUBLE) {
+                        kernel->cmp_i64((const int64_t*)col->values + base, n, int_op, int_t, masks);
+                } else {
+                        kernel->cmp_f64((const double*)col->values + base, n, op, value, masks);
+                }
+                count = _csv_scan_emit(masks, words, col->validity, base, sel, count);
+        }
+        return count;
+}
+
+int
+csv_column_count_if(const csv_column_t* col,
+                    csv_cmp_t op,
+                    double value)
+{
+        return _csv_column_scan(col, op, value, NULL);
+}
+
+int
+csv_column_select(const csv_column_t* col,
+                  csv_cmp_t op,
+                  double value,
+                  int* sel)
+{
+        if (!sel) {
+                return -1;
+        }
+        return _csv_column_scan(col, op, value, sel);
+}
+
+// -------------------------------------------------------------------------------------
+// Packed Columns
+// -------------------------------------------------------------------------------------
+
+#define _CSV_PACK_BLOCK 256 // Values per block; a multiple of 64 so validity words line up.
+
+// One block's header. Its residuals take `width` bits each, back to back,
+// starting at data[word].
+typedef struct {
+        int64_t min;        // Smallest valid value; the FOR base.
+        int64_t max;        // Largest valid value.
+        int64_t first;      // DELTA: the block's first value.
+        int64_t step;       // DELTA: the smallest difference, taken out before packing.
+        size_t word;
+        uint8_t width;      // 0..64.
+} _csv_pack_block_t;
+
+struct csv_packed_column {
+        csv_type_t type;
+        csv_packing_t packing;
+        int length;
+        int null_count;
+        int num_blocks;
+        _csv_pack_block_t* blocks;
+        uint64_t* data;
+        size_t num_words;
+        uint64_t* validity; // As in csv_column_t.
+};
+
+static inline
+int
+_csv_pack_block_len(const csv_packed_column_t* packed,
+                    int b)
+{
+        int rest = packed->length - b * _CSV_PACK_BLOCK;
+        return rest < _CSV_PACK_BLOCK ? rest : _CSV_PACK_BLOCK;
+}
+
+// Fills the header of one block and turns its values into unsigned residuals.
+// Nulls repeat the previous value (the minimum at the start), so they never
+// widen a block. Residuals use unsigned arithmetic, which wraps exactly even
+// where a difference overflows int64.
+static
+void
+_csv_pack_residuals(const int64_t* v,
+                    const uint64_t* validity,
+                    int n,
+                    csv_packing_t packing,
+                    _csv_pack_block_t* blk,
+                    uint64_t* res)
+{
+        int64_t lo = INT64_MAX;
+        int64_t hi = INT64_MIN;
+        for (int k = 0; k < n; k++) {
+                if (!validity || (validity[k >> 6] >> (k & 63)) & 1) {
+                        lo = v[k] < lo ? v[k] : lo;
+                        hi = v[k] > hi ? v[k] : hi;
+                }
+        }
+        if (lo > hi) {
+                lo = hi = 0; // No valid values.
+        }
+        blk->min = lo;
+        blk->max = hi;
+        blk->first = 0;
+        blk->step = 0;
+
+        int64_t prev = lo;
+        for (int k = 0; k < n; k++) {
+                bool valid = !validity || (validity[k >> 6] >> (k & 63)) & 1;
+                prev = valid ? v[k] : prev;
+                res[k] = (uint64_t)prev;
+        }
+
+        uint64_t bits = 0;
+        if (packing == CSV_PACK_FOR) {
+                for (int k = 0; k < n; k++) {
+                        res[k] -= (uint64_t)lo;
+                        bits |= res[k];
+                }
+        } else {
+                // Rebasing the differences on the smallest one makes them all
+                // non-negative, so descending runs pack as well as ascending ones.
+                int64_t step = INT64_MAX;
+                for (int k = 1; k < n; k++) {
+                        int64_t d = (int64_t)(res[k] - res[k - 1]);
+                        step = d < step ? d : step;
+                }
+                blk->first = (int64_t)res[0];
+                blk->step = n > 1 ? step : 0;
+                for (int k = n - 1; k > 0; k--) {
+                        res[k] = res[k] - res[k - 1] - (uint64_t)blk->step;
+                        bits |= res[k];
+                }
+                res[0] = 0;
+        }
+        blk->width = (uint8_t)(64 - _csv_clz64(bits));
+}
+
+// Decodes block `b` into out[0..n). Nulls come out as 0, as in csv_column_t.
+static
+void
+_csv_unpack_block(const csv_packed_column_t* packed,
+                  int b,
+                  int64_t* out)
+{
+        const _csv_pack_block_t* blk = &packed->blocks[b];
+        int n = _csv_pack_block_len(packed, b);
+        int w = blk->width;
+        const uint64_t* in = packed->data + blk->word;
+        uint64_t mask = w == 64 ? ~0ULL : (1ULL << w) - 1;
+        uint64_t* u = (uint64_t*)out;
+
+        if (packed->packing == CSV_PACK_FOR) {
+                // Branch-free: the high part is shifted in two steps so a
+                // word-aligned value (shift 0) takes nothing from in[i + 1],
+                // which the padding word keeps readable.
+                uint64_t base = (uint64_t)blk->min;
+                for (int k = 0; k < n && w > 0; k++) {
+                        size_t bit = (size_t)k * w;
+                        size_t i = bit >> 6;
+                        int shift = (int)(bit & 63);
+                        u[k] = base + (((in[i] >> shift) | (in[i + 1] << 1 << (63 - shift))) & mask);
+                }
+                for (int k = 0; k < n && w == 0; k++) {
+                        u[k] = base;
+                }
+        } else {
+                uint64_t acc = (uint64_t)blk->first;
+                uint64_t step = (uint64_t)blk->step;
+                u[0] = acc;
+                for (int k = 1; k < n; k++) {
+                        size_t bit = (size_t)k * w;
+                        size_t i = bit >> 6;
+                        int shift = (int)(bit & 63);
+                        acc += step + (w ? ((in[i] >> shift) | (in[i + 1] << 1 << (63 - shift))) & mask : 0);
+                        u[k] = acc;
+                }
+        }
+
+        if (packed->validity) {
+                const uint64_t* valid = packed->validity + (size_t)b * (_CSV_PACK_BLOCK / 64);
+                for (int k = 0; k < n; k += 64) {
+                        uint64_t word = valid[k >> 6];
+                        int m = n - k < 64 ? n - k : 64;
+                        for (int j = 0; word != ~0ULL && j < m; j++) {
+                                u[k + j] &= 0 - ((word >> j) & 1);
+                        }
+                }
+        }
+}
+
+// Decides `x op t` for a whole block from its value range: 1 when it holds
+// for every value, -1 when it holds for none, 0 when the block must be decoded.
+static
+int
+_csv_pack_verdict(csv_cmp_t op,
+                  int64_t t,
+                  int64_t min,
+                  int64_t max)
+{
+        switch (op) {
+        case CSV_CMP_EQ:
+                return t < min || t > max ? -1 : min == max ? 1 : 0;
+        case CSV_CMP_NE:
+                return t < min || t > max ? 1 : min == max ? -1 : 0;
+        case CSV_CMP_LT:
+                return max < t ? 1 : min >= t ? -1 : 0;
+        case CSV_CMP_LE:
+                return max <= t ? 1 : min > t ? -1 : 0;
+        case CSV_CMP_GT:
+                return min > t ? 1 : max <= t ? -1 : 0;
+        default:
+                return min >= t ? 1 : max < t ? -1 : 0;
+        }
+}
+
+csv_packed_column_t*
+csv_column_pack(const csv_column_t* col,
+                csv_packing_t packing)
+{
+        if (!col || (col->type != CSV_TYPE_INT64 && col->type != CSV_TYPE_BOOL) ||
+            (packing != CSV_PACK_FOR && packing != CSV_PACK_DELTA)) {
+                return NULL;
+        }
+        csv_packed_column_t* packed = (csv_packed_column_t*)calloc(1, sizeof(csv_packed_column_t));
+        if (!packed) {
+                return NULL;
+        }
+        packed->type = col->type;
+        packed->packing = packing;
+        packed->length = col->length;
+        packed->null_count = col->null_count;
+        packed->num_blocks = (col->length + _CSV_PACK_BLOCK - 1) / _CSV_PACK_BLOCK;
+        packed->blocks = (_csv_pack_block_t*)calloc(packed->num_blocks ? packed->num_blocks : 1, sizeof(_csv_pack_block_t));
+        bool ok = packed->blocks != NULL;
+        if (ok && col->validity) {
+                size_t words = ((size_t)col->length + 63) / 64;
+                packed->validity = (uint64_t*)malloc(words ? words * sizeof(uint64_t) : 1);
+                ok = packed->validity != NULL;
+                if (ok && words) {
+                        memcpy(packed->validity, col->validity, words * sizeof(uint64_t));
+                }
+        }
+
+        uint64_t res[_CSV_PACK_BLOCK];
+        size_t cap = 0;
+        for (int b = 0; b < packed->num_blocks && ok; b++) {
+                _csv_pack_block_t* blk = &packed->blocks[b];
+                int n = _csv_pack_block_len(packed, b);
+                size_t first = (size_t)b * _CSV_PACK_BLOCK;
+                _csv_pack_residuals((const int64_t*)col->values + first,
+                                    col->validity ? col->validity + first / 64 : NULL,
+                                    n, packing, blk, res);
+
+                int w = blk->width;
+                size_t words = ((size_t)n * w + 63) / 64;
+                if (packed->num_words + words + 1 > cap) { // +1: the decoder's padding word.
+                        size_t grown = cap ? cap * 2 : 1024;
+                        grown = grown < packed->num_words + words + 1 ? packed->num_words + words + 1 : grown;
+                        uint64_t* data = (uint64_t*)realloc(packed->data, grown * sizeof(uint64_t));
+                        if (!data) {
+                                ok = false;
+                                break;
+                        }
+                        packed->data = data;
+                        cap = grown;
+                }
+                uint64_t* out = packed->data + packed->num_words;
+                if (words) {
+                        memset(out, 0, words * sizeof(uint64_t));
+                }
+                for (int k = 0; k < n && w > 0; k++) {
+                        size_t bit = (size_t)k * w;
+                        size_t i = bit >> 6;
+                        int shift = (int)(bit & 63);
+                        out[i] |= res[k] << shift;
+                        if (shift + w > 64) {
+                                out[i + 1] |= res[k] >> (64 - shift);
+                        }
+                }
+                blk->word = packed->num_words;
+                packed->num_words += words;
+        }
+        if (!ok) {
+                csv_packed_free(&packed);
+                return NULL;
+        }
+        if (packed->num_words + 1 < cap) {
+                uint64_t* data = (uint64_t*)realloc(packed->data, (packed->num_words + 1) * sizeof(uint64_t));
+                packed->data = data ? data : packed->data;
+        }
+        if (packed->data) {
+                packed->data[packed->num_words] = 0;
+        }
+        return packed;
+}
+
+int
+csv_packed_decode(const csv_packed_column_t* packed,
+                  int begin,
+                  int count,
+                  int64_t* out)
+{
+        if (!packed || !out || begin < 0 || count < 0 || begin > packed->length - count) {
+                return -1;
+        }
+        int64_t buf[_CSV_PACK_BLOCK];
+        int done = 0;
+        while (done < count) {
+                int i = begin + done;
+                int b = i / _CSV_PACK_BLOCK;
+                int off = i % _CSV_PACK_BLOCK;
+                int n = _csv_pack_block_len(packed, b);
+                int take = n - off < count - done ? n - off : count - done;
+                if (take == n) {
+                        _csv_unpack_block(packed, b, out + done);
+                } else {
+                        _csv_unpack_block(packed, b, buf);
+                        memcpy(out + done, buf + off, (size_t)take * sizeof(int64_t));
+                }
+                done += take;
+        }
+        return count;
+}
+
+csv_column_t*
+csv_packed_unpack(const csv_packed_column_t* packed)
+{
+        if (!packed) {
+                return NULL;
+        }
+        csv_column_t* column = (csv_column_t*)calloc(1, sizeof(csv_column_t));
+        if (!column) {
+                return NULL;
+        }
+        size_t n = (size_t)packed->length;
+        size_t words = (n + 63) / 64;
+        column->type = packed->type;
+        column->length = packed->length;
+        column->null_count = packed->null_count;
+        column->values = malloc(n ? n * sizeof(int64_t) : 1);
+        if (packed->validity) {
+                column->validity = (uint64_t*)malloc(words ? words * sizeof(uint64_t) : 1);
+                if (column->validity && words) {
+                        memcpy(column->validity, packed->validity, words * sizeof(uint64_t));
+                }
+        }
+        if (!column->values || (packed->validity && !column->validity)) {
+                csv_column_free(&column);
+                return NULL;
+        }
+        csv_packed_decode(packed, 0, packed->length, (int64_t*)column->values);
+        return column;
+}
+
+int
+csv_packed_length(const csv_packed_column_t* packed)
+{
+        return packed ? packed->length : 0;
+}
+
+size_t
+csv_packed_size(const csv_packed_column_t* packed)
+{
+        if (!packed) {
+                return 0;
+        }
+        size_t words = packed->validity ? ((size_t)packed->length + 63) / 64 : 0;
+        return sizeof(csv_packed_column_t) +
+               (size_t)packed->num_blocks * sizeof(_csv_pack_block_t) +
+               (packed->num_words + 1 + words) * sizeof(uint64_t);
+}
+
+int
+csv_packed_aggregate(const csv_packed_column_t* packed,
+                     csv_aggregate_t* out)
+{
+        if (!packed || !out) {
+                return -1;
+        }
+        const _csv_kernel_t* kernel = _csv_get_kernel();
+        _csv_agg_acc_t acc;
+        _csv_agg_init(&acc);
+        int64_t buf[_CSV_PACK_BLOCK];
+        for (int b = 0; b < packed->num_blocks; b++) {
+                int n = _csv_pack_block_len(packed, b);
+                _csv_unpack_block(packed, b, buf);
+                if (!packed->validity) {
+                        kernel->agg_i64(buf, n, &acc);
+                        continue;
+                }
+                for (int k = 0; k < n; k += 64) {
+                        int m = n - k < 64 ? n - k : 64;
+                        uint64_t full = m == 64 ? ~0ULL : (1ULL << m) - 1;
+                        uint64_t word = packed->validity[((size_t)b * _CSV_PACK_BLOCK + k) >> 6];
+                        if (word == full) {
+                                kernel->agg_i64(buf + k, m, &acc);
+                        } else {
+                                _csv_agg_i64_masked(buf + k, m, word, &acc);
+                        }
+                }
+        }
+        _csv_agg_finish(&acc, true, out);
+        return 0;
+}
+
+// Like _csv_column_scan(), but a block whose min/max already decide the
+// comparison is answered from its header without being decoded.
+static
+int
+_csv_packed_scan(const csv_packed_column_t* packed,
+                 csv_cmp_t op,
+                 double value,
+                 int* sel)
+{
+        if (!packed || (unsigned)op > CSV_CMP_GE) {
+                return -1;
+        }
+        const _csv_kernel_t* kernel = _csv_get_kernel();
+        csv_cmp_t int_op = op;
+        int64_t int_t = 0;
+        int constant = _csv_int_threshold(op, value, &int_op, &int_t);
+
+        int64_t buf[_CSV_PACK_BLOCK];
+        uint64_t masks[_CSV_PACK_BLOCK / 64];
+        int count = 0;
+        for (int b = 0; b < packed->num_blocks; b++) {
+                const _csv_pack_block_t* blk = &packed->blocks[b];
+                int n = _csv_pack_block_len(packed, b);
+                int verdict = constant ? constant : _csv_pack_verdict(int_op, int_t, blk->min, blk->max);
+                if (verdict != 0) {
+                        _csv_scan_fill(masks, n, verdict > 0);
+                } else {
+                        _csv_unpack_block(packed, b, buf);
+                        kernel->cmp_i64(buf, n, int_op, int_t, masks);
+                }
+                count = _csv_scan_emit(masks, (n + 63) / 64, packed->validity, b * _CSV_PACK_BLOCK, sel, count);
+        }
+        return count;
+}
+
+int
+csv_packed_count_if(const csv_packed_column_t* packed,
+                    csv_cmp_t op,
+                    double value)
+{
+        return _csv_packed_scan(packed, op, value, NULL);
+}
+
+int
+csv_packed_select(const csv_packed_column_t* packed,
+                  csv_cmp_t op,
+                  double value,
+                  int* sel)
+{
+        if (!sel) {
+                return -1;
+        }
+        return _csv_packed_scan(packed, op, value, sel);
+}
+
+void
+csv_packed_free(csv_packed_column_t** packed_ptr)
+{
+        if (!packed_ptr || !*packed_ptr) {
+                return;
+        }
+        free((*packed_ptr)->blocks);
+        free((*packed_ptr)->data);
+        free((*packed_ptr)->validity);
+        free(*packed_ptr);
+        *packed_ptr = NULL;
+}
+
+// -------------------------------------------------------------------------------------
+// Views
+// -------------------------------------------------------------------------------------
+
+csv_view_t*
+csv_view_create(const csv_document_t* doc,
+                const int* rows,
+                int num_rows)
+{
+        if (!doc) {
+                return NULL;
+        }
+        if (!rows) {
+                num_rows = doc->num_rows;
+        }
+        if (num_rows < 0) {
+                return NULL;
+        }
+        for (int i = 0; rows && i < num_rows; i++) {
+                if (rows[i] < 0 || rows[i] >= doc->num_rows) {
+                        return NULL;
+                }
+        }
+        csv_view_t* view = (csv_view_t*)calloc(1, sizeof(csv_view_t));
+        if (!view) {
+                return NULL;
+        }
+        view->doc = doc;
+        view->num_rows = num_rows;
+        view->rows = (int*)malloc((num_rows > 0 ? num_rows : 1) * sizeof(int));
+        if (!view->rows) {
+                free(view);
+                return NULL;
+        }
+        for (int i = 0; i < num_rows; i++) {
+                view->rows[i] = rows ? rows[i] : i;
+        }
+        return view;
+}
+
+csv_view_t*
+csv_slice(const csv_document_t* doc,
+          int row_begin,
+          int row_end,
+          const int* cols,
+          int num_cols)
+{
+        if (!doc || (cols && num_cols < 0)) {
+                return NULL;
+        }
+        row_begin = row_begin < 0 ? 0 : (row_begin > doc->num_rows ? doc->num_rows : row_begin);
+        row_end = row_end > doc->num_rows ? doc->num_rows : row_end;
+        if (row_end < row_begin) {
+                row_end = row_begin;
+        }
+
+        csv_view_t* view = (csv_view_t*)calloc(1, sizeof(csv_view_t));
+        if (!view) {
+                return NULL;
+        }
+        view->doc = doc;
+        view->first_row = row_begin;
+        view->num_rows = row_end - row_begin;
+        if (cols) {
+                view->cols = (int*)malloc((num_cols > 0 ? num_cols : 1) * sizeof(int));
+                if (!view->cols) {
+                        free(view);
+                        return NULL;
+                }
+                for (int j = 0; j < num_cols; j++) {
+                        if (cols[j] < 0 || cols[j] >= doc->num_cols) {
+                                csv_view_free(&view);
+                                return NULL;
+                        }
+                        view->cols[j] = cols[j];
+                }
+                view->num_cols = num_cols;
+        }
+        return view;
+}
+
+void
+csv_view_free(csv_view_t** view_ptr)
+{
+        if (!view_ptr || !*view_ptr) {
+                return;
+        }
+        free((*view_ptr)->rows);
+        free((*view_ptr)->cols);
+        free(*view_ptr);
+        *view_ptr = NULL;
+}
+
+// An empty view with room for every row of `view` and the same projection.
+static
+csv_view_t*
+_csv_view_empty_like(const csv_view_t* view)
+{
+        csv_view_t* out = (csv_view_t*)calloc(1, sizeof(csv_view_t));
+        if (!out) {
+                return NULL;
+        }
+        out->doc = view->doc;
+        out->rows = (int*)malloc((view->num_rows > 0 ? view->num_rows : 1) * sizeof(int));
+        if (!out->rows) {
+                free(out);
+                return NULL;
+        }
+        if (view->cols) {
+                out->cols = (int*)malloc((view->num_cols > 0 ? view->num_cols : 1) * sizeof(int));
+                if (!out->cols) {
+                        csv_view_free(&out);
+                        return NULL;
+                }
+                memcpy(out->cols, view->cols, (size_t)view->num_cols * sizeof(int));
+                out->num_cols = view->num_cols;
+        }
+        return out;
+}
+
+csv_view_t*
+csv_view_filter(const csv_view_t* view,
+                csv_row_pred_fn pred,
+                void* ctx)
+{
+        if (!view || !pred) {
+                return NULL;
+        }
+        csv_view_t* out = _csv_view_empty_like(view);
+        if (!out) {
+                return NULL;
+        }
+        for (int i = 0; i < view->num_rows; i++) {
+                int row = _csv_view_row_index(view, i);
+                if (pred(view->doc->rows[row], ctx)) {
+                        out->rows[out->num_rows++] = row;
+                }
+        }
+        return out;
+}
+
+csv_view_t*
+csv_filter(const csv_document_t* doc,
+           csv_row_pred_fn pred,
+           void* ctx)
+{
+        if (!doc) {
+                return NULL;
+        }
+        csv_view_t all = _csv_view_identity(doc);
+        return csv_view_filter(&all, pred, ctx);
+}
+
+csv_view_t*
+csv_filter_column(const csv_document_t* doc,
+                  const csv_column_t* column,
+                  csv_cmp_t op,
+                  double value)
+{
+        if (!doc || !column || column->length != doc->num_rows) {
+                return NULL;
+        }
+        csv_view_t* view = (csv_view_t*)calloc(1, sizeof(csv_view_t));
+        if (!view) {
+                return NULL;
+        }
+        view->doc = doc;
+        view->rows = (int*)malloc((column->length > 0 ? column->length : 1) * sizeof(int));
+        if (!view->rows) {
+                free(view);
+                return NULL;
+        }
+        view->num_rows = csv_column_select(column, op, value, view->rows);
+        if (view->num_rows < 0) {
+                csv_view_free(&view);
+                return NULL;
+        }
+        return view;
+}
+
+// A sort key decoded once per row so the comparisons never re-parse text.
+typedef struct {
+        int row;
+        bool null;
+        int64_t i;
+        double d;
+        const char* s;
+} _csv_sort_key_t;
+
+static
+int
+_csv_sort_key_cmp(const _csv_sort_key_t* a,
+                  const _csv_sort_key_t* b,
+                  csv_type_t type,
+                  bool descending)
+{
+        if (a->null || b->null) {
+                return (int)a->null - (int)b->null; // Nulls last either way.
+        }
+        int c;
+        if (type == CSV_TYPE_INT64 || type == CSV_TYPE_BOOL) {
+                c = (a->i > b->i) - (a->i < b->i);
+        } else if (type == CSV_TYPE_DOUBLE) {
+                c = (a->d > b->d) - (a->d < b->d);
+        } else {
+                c = strcmp(a->s, b->s);
+        }
+        return descending ? -c : c;
+}
+
+// Decodes `field` (NULL if missing) as a sort key of the given type.
+static
+void
+_csv_sort_key_decode(_csv_sort_key_t* key,
+                     const char* field,
+                     csv_type_t type)
+{
+        key->s = field;
+        if (type == CSV_TYPE_INT64) {
+                key->null = !_csv_parse_int64(field, &key->i);
+        } else if (type == CSV_TYPE_DOUBLE) {
+                key->null = !_csv_parse_double(field, &key->d);
+        } else if (type == CSV_TYPE_BOOL) {
+                key->null = !field || !_csv_parse_bool(field, strlen(field), &key->i);
+        } else {
+                key->null = field == NULL;
+        }
+}
+
+// Bottom-up merge sort: stable, and needs no comparator context (unlike qsort).
+static
+void
+_csv_sort_keys(_csv_sort_key_t* keys,
+               _csv_sort_key_t* tmp,
+               int n,
+               csv_type_t type,
+               bool descending)
+{
+        _csv_sort_key_t* src = keys;
+        _csv_sort_key_t* dst = tmp;
+        for (int width = 1; width < n; width *= 2) {
+                for (int lo = 0; lo < n; lo += 2 * width) {
+                        int mid = lo + width < n ? lo + width : n;
+                        int hi = lo + 2 * width < n ? lo + 2 * width : n;
+                        int i = lo, j = mid, k = lo;
+                        while (i < mid && j < hi) {
+                                dst[k++] = _csv_sort_key_cmp(&src[j], &src[i], type, descending) < 0 ? src[j++] : src[i++];
+                        }
+                        while (i < mid) {
+                                dst[k++] = src[i++];
+                        }
+                        while (j < hi) {
+                                dst[k++] = src[j++];
+                        }
+                }
+                _csv_sort_key_t* swap = src;
+                src = dst;
+                dst = swap;
+        }
+        if (src != keys) {
+                memcpy(keys, src, (size_t)n * sizeof(_csv_sort_key_t));
+        }
+}
+
+int
+csv_view_sort(csv_view_t* view,
+              int col,
+              csv_type_t type,
+              bool descending)
+{
+        if (!view || col < 0 || (view->cols && col >= view->num_cols)) {
+                return -1;
+        }
+        if (view->cols) {
+                col = view->cols[col];
+        }
+        int n = view->num_rows;
+        if (!view->rows) {
+                // An all-rows view gets an explicit selection vector to reorder.
+                view->rows = (int*)malloc((n > 0 ? n : 1) * sizeof(int));
+                if (!view->rows) {
+                        return -1;
+                }
+                for (int i = 0; i < n; i++) {
+                        view->rows[i] = view->first_row + i;
+                }
+        }
+        _csv_sort_key_t* keys = (_csv_sort_key_t*)malloc((n > 0 ? n : 1) * sizeof(_csv_sort_key_t));
+        _csv_sort_key_t* tmp = (_csv_sort_key_t*)malloc((n > 0 ? n : 1) * sizeof(_csv_sort_key_t));
+        if (!keys || !tmp) {
+                free(keys);
+                free(tmp);
+                return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+                const csv_row_t* row = view->doc->rows[view->rows[i]];
+                const char* field = col < row->num_fields ? row->fields[col] : NULL;
+                keys[i].row = view->rows[i];
+                _csv_sort_key_decode(&keys[i], field, type);
+        }
+        _csv_sort_keys(keys, tmp, n, type, descending);
+        for (int i = 0; i < n; i++) {
+                view->rows[i] = keys[i].row;
+        }
+        free(keys);
+        free(tmp);
+        return 0;
+}
+
+int
+csv_view_write(const csv_view_t* view,
+               const char* file_path)
+{
+        if (!view) {
+                return -1;
+        }
+        return _csv_write_view(view, file_path);
+}
+
+void
+csv_view_show(const csv_view_t* view)
+{
+        if (!view) {
+                printf("CSV View is NULL.\n");
+                return;
+        }
+        _csv_show_view(view);
+}
+
+csv_document_t*
+csv_view_materialize(const csv_view_t* view)
+{
+        if (!view) {
+                return NULL;
+        }
+        return _csv_share_rows(view);
+}
+
+// -------------------------------------------------------------------------------------
+// Row Hashing
+// -------------------------------------------------------------------------------------
+
+// Key field `k` of a row: column key_cols[k], or field k for whole-row keys.
+// Missing columns read as "".
+static inline
+const char*
+_csv_key_field(const csv_row_t* row,
+               const int* key_cols,
+               int k)
+{
+        int col = key_cols ? key_cols[k] : k;
+        return col >= 0 && col < row->num_fields ? row->fields[col] : "";
+}
+
+static inline
+int
+_csv_key_width(const csv_row_t* row,
+               const int* key_cols,
+               int num_keys)
+{
+        return key_cols ? num_keys : row->num_fields;
+}
+
+uint64_t
+csv_row_hash(const csv_row_t* row,
+             const int* cols,
+             int num_cols)
+{
+        // Each field is hashed on its own (XXH64 mixes in its length) and folded
+        // in order, so field boundaries matter and no row is re-serialized.
+        int width = _csv_key_width(row, cols, num_cols);
+        uint64_t h = _CSV_XXH_P5 + (uint64_t)width;
+        for (int k = 0; k < width; k++) {
+                const char* field = _csv_key_field(row, cols, k);
+                h = _csv_xxh_fold(h, _csv_hash_bytes(field, strlen(field), 0));
+        }
+        return _csv_xxh_avalanche(h);
+}
+
+uint64_t
+csv_fingerprint(const csv_document_t* doc)
+{
+        uint64_t fp = _CSV_XXH_P5;
+        if (!doc) {
+                return _csv_xxh_avalanche(fp);
+        }
         if (doc->header) {
-                for (int i = 0; i < doc->num_cols; i++) {
-                        printf("%-*s | ", col_widths[i], doc->header[i]);
+                csv_row_t header = { doc->header, doc->num_cols, 0 };
+                fp = _csv_xxh_fold(fp, csv_row_hash(&header, NULL, 0));
+        }
+        for (int i = 0; i < doc->num_rows; i++) {
+                fp = _csv_xxh_fold(fp, csv_row_hash(doc->rows[i], NULL, 0));
+        }
+        return _csv_xxh_avalanche(fp);
+}
+
+// -------------------------------------------------------------------------------------
+// Streaming Reader
+// -------------------------------------------------------------------------------------
+
+struct csv_reader {
+        FILE* file;
+        _csv_buf_t line;
+        csv_row_t* header;
+        csv_row_t* row;     // The row handed out by the last csv_reader_next().
+        char* header_line;  // The raw header line, for tools that copy it through.
+        _csv_spans_t spans; // Filled by _csv_reader_next_spans() instead of `row`.
+        csv_batch_t batch;
+        _csv_buf_t* batch_data;     // One value buffer per batch column.
+        size_t* batch_offsets;      // (rows + 1) offsets per batch column.
+        int batch_rows;             // Row capacity of batch_offsets.
+        uint64_t fingerprint;
+        long offset;        // Byte offset of the next unread line.
+        long line_offset;   // Byte offset of the line in `line`.
+};
+
+// Reads the next non-empty line into reader->line, keeping the byte offsets.
+static
+bool
+_csv_reader_line(csv_reader_t* reader)
+{
+        size_t consumed;
+        while ((consumed = _csv_read_line(reader->file, &reader->line)) > 0) {
+                reader->line_offset = reader->offset;
+                reader->offset += (long)consumed;
+                if (reader->line.len > 0) {
+                        return true; // Empty lines are skipped, as csv_read() does.
+                }
+        }
+        return false;
+}
+
+csv_reader_t*
+csv_reader_open(const char* file_path,
+                bool has_header)
+{
+        FILE* file = fopen(file_path, "r");
+        if (!file) {
+                perror("Error opening file");
+                return NULL;
+        }
+        csv_reader_t* reader = (csv_reader_t*)calloc(1, sizeof(csv_reader_t));
+        if (!reader) {
+                fclose(file);
+                return NULL;
+        }
+        reader->file = file;
+        reader->fingerprint = _CSV_XXH_P5;
+        size_t consumed = has_header ? _csv_read_line(file, &reader->line) : 0;
+        if (consumed > 0) {
+                reader->offset = (long)consumed;
+                reader->header = _parse_csv_line(reader->line.data);
+                reader->header_line = _csv_strdup(reader->line.data);
+                reader->fingerprint = _csv_xxh_fold(reader->fingerprint, csv_row_hash(reader->header, NULL, 0));
+        }
+        return reader;
+}
+
+const csv_row_t*
+csv_reader_header(const csv_reader_t* reader)
+{
+        return reader ? reader->header : NULL;
+}
+
+const csv_row_t*
+csv_reader_next(csv_reader_t* reader)
+{
+        if (!reader) {
+                return NULL;
+        }
+        _csv_row_release(reader->row);
+        reader->row = NULL;
+        if (!_csv_reader_line(reader)) {
+                return NULL;
+        }
+        reader->row = _parse_csv_line(reader->line.data);
+        reader->fingerprint = _csv_xxh_fold(reader->fingerprint, csv_row_hash(reader->row, NULL, 0));
+        return reader->row;
+}
+
+// Advances like csv_reader_next() but only locates the first `max_fields`
+// fields (0 for all) in reader->spans, allocating nothing per row. Rows read
+// this way are not folded into the fingerprint.
+static
+bool
+_csv_reader_next_spans(csv_reader_t* reader,
+                       int max_fields)
+{
+        _csv_row_release(reader->row);
+        reader->row = NULL;
+        return _csv_reader_line(reader) &&
+               _csv_tokenize(reader->line.data, reader->line.data + reader->line.len, max_fields, &reader->spans);
+}
+
+// csv_row_hash() of a whole row given as spans.
+static
+uint64_t
+_csv_spans_hash(const _csv_spans_t* spans)
+{
+        uint64_t h = _CSV_XXH_P5 + (uint64_t)spans->count;
+        for (int k = 0; k < spans->count; k++) {
+                h = _csv_xxh_fold(h, _csv_hash_bytes(spans->data[k].start, (size_t)spans->data[k].len, 0));
+        }
+        return _csv_xxh_avalanche(h);
+}
+
+// Sizes the batch for `width` columns and `max_rows` rows on first use.
+static
+bool
+_csv_reader_batch_init(csv_reader_t* reader,
+                       int width,
+                       int max_rows)
+{
+        csv_batch_t* batch = &reader->batch;
+        if (!batch->columns) {
+                batch->columns = (csv_batch_column_t*)calloc(width > 0 ? width : 1, sizeof(csv_batch_column_t));
+                reader->batch_data = (_csv_buf_t*)calloc(width > 0 ? width : 1, sizeof(_csv_buf_t));
+                if (!batch->columns || !reader->batch_data) {
+                        return false;
+                }
+                batch->num_cols = width;
+        }
+        if (max_rows > reader->batch_rows) {
+                size_t* offsets = (size_t*)realloc(reader->batch_offsets,
+                                                   (size_t)(batch->num_cols > 0 ? batch->num_cols : 1) * (max_rows + 1) * sizeof(size_t));
+                if (!offsets) {
+                        return false;
+                }
+                reader->batch_offsets = offsets;
+                reader->batch_rows = max_rows;
+        }
+        for (int c = 0; c < batch->num_cols; c++) {
+                reader->batch_data[c].len = 0;
+                reader->batch_offsets[(size_t)c * (reader->batch_rows + 1)] = 0;
+        }
+        batch->num_rows = 0;
+        return true;
+}
+
+const csv_batch_t*
+csv_reader_next_batch(csv_reader_t* reader,
+                      int max_rows)
+{
+        if (!reader || max_rows <= 0) {
+                return NULL;
+        }
+        _csv_row_release(reader->row);
+        reader->row = NULL;
+        csv_batch_t* batch = &reader->batch;
+        bool sized = batch->columns != NULL;
+        if (sized && !_csv_reader_batch_init(reader, batch->num_cols, max_rows)) {
+                return NULL;
+        }
+
+        while (batch->num_rows < max_rows && _csv_reader_line(reader)) {
+                if (!_csv_tokenize(reader->line.data, reader->line.data + reader->line.len, 0, &reader->spans)) {
+                        return NULL;
+                }
+                if (!sized) {
+                        int width = reader->header ? reader->header->num_fields : reader->spans.count;
+                        if (!_csv_reader_batch_init(reader, width, max_rows)) {
+                                return NULL;
+                        }
+                        sized = true;
+                }
+                reader->fingerprint = _csv_xxh_fold(reader->fingerprint, _csv_spans_hash(&reader->spans));
+
+                int r = batch->num_rows++;
+                for (int c = 0; c < batch->num_cols; c++) {
+                        _csv_buf_t* data = &reader->batch_data[c];
+                        size_t* offsets = reader->batch_offsets + (size_t)c * (reader->batch_rows + 1);
+                        const _csv_span_t* span = c < reader->spans.count ? &reader->spans.data[c] : NULL;
+                        if ((span && !_csv_buf_append(data, span->start, (size_t)span->len)) ||
+                            !_csv_buf_append(data, "", 1)) {
+                                return NULL;
+                        }
+                        offsets[r + 1] = data->len;
+                }
+        }
+        if (batch->num_rows == 0) {
+                return NULL;
+        }
+        // Buffers may have moved while filling, so publish the pointers last.
+        for (int c = 0; c < batch->num_cols; c++) {
+                batch->columns[c].offsets = reader->batch_offsets + (size_t)c * (reader->batch_rows + 1);
+                batch->columns[c].data = reader->batch_data[c].data;
+        }
+        return batch;
+}
+
+const char*
+csv_batch_field(const csv_batch_t* batch,
+                int row,
+                int col)
+{
+        if (!batch || row < 0 || row >= batch->num_rows || col < 0 || col >= batch->num_cols) {
+                return NULL;
+        }
+        return batch->columns[col].data + batch->columns[col].offsets[row];
+}
+
+uint64_t
+csv_reader_fingerprint(const csv_reader_t* reader)
+{
+        return _csv_xxh_avalanche(reader ? reader->fingerprint : _CSV_XXH_P5);
+}
+
+int
+csv_file_fingerprint(const char* file_path,
+                     bool has_header,
+                     uint64_t* fingerprint)
+{
+        csv_reader_t* reader = csv_reader_open(file_path, has_header);
+        if (!reader) {
+                return -1;
+        }
+        while (csv_reader_next(reader)) {
+        }
+        *fingerprint = csv_reader_fingerprint(reader);
+        csv_reader_close(&reader);
+        return 0;
+}
+
+void
+csv_reader_close(csv_reader_t** reader_ptr)
+{
+        if (!reader_ptr || !*reader_ptr) {
+                return;
+        }
+        csv_reader_t* reader = *reader_ptr;
+        _csv_row_release(reader->header);
+        _csv_row_release(reader->row);
+        free(reader->header_line);
+        free(reader->spans.data);
+        for (int c = 0; c < reader->batch.num_cols; c++) {
+                _csv_buf_free(&reader->batch_data[c]);
+        }
+        free(reader->batch_data);
+        free(reader->batch_offsets);
+        free(reader->batch.columns);
+        _csv_buf_free(&reader->line);
+        fclose(reader->file);
+        free(reader);
+        *reader_ptr = NULL;
+}
+
+// -------------------------------------------------------------------------------------
+// Deduplication
+// -------------------------------------------------------------------------------------
+
+static
+bool
+_csv_key_equal(const csv_row_t* a,
+               const csv_row_t* b,
+               const int* key_cols,
+               int num_keys)
+{
+        int width = _csv_key_width(a, key_cols, num_keys);
+        if (width != _csv_key_width(b, key_cols, num_keys)) {
+                return false;
+        }
+        for (int k = 0; k < width; k++) {
+                if (strcmp(_csv_key_field(a, key_cols, k), _csv_key_field(b, key_cols, k)) != 0) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+csv_view_t*
+csv_dedup(const csv_document_t* doc,
+          const int* key_cols,
+          int num_keys,
+          csv_keep_t keep)
+{
+        if (!doc) {
+                return NULL;
+        }
+        int n = doc->num_rows;
+        csv_view_t* view = csv_view_create(doc, NULL, 0);
+        bool* kept = (bool*)calloc(n > 0 ? n : 1, sizeof(bool));
+        _csv_htab_t seen;
+        if (!view || !kept || !_csv_htab_init(&seen, (size_t)n)) {
+                csv_view_free(&view);
+                free(kept);
+                return NULL;
+        }
+
+        // Keeping the last occurrence is keeping the first one scanning backwards.
+        for (int step = 0; step < n; step++) {
+                int i = keep == CSV_KEEP_LAST ? n - 1 - step : step;
+                const csv_row_t* row = doc->rows[i];
+                uint64_t hash = csv_row_hash(row, key_cols, num_keys);
+                size_t cursor = _csv_htab_probe(&seen, hash);
+                int64_t* other;
+                bool duplicate = false;
+                while ((other = _csv_htab_next(&seen, hash, &cursor))) {
+                        if (_csv_key_equal(row, doc->rows[*other], key_cols, num_keys)) {
+                                duplicate = true;
+                                break;
+                        }
+                }
+                if (!duplicate) {
+                        if (!_csv_htab_insert(&seen, hash, i)) {
+                                csv_view_free(&view);
+                                view = NULL;
+                                break;
+                        }
+                        kept[i] = true;
+                }
+        }
+
+        if (view) {
+                view->num_rows = 0;
+                for (int i = 0; i < n; i++) {
+                        if (kept[i]) {
+                                view->rows[view->num_rows++] = i;
+                        }
+                }
+        }
+        _csv_htab_free(&seen);
+        free(kept);
+        return view;
+}
+
+// The distinct keys seen by a streaming pass. Keys are serialized into one
+// arena as a length followed by NUL-terminated fields; the table maps a key
+// hash to its arena offset and the ordinal of the row that owns it.
+typedef struct {
+        _csv_htab_t table;
+        _csv_buf_t arena;
+        _csv_buf_t scratch;
+} _csv_keyset_t;
+
+static
+bool
+_csv_keyset_serialize(_csv_buf_t* out,
+                      const csv_row_t* row,
+                      const int* key_cols,
+                      int num_keys)
+{
+        out->len = 0;
+        int width = _csv_key_width(row, key_cols, num_keys);
+        for (int k = 0; k < width; k++) {
+                const char* field = _csv_key_field(row, key_cols, k);
+                if (!_csv_buf_append(out, field, strlen(field) + 1)) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+// Finds the slot of the row's key. Returns NULL if the key is new, leaving its
+// serialized form in ks->scratch for _csv_keyset_add().
+static
+int64_t*
+_csv_keyset_find(_csv_keyset_t* ks,
+                 const csv_row_t* row,
+                 const int* key_cols,
+                 int num_keys,
+                 uint64_t hash,
+                 bool* failed)
+{
+        *failed = !_csv_keyset_serialize(&ks->scratch, row, key_cols, num_keys);
+        if (*failed) {
+                return NULL;
+        }
+        size_t cursor = _csv_htab_probe(&ks->table, hash);
+        int64_t* slot;
+        while ((slot = _csv_htab_next(&ks->table, hash, &cursor))) {
+                const char* stored = ks->arena.data + *slot;
+                size_t len;
+                memcpy(&len, stored, sizeof(len));
+                if (len == ks->scratch.len && memcmp(stored + sizeof(len), ks->scratch.data, len) == 0) {
+                        return slot;
+                }
+        }
+        return NULL;
+}
+
+// Adds the key left in ks->scratch and records `ordinal` next to it.
+static
+bool
+_csv_keyset_add(_csv_keyset_t* ks,
+                uint64_t hash,
+                long ordinal)
+{
+        size_t offset = ks->arena.len;
+        size_t len = ks->scratch.len;
+        if (!_csv_buf_append(&ks->arena, (const char*)&ordinal, sizeof(ordinal)) ||
+            !_csv_buf_append(&ks->arena, (const char*)&len, sizeof(len)) ||
+            !_csv_buf_append(&ks->arena, ks->scratch.data, len)) {
+                return false;
+        }
+        return _csv_htab_insert(&ks->table, hash, (int64_t)(offset + sizeof(ordinal)));
+}
+
+// The (unaligned) row ordinal stored in front of a key found by _csv_keyset_find().
+static inline
+void*
+_csv_keyset_ordinal(_csv_keyset_t* ks,
+                    const int64_t* slot)
+{
+        return ks->arena.data + *slot - sizeof(long);
+}
+
+static
+void
+_csv_keyset_free(_csv_keyset_t* ks)
+{
+        _csv_htab_free(&ks->table);
+        _csv_buf_free(&ks->arena);
+        _csv_buf_free(&ks->scratch);
+}
+
+// Writes a raw record line followed by a newline.
+static
+bool
+_csv_fwrite_line(FILE* file,
+                 const char* line,
+                 size_t len)
+{
+        return fwrite(line, 1, len, file) == len && fputc('\n', file) != EOF;
+}
+
+long
+csv_dedup_file(const char* in_path,
+               bool has_header,
+               const int* key_cols,
+               int num_keys,
+               csv_keep_t keep,
+               const char* out_path)
+{
+        _csv_keyset_t ks;
+        memset(&ks, 0, sizeof(ks));
+        if (!_csv_htab_init(&ks.table, 1024)) {
+                return -1;
+        }
+
+        // Pass 1 (CSV_KEEP_LAST only): remember the ordinal of each key's last row.
+        // Arena entries are unaligned, so ordinals are moved with memcpy.
+        if (keep == CSV_KEEP_LAST) {
+                csv_reader_t* reader = csv_reader_open(in_path, has_header);
+                if (!reader) {
+                        _csv_keyset_free(&ks);
+                        return -1;
+                }
+                const csv_row_t* row;
+                long ordinal = 0;
+                bool failed = false;
+                while (!failed && (row = csv_reader_next(reader))) {
+                        uint64_t hash = csv_row_hash(row, key_cols, num_keys);
+                        int64_t* slot = _csv_keyset_find(&ks, row, key_cols, num_keys, hash, &failed);
+                        if (slot) {
+                                memcpy(_csv_keyset_ordinal(&ks, slot), &ordinal, sizeof(ordinal));
+                        } else if (!failed) {
+                                failed = !_csv_keyset_add(&ks, hash, ordinal);
+                        }
+                        ordinal++;
+                }
+                csv_reader_close(&reader);
+                if (failed) {
+                        _csv_keyset_free(&ks);
+                        return -1;
+                }
+        }
+
+        csv_reader_t* reader = csv_reader_open(in_path, has_header);
+        FILE* out = reader ? fopen(out_path, "w") : NULL;
+        if (!out) {
+                if (reader) {
+                        perror("Error opening file for writing");
+                }
+                csv_reader_close(&reader);
+                _csv_keyset_free(&ks);
+                return -1;
+        }
+
+        // Kept records are copied verbatim, so quoting survives.
+        bool failed = false;
+        if (reader->header_line) {
+                failed = !_csv_fwrite_line(out, reader->header_line, strlen(reader->header_line));
+        }
+
+        // Pass 2: write each row that owns its key.
+        long written = 0;
+        long ordinal = 0;
+        const csv_row_t* row;
+        while (!failed && (row = csv_reader_next(reader))) {
+                uint64_t hash = csv_row_hash(row, key_cols, num_keys);
+                int64_t* slot = _csv_keyset_find(&ks, row, key_cols, num_keys, hash, &failed);
+                bool emit;
+                if (keep == CSV_KEEP_LAST) {
+                        long last = -1;
+                        if (slot) {
+                                memcpy(&last, _csv_keyset_ordinal(&ks, slot), sizeof(last));
+                        }
+                        emit = last == ordinal;
+                } else {
+                        emit = !slot && !failed;
+                        if (emit) {
+                                failed = !_csv_keyset_add(&ks, hash, ordinal);
+                        }
+                }
+                if (emit && !failed) {
+                        failed = !_csv_fwrite_line(out, reader->line.data, reader->line.len);
+                        written++;
+                }
+                ordinal++;
+        }
+
+        if (fclose(out) != 0) {
+                failed = true;
+        }
+        csv_reader_close(&reader);
+        _csv_keyset_free(&ks);
+        return failed ? -1 : written;
+}
+
+// -------------------------------------------------------------------------------------
+// Diff
+// -------------------------------------------------------------------------------------
+
+// One row of the indexed (smaller) file. Its serialized key, its serialized
+// fields (for comparing values) and its raw line (for output, so quoting
+// survives) are stored back to back in the index arena.
+typedef struct {
+        size_t offset;
+        size_t key_len;
+        size_t row_len;
+        size_t line_len;
+        bool matched;
+} _csv_diff_entry_t;
+
+typedef struct {
+        _csv_htab_t table;
+        _csv_buf_t arena;
+        _csv_diff_entry_t* entries;
+        size_t count;
+        size_t capacity;
+} _csv_diff_index_t;
+
+static
+void
+_csv_diff_index_free(_csv_diff_index_t* index)
+{
+        _csv_htab_free(&index->table);
+        _csv_buf_free(&index->arena);
+        free(index->entries);
+}
+
+static
+bool
+_csv_diff_index_add(_csv_diff_index_t* index,
+                    const csv_reader_t* reader,
+                    const csv_row_t* row,
+                    const int* key_cols,
+                    int num_keys,
+                    _csv_buf_t* scratch)
+{
+        if (index->count == index->capacity) {
+                size_t capacity = index->capacity ? index->capacity * 2 : 1024;
+                _csv_diff_entry_t* entries = (_csv_diff_entry_t*)realloc(index->entries, capacity * sizeof(_csv_diff_entry_t));
+                if (!entries) {
+                        return false;
+                }
+                index->entries = entries;
+                index->capacity = capacity;
+        }
+        _csv_diff_entry_t* entry = &index->entries[index->count];
+        entry->offset = index->arena.len;
+        entry->matched = false;
+        if (!_csv_keyset_serialize(scratch, row, key_cols, num_keys) ||
+            !_csv_buf_append(&index->arena, scratch->data, scratch->len)) {
+                return false;
+        }
+        entry->key_len = scratch->len;
+        if (!_csv_keyset_serialize(scratch, row, NULL, 0) ||
+            !_csv_buf_append(&index->arena, scratch->data, scratch->len)) {
+                return false;
+        }
+        entry->row_len = scratch->len;
+        if (!_csv_buf_append(&index->arena, reader->line.data, reader->line.len)) {
+                return false;
+        }
+        entry->line_len = reader->line.len;
+        if (!_csv_htab_insert(&index->table, csv_row_hash(row, key_cols, num_keys), (int64_t)index->count)) {
+                return false;
+        }
+        index->count++;
+        return true;
+}
+
+// Finds the first unmatched entry with the same key as `row`, whose key is
+// already serialized in `key`.
+static
+_csv_diff_entry_t*
+_csv_diff_index_find(_csv_diff_index_t* index,
+                     const csv_row_t* row,
+                     const int* key_cols,
+                     int num_keys,
+                     const _csv_buf_t* key)
+{
+        uint64_t hash = csv_row_hash(row, key_cols, num_keys);
+        size_t cursor = _csv_htab_probe(&index->table, hash);
+        int64_t* slot;
+        // The table returns equal hashes in insertion order, so the first
+        // unmatched candidate is the earliest row with this key.
+        while ((slot = _csv_htab_next(&index->table, hash, &cursor))) {
+                _csv_diff_entry_t* entry = &index->entries[*slot];
+                if (!entry->matched && entry->key_len == key->len &&
+                    memcmp(index->arena.data + entry->offset, key->data, key->len) == 0) {
+                        return entry;
+                }
+        }
+        return NULL;
+}
+
+// Writes `label`, a comma and a raw record line, so the record keeps its quoting.
+static
+bool
+_csv_diff_emit(FILE* out,
+               const char* label,
+               const char* line,
+               size_t len,
+               _csv_buf_t* scratch)
+{
+        scratch->len = 0;
+        if (!_csv_buf_append(scratch, label, strlen(label)) ||
+            !_csv_buf_append(scratch, ",", 1) ||
+            !_csv_buf_append(scratch, line, len) ||
+            !_csv_buf_append(scratch, "\n", 1)) {
+                return false;
+        }
+        return fwrite(scratch->data, 1, scratch->len, out) == scratch->len;
+}
+
+// Writes an indexed row from its stored raw line.
+static
+bool
+_csv_diff_emit_entry(FILE* out,
+                     const char* label,
+                     const _csv_diff_index_t* index,
+                     const _csv_diff_entry_t* entry,
+                     _csv_buf_t* scratch)
+{
+        const char* line = index->arena.data + entry->offset + entry->key_len + entry->row_len;
+        return _csv_diff_emit(out, label, line, entry->line_len, scratch);
+}
+
+static
+long
+_csv_file_size(const char* path)
+{
+        FILE* file = fopen(path, "rb");
+        if (!file) {
+                return -1;
+        }
+        long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+        fclose(file);
+        return size;
+}
+
+long
+csv_diff(const char* old_path,
+         const char* new_path,
+         bool has_header,
+         const int* key_cols,
+         int num_keys,
+         const char* out_path)
+{
+        // Index the smaller file; stream the larger one.
+        bool index_old = _csv_file_size(old_path) <= _csv_file_size(new_path);
+        const char* label_streamed = index_old ? "added" : "removed";
+        const char* label_unmatched = index_old ? "removed" : "added";
+
+        csv_reader_t* indexed = csv_reader_open(index_old ? old_path : new_path, has_header);
+        csv_reader_t* streamed = indexed ? csv_reader_open(index_old ? new_path : old_path, has_header) : NULL;
+        FILE* out = streamed ? fopen(out_path, "w") : NULL;
+        if (!out) {
+                if (streamed) {
+                        perror("Error opening file for writing");
+                }
+                csv_reader_close(&indexed);
+                csv_reader_close(&streamed);
+                return -1;
+        }
+
+        _csv_diff_index_t index;
+        memset(&index, 0, sizeof(index));
+        _csv_buf_t key = { NULL, 0, 0 };
+        _csv_buf_t scratch = { NULL, 0, 0 };
+        bool failed = !_csv_htab_init(&index.table, 1024);
+
+        const csv_row_t* row;
+        while (!failed && (row = csv_reader_next(indexed))) {
+                failed = !_csv_diff_index_add(&index, indexed, row, key_cols, num_keys, &scratch);
+        }
+
+        const char* header = (index_old ? streamed : indexed)->header_line;
+        if (!failed && header) {
+                failed = !_csv_diff_emit(out, "_diff", header, strlen(header), &scratch);
+        }
+
+        long written = 0;
+        while (!failed && (row = csv_reader_next(streamed))) {
+                if (!_csv_keyset_serialize(&key, row, key_cols, num_keys)) {
+                        failed = true;
+                        break;
+                }
+                _csv_diff_entry_t* entry = _csv_diff_index_find(&index, row, key_cols, num_keys, &key);
+                if (!entry) {
+                        failed = !_csv_diff_emit(out, label_streamed, streamed->line.data, streamed->line.len, &scratch);
+                        written++;
+                        continue;
+                }
+                entry->matched = true;
+                // Keys are equal, so the rows differ exactly when a non-key field does.
+                if (!_csv_keyset_serialize(&key, row, NULL, 0)) {
+                        failed = true;
+                        break;
+                }
+                if (entry->row_len != key.len ||
+                    memcmp(index.arena.data + entry->offset + entry->key_len, key.data, key.len) != 0) {
+                        failed = index_old ? !_csv_diff_emit(out, "changed", streamed->line.data, streamed->line.len, &scratch)
+                                           : !_csv_diff_emit_entry(out, "changed", &index, entry, &scratch);
+                        written++;
+                }
+        }
+
+        for (size_t i = 0; !failed && i < index.count; i++) {
+                if (!index.entries[i].matched) {
+                        failed = !_csv_diff_emit_entry(out, label_unmatched, &index, &index.entries[i], &scratch);
+                        written++;
+                }
+        }
+
+        if (fclose(out) != 0) {
+                failed = true;
+        }
+        csv_reader_close(&indexed);
+        csv_reader_close(&streamed);
+        _csv_diff_index_free(&index);
+        _csv_buf_free(&key);
+        _csv_buf_free(&scratch);
+        return failed ? -1 : written;
+}
+
+// -------------------------------------------------------------------------------------
+// File Tools
+// -------------------------------------------------------------------------------------
+
+#define _CSV_WRITER_FLUSH (64 * 1024)
+
+// Expands an output pattern containing exactly one integer conversion
+// (flags, width and precision allowed) and any number of "%%". Returns a
+// malloc'd path, or NULL if the pattern is not of that form.
+static
+char*
+_csv_format_path(const char* pattern,
+                 int index)
+{
+        int conversions = 0;
+        for (const char* p = pattern; *p; p++) {
+                if (*p != '%') {
+                        continue;
+                }
+                if (*++p == '%') {
+                        continue;
+                }
+                while (*p && strchr("-+ #0123456789.", *p)) {
+                        p++;
+                }
+                if (*p != 'd' && *p != 'i') {
+                        return NULL;
+                }
+                conversions++;
+        }
+        if (conversions != 1) {
+                return NULL;
+        }
+        int len = snprintf(NULL, 0, pattern, index);
+        char* path = len >= 0 ? (char*)malloc((size_t)len + 1) : NULL;
+        if (path) {
+                snprintf(path, (size_t)len + 1, pattern, index);
+        }
+        return path;
+}
+
+// An output file with its own write buffer, flushed in large blocks.
+typedef struct {
+        FILE* file;
+        _csv_buf_t buf;
+} _csv_writer_t;
+
+static
+bool
+_csv_writer_open(_csv_writer_t* w,
+                 const char* path)
+{
+        memset(w, 0, sizeof(*w));
+        w->file = fopen(path, "wb");
+        if (!w->file) {
+                perror("Error opening file for writing");
+                return false;
+        }
+        return true;
+}
+
+static
+bool
+_csv_writer_flush(_csv_writer_t* w)
+{
+        bool ok = w->buf.len == 0 || fwrite(w->buf.data, 1, w->buf.len, w->file) == w->buf.len;
+        w->buf.len = 0;
+        return ok;
+}
+
+// Appends `line` and a newline, flushing once the buffer is full.
+static
+bool
+_csv_writer_line(_csv_writer_t* w,
+                 const char* line,
+                 size_t len)
+{
+        if (!_csv_buf_append(&w->buf, line, len) || !_csv_buf_append(&w->buf, "\n", 1)) {
+                return false;
+        }
+        return w->buf.len < _CSV_WRITER_FLUSH || _csv_writer_flush(w);
+}
+
+// Flushes and closes the writer. Returns false if any write failed.
+static
+bool
+_csv_writer_close(_csv_writer_t* w)
+{
+        bool ok = true;
+        if (w->file) {
+                ok = _csv_writer_flush(w);
+                ok = fclose(w->file) == 0 && ok;
+        }
+        _csv_buf_free(&w->buf);
+        memset(w, 0, sizeof(*w));
+        return ok;
+}
+
+long
+csv_partition(const char* in_path,
+              bool has_header,
+              int key_col,
+              int num_parts,
+              const char* out_pattern)
+{
+        if (num_parts <= 0 || key_col < 0) {
+                return -1;
+        }
+        csv_reader_t* reader = csv_reader_open(in_path, has_header);
+        _csv_writer_t* parts = reader ? (_csv_writer_t*)calloc(num_parts, sizeof(_csv_writer_t)) : NULL;
+        if (!parts) {
+                csv_reader_close(&reader);
+                return -1;
+        }
+
+        bool failed = false;
+        for (int i = 0; i < num_parts && !failed; i++) {
+                char* path = _csv_format_path(out_pattern, i);
+                if (!path) {
+                        fprintf(stderr, "Invalid output pattern: %s\n", out_pattern);
+                        failed = true;
+                        break;
+                }
+                failed = !_csv_writer_open(&parts[i], path);
+                free(path);
+                if (!failed && reader->header_line) {
+                        failed = !_csv_writer_line(&parts[i], reader->header_line, strlen(reader->header_line));
+                }
+        }
+
+        // Records are copied from the raw line, so quoting survives untouched.
+        long written = 0;
+        const csv_row_t* row;
+        while (!failed && (row = csv_reader_next(reader))) {
+                uint64_t hash = csv_row_hash(row, &key_col, 1);
+                _csv_writer_t* part = &parts[hash % (uint64_t)num_parts];
+                failed = !_csv_writer_line(part, reader->line.data, reader->line.len);
+                written++;
+        }
+
+        for (int i = 0; i < num_parts; i++) {
+                if (!_csv_writer_close(&parts[i])) {
+                        failed = true;
+                }
+        }
+        free(parts);
+        csv_reader_close(&reader);
+        return failed ? -1 : written;
+}
+
+// Returns the terminator of the first line of `path`: "\r\n", "\n", or ""
+// when the file is a single unterminated line. NULL if it cannot be opened.
+static
+const char*
+_csv_line_ending(const char* path,
+                 _csv_buf_t* line)
+{
+        FILE* in = fopen(path, "rb");
+        if (!in) {
+                perror("Error opening file");
+                return NULL;
+        }
+        size_t consumed = _csv_read_line(in, line);
+        fclose(in);
+        size_t tail = consumed > line->len ? consumed - line->len : 0;
+        if (tail == 0) {
+                return "";
+        }
+        // A lone '\r' inside the line also stops the strip; report it as a
+        // mismatch so the caller falls back to rewriting the records.
+        return tail == 1 ? "\n" : tail == 2 ? "\r\n" : "\r";
+}
+
+// Copies the rest of `in` to `out` in large blocks, ending on `eol`.
+static
+bool
+_csv_copy_rest(FILE* in,
+               FILE* out,
+               const char* eol)
+{
+        static const size_t block = 1 << 20;
+        char* buf = (char*)malloc(block);
+        if (!buf) {
+                return false;
+        }
+        bool ok = true;
+        char last = '\n';
+        size_t n;
+        while (ok && (n = fread(buf, 1, block, in)) > 0) {
+                ok = fwrite(buf, 1, n, out) == n;
+                last = buf[n - 1];
+        }
+        if (ferror(in)) {
+                ok = false;
+        }
+        if (ok && last != '\n') {
+                ok = fputs(eol, out) != EOF;
+        }
+        free(buf);
+        return ok;
+}
+
+// Appends one file's records to `out` unchanged, skipping its header line.
+static
+bool
+_csv_concat_copy(const char* path,
+                 bool has_header,
+                 const char* eol,
+                 FILE* out,
+                 _csv_buf_t* line)
+{
+        FILE* in = fopen(path, "rb");
+        if (!in) {
+                perror("Error opening file");
+                return false;
+        }
+        if (has_header) {
+                _csv_read_line(in, line);
+        }
+        bool ok = _csv_copy_rest(in, out, eol);
+        fclose(in);
+        return ok;
+}
+
+// Appends one file's rows to `out`, placing each column by header name, or
+// keeping every column in place when `schema` is NULL.
+static
+bool
+_csv_concat_remap(const char* path,
+                  bool has_header,
+                  const csv_row_t* schema,
+                  FILE* out,
+                  _csv_buf_t* record)
+{
+        csv_reader_t* reader = csv_reader_open(path, has_header);
+        if (!reader) {
+                return false;
+        }
+        const csv_row_t* header = csv_reader_header(reader);
+        int width = schema ? schema->num_fields : 0;
+        int* source = (int*)malloc((width > 0 ? width : 1) * sizeof(int));
+        bool ok = source != NULL;
+        for (int j = 0; ok && j < width; j++) {
+                source[j] = -1;
+                for (int k = 0; header && k < header->num_fields; k++) {
+                        if (strcmp(header->fields[k], schema->fields[j]) == 0) {
+                                source[j] = k;
+                                break;
+                        }
+                }
+        }
+
+        // Fields are copied from their spans, quotes included.
+        while (ok && _csv_reader_next_spans(reader, 0)) {
+                record->len = 0;
+                int count = schema ? width : reader->spans.count;
+                for (int j = 0; ok && j < count; j++) {
+                        int k = schema ? source[j] : j;
+                        ok = (j == 0 || _csv_buf_append(record, ",", 1)) &&
+                             (k < 0 || k >= reader->spans.count || _csv_buf_append_span(record, &reader->spans.data[k]));
+                }
+                ok = ok && _csv_buf_append(record, "\n", 1) &&
+                     fwrite(record->data, 1, record->len, out) == record->len;
+        }
+        free(source);
+        csv_reader_close(&reader);
+        return ok;
+}
+
+int
+csv_concat(const char* const* paths,
+           int num_paths,
+           bool has_header,
+           const char* out_path)
+{
+        if (!paths || num_paths < 0) {
+                return -1;
+        }
+
+        // Block copies are only safe when every file ends its lines the same
+        // way; `eol` is that ending, reused for the header and for a missing
+        // final newline.
+        _csv_buf_t scratch = { NULL, 0, 0 };
+        const char* eol = NULL;
+        bool same = true;
+        bool failed = false;
+        for (int i = 0; i < num_paths && !failed; i++) {
+                const char* ending = _csv_line_ending(paths[i], &scratch);
+                failed = ending == NULL;
+                if (failed || !*ending) {
+                        continue;
+                }
+                if (!eol) {
+                        eol = ending;
+                } else if (strcmp(eol, ending) != 0) {
+                        same = false;
+                }
+        }
+        if (!eol || strcmp(eol, "\r") == 0) {
+                same = same && eol == NULL;
+                eol = "\n";
+        }
+
+        // Read every header up front to decide between copying and remapping.
+        // `quoted` remembers which union names were quoted, for the header.
+        csv_row_t* schema = NULL;
+        bool* quoted = NULL;
+        _csv_spans_t spans = { NULL, 0, 0 };
+        char* first_line = NULL;
+        for (int i = 0; has_header && i < num_paths && !failed; i++) {
+                csv_reader_t* reader = csv_reader_open(paths[i], true);
+                if (!reader) {
+                        failed = true;
+                        break;
+                }
+                const csv_row_t* header = csv_reader_header(reader);
+                const char* line = reader->header_line ? reader->header_line : "";
+                if (i == 0) {
+                        first_line = _csv_strdup(line);
+                        schema = _csv_row_copy(NULL, 0);
+                        failed = !first_line || !schema;
+                } else if (strcmp(line, first_line) != 0) {
+                        same = false;
+                }
+                failed = failed || !_csv_tokenize(line, line + strlen(line), 0, &spans);
+                // Grow the union schema with names not seen before.
+                for (int k = 0; !failed && header && k < header->num_fields; k++) {
+                        bool known = false;
+                        for (int j = 0; j < schema->num_fields && !known; j++) {
+                                known = strcmp(schema->fields[j], header->fields[k]) == 0;
+                        }
+                        if (!known) {
+                                char** grown = (char**)realloc(schema->fields, (schema->num_fields + 1) * sizeof(char*));
+                                char* name = _csv_strdup(header->fields[k]);
+                                if (grown) {
+                                        schema->fields = grown;
+                                }
+                                if (!grown || !name || !_csv_grow((void**)&quoted, schema->num_fields, sizeof(bool))) {
+                                        free(name);
+                                        failed = true;
+                                        break;
+                                }
+                                quoted[schema->num_fields] = k < spans.count && spans.data[k].quoted;
+                                schema->fields[schema->num_fields++] = name;
+                        }
+                }
+                csv_reader_close(&reader);
+        }
+
+        FILE* out = failed ? NULL : fopen(out_path, "wb");
+        if (!out) {
+                if (!failed) {
+                        perror("Error opening file for writing");
+                }
+                _csv_buf_free(&scratch);
+                _csv_row_release(schema);
+                free(quoted);
+                free(spans.data);
+                free(first_line);
+                return -1;
+        }
+
+        if (has_header && num_paths > 0) {
+                if (same) {
+                        failed = fputs(first_line, out) == EOF || fputs(eol, out) == EOF;
+                } else {
+                        scratch.len = 0;
+                        for (int j = 0; !failed && j < schema->num_fields; j++) {
+                                _csv_span_t name = { schema->fields[j], (int)strlen(schema->fields[j]), quoted[j] };
+                                failed = (j > 0 && !_csv_buf_append(&scratch, ",", 1)) || !_csv_buf_append_span(&scratch, &name);
+                        }
+                        failed = failed || !_csv_buf_append(&scratch, "\n", 1) ||
+                                 fwrite(scratch.data, 1, scratch.len, out) != scratch.len;
+                }
+        }
+        for (int i = 0; i < num_paths && !failed; i++) {
+                failed = same ? !_csv_concat_copy(paths[i], has_header, eol, out, &scratch)
+                              : !_csv_concat_remap(paths[i], has_header, schema, out, &scratch);
+        }
+
+        if (fclose(out) != 0) {
+                failed = true;
+        }
+        _csv_buf_free(&scratch);
+        _csv_row_release(schema);
+        free(quoted);
+        free(spans.data);
+        free(first_line);
+        return failed ? -1 : 0;
+}
+
+// Returns the end of the record starting at `p` (one past its '\n'), or NULL
+// if it runs past `end`. A '\n' ends a record only outside quotes; quotes are
+// tracked by parity, which also handles escaped "" pairs.
+static
+const char*
+_csv_record_end(const char* p,
+                const char* end,
+                _csv_find_fn find)
+{
+        for (;;) {
+                const char* nl = find(p, end, '\n');
+                if (nl == end) {
+                        return NULL;
+                }
+                bool in_quotes = false;
+                for (const char* q = find(p, nl, '"'); q < nl; q = find(q + 1, nl, '"')) {
+                        in_quotes = !in_quotes;
+                }
+                if (!in_quotes) {
+                        return nl + 1;
+                }
+                // The newline is quoted: keep scanning with the quote still open.
+                const char* close = find(nl + 1, end, '"');
+                if (close == end) {
+                        return NULL;
+                }
+                p = close + 1;
+        }
+}
+
+typedef struct {
+        const char* pattern;
+        bool has_header;
+        _csv_buf_t header;
+        long max_bytes;
+        long max_rows;
+        FILE* out;          // NULL between chunks.
+        int chunks;
+        long bytes;
+        long rows;
+} _csv_splitter_t;
+
+static
+bool
+_csv_split_close(_csv_splitter_t* sp)
+{
+        if (!sp->out) {
+                return true;
+        }
+        bool ok = fclose(sp->out) == 0;
+        sp->out = NULL;
+        return ok;
+}
+
+// Starts the next chunk and writes the header into it.
+static
+bool
+_csv_split_open(_csv_splitter_t* sp)
+{
+        char* path = _csv_format_path(sp->pattern, sp->chunks);
+        if (!path) {
+                fprintf(stderr, "Invalid output pattern: %s\n", sp->pattern);
+                return false;
+        }
+        sp->out = fopen(path, "wb");
+        free(path);
+        if (!sp->out) {
+                perror("Error opening file for writing");
+                return false;
+        }
+        sp->chunks++;
+        sp->bytes = (long)sp->header.len;
+        sp->rows = 0;
+        return fwrite(sp->header.data, 1, sp->header.len, sp->out) == sp->header.len;
+}
+
+static
+bool
+_csv_split_write(_csv_splitter_t* sp,
+                 const char* p,
+                 const char* end)
+{
+        return fwrite(p, 1, (size_t)(end - p), sp->out) == (size_t)(end - p);
+}
+
+// Handles the complete records in [p, end). Runs of records that stay in one
+// chunk are written with a single fwrite. Returns the end of the last
+// complete record, or NULL on a write error.
+static
+const char*
+_csv_split_records(_csv_splitter_t* sp,
+                   const char* p,
+                   const char* end,
+                   bool at_eof,
+                   _csv_find_fn find)
+{
+        const char* run = p;
+        while (p < end) {
+                const char* next = _csv_record_end(p, end, find);
+                if (!next) {
+                        if (!at_eof) {
+                                break;
+                        }
+                        next = end; // Unterminated last record.
+                }
+                if (sp->has_header && sp->header.len == 0) {
+                        // The first record is the header: keep it for every chunk.
+                        if (!_csv_buf_append(&sp->header, p, (size_t)(next - p)) ||
+                            (next[-1] != '\n' && !_csv_buf_append(&sp->header, "\n", 1))) {
+                                return NULL;
+                        }
+                        p = run = next;
+                        continue;
+                }
+
+                long len = (long)(next - p);
+                bool blank = p[0] == '\n' || (p[0] == '\r' && len > 1 && p[1] == '\n');
+                if (!sp->out) {
+                        if (!_csv_split_open(sp)) {
+                                return NULL;
+                        }
+                        run = p;
+                } else if (!blank && ((sp->max_rows > 0 && sp->rows >= sp->max_rows) ||
+                                      (sp->max_bytes > 0 && sp->rows > 0 && sp->bytes + len > sp->max_bytes))) {
+                        if (!_csv_split_write(sp, run, p) || !_csv_split_close(sp) || !_csv_split_open(sp)) {
+                                return NULL;
+                        }
+                        run = p;
+                }
+                sp->bytes += len;
+                sp->rows += blank ? 0 : 1;
+                p = next;
+        }
+        if (sp->out && p > run) {
+                if (!_csv_split_write(sp, run, p) || (at_eof && p[-1] != '\n' && fputc('\n', sp->out) == EOF)) {
+                        return NULL;
+                }
+        }
+        return p;
+}
+
+int
+csv_split(const char* in_path,
+          bool has_header,
+          long max_bytes,
+          long max_rows,
+          const char* out_pattern)
+{
+        FILE* in = fopen(in_path, "rb");
+        if (!in) {
+                perror("Error opening file");
+                return -1;
+        }
+        _csv_splitter_t sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.pattern = out_pattern;
+        sp.has_header = has_header;
+        sp.max_bytes = max_bytes;
+        sp.max_rows = max_rows;
+
+        // Read in 1 MiB blocks; a record cut by the block end is carried over
+        // to the front of the buffer for the next read.
+        _csv_find_fn find = _csv_get_kernel()->find;
+        _csv_buf_t buf = { NULL, 0, 0 };
+        bool failed = false;
+        bool eof = false;
+        while (!failed && !eof) {
+                if (!_csv_buf_reserve(&buf, 1 << 20)) {
+                        failed = true;
+                        break;
+                }
+                size_t n = fread(buf.data + buf.len, 1, buf.cap - buf.len, in);
+                buf.len += n;
+                eof = n == 0;
+                if (eof && ferror(in)) {
+                        failed = true;
+                        break;
+                }
+                const char* done = _csv_split_records(&sp, buf.data, buf.data + buf.len, eof, find);
+                if (!done) {
+                        failed = true;
+                        break;
+                }
+                size_t carry = buf.len - (size_t)(done - buf.data);
+                memmove(buf.data, done, carry);
+                buf.len = carry;
+        }
+        if (!failed && sp.chunks == 0 && has_header && sp.header.len > 0) {
+                // Header only: still emit one chunk so the schema is not lost.
+                failed = !_csv_split_open(&sp);
+        }
+
+        if (!_csv_split_close(&sp)) {
+                failed = true;
+        }
+        fclose(in);
+        _csv_buf_free(&buf);
+        _csv_buf_free(&sp.header);
+        return failed ? -1 : sp.chunks;
+}
+
+typedef struct {
+        csv_reader_t** readers;
+        _csv_sort_key_t* heads;     // num_keys decoded keys per input.
+        const csv_sort_key_t* keys;
+        int num_keys;
+} _csv_merge_t;
+
+// Orders inputs by their current rows; exhausted inputs sort after everything
+// and ties go to the earlier input.
+static
+bool
+_csv_merge_less(const _csv_merge_t* m,
+                int a,
+                int b)
+{
+        bool done_a = !m->readers[a]->row;
+        bool done_b = !m->readers[b]->row;
+        if (done_a || done_b) {
+                return !done_a || (done_b && a < b);
+        }
+        const _csv_sort_key_t* ka = &m->heads[(size_t)a * m->num_keys];
+        const _csv_sort_key_t* kb = &m->heads[(size_t)b * m->num_keys];
+        for (int k = 0; k < m->num_keys; k++) {
+                int c = _csv_sort_key_cmp(&ka[k], &kb[k], m->keys[k].type, m->keys[k].descending);
+                if (c != 0) {
+                        return c < 0;
+                }
+        }
+        return a < b;
+}
+
+// Reads the next row of input `i` and decodes its keys.
+static
+void
+_csv_merge_advance(_csv_merge_t* m,
+                   int i)
+{
+        const csv_row_t* row = csv_reader_next(m->readers[i]);
+        for (int k = 0; row && k < m->num_keys; k++) {
+                int col = m->keys[k].col;
+                const char* field = col >= 0 && col < row->num_fields ? row->fields[col] : NULL;
+                _csv_sort_key_decode(&m->heads[(size_t)i * m->num_keys + k], field, m->keys[k].type);
+        }
+}
+
+long
+csv_merge_sorted(const char* const* paths,
+                 int num_paths,
+                 bool has_header,
+                 const csv_sort_key_t* keys,
+                 int num_keys,
+                 const char* out_path)
+{
+        if (!paths || num_paths < 0 || num_keys < 0 || (num_keys > 0 && !keys)) {
+                return -1;
+        }
+        int n = num_paths;
+        _csv_merge_t m;
+        m.keys = keys;
+        m.num_keys = num_keys;
+        m.readers = (csv_reader_t**)calloc(n > 0 ? n : 1, sizeof(csv_reader_t*));
+        m.heads = (_csv_sort_key_t*)malloc(((size_t)n * num_keys + 1) * sizeof(_csv_sort_key_t));
+        // Loser tree over leaves n..2n-1: node p holds the loser of the match
+        // between its subtrees and loser[0] the overall winner. `win` is only
+        // needed to play the first round.
+        int* tree = (int*)malloc(3 * (n > 0 ? n : 1) * sizeof(int));
+        bool failed = !m.readers || !m.heads || !tree;
+        for (int i = 0; i < n && !failed; i++) {
+                m.readers[i] = csv_reader_open(paths[i], has_header);
+                failed = !m.readers[i];
+        }
+
+        _csv_writer_t out;
+        memset(&out, 0, sizeof(out));
+        failed = failed || !_csv_writer_open(&out, out_path);
+        if (!failed && n > 0 && m.readers[0]->header_line) {
+                failed = !_csv_writer_line(&out, m.readers[0]->header_line, strlen(m.readers[0]->header_line));
+        }
+
+        long written = 0;
+        if (!failed && n > 0) {
+                for (int i = 0; i < n; i++) {
+                        _csv_merge_advance(&m, i);
+                }
+                int* loser = tree;
+                int* win = tree + n;
+                for (int i = 0; i < n; i++) {
+                        win[n + i] = i;
+                }
+                for (int p = n - 1; p >= 1; p--) {
+                        int a = win[2 * p];
+                        int b = win[2 * p + 1];
+                        bool a_wins = _csv_merge_less(&m, a, b);
+                        win[p] = a_wins ? a : b;
+                        loser[p] = a_wins ? b : a;
+                }
+                loser[0] = win[1];
+
+                for (;;) {
+                        int w = loser[0];
+                        csv_reader_t* reader = m.readers[w];
+                        if (!reader->row) {
+                                break; // The best input is exhausted, so all are.
+                        }
+                        if (!_csv_writer_line(&out, reader->line.data, reader->line.len)) {
+                                failed = true;
+                                break;
+                        }
+                        written++;
+                        // Replay only the winner's path to the root.
+                        _csv_merge_advance(&m, w);
+                        for (int p = (w + n) / 2; p >= 1; p /= 2) {
+                                if (_csv_merge_less(&m, loser[p], w)) {
+                                        int t = loser[p];
+                                        loser[p] = w;
+                                        w = t;
+                                }
+                        }
+                        loser[0] = w;
+                }
+        }
+
+        for (int i = 0; i < n && m.readers; i++) {
+                csv_reader_close(&m.readers[i]);
+        }
+        if (!_csv_writer_close(&out)) {
+                failed = true;
+        }
+        free(m.readers);
+        free(m.heads);
+        free(tree);
+        return failed ? -1 : written;
+}
+
+long
+csv_transform(const char* in_path,
+              const char* const* columns,
+              const char* const* names,
+              int num_columns,
+              const char* out_path)
+{
+        if (!columns || num_columns <= 0) {
+                return -1;
+        }
+        csv_reader_t* reader = csv_reader_open(in_path, true);
+        if (!reader) {
+                return -1;
+        }
+        const csv_row_t* header = csv_reader_header(reader);
+        int* source = (int*)malloc(num_columns * sizeof(int));
+        bool failed = !header || !source;
+        int needed = 0;
+        for (int j = 0; j < num_columns && !failed; j++) {
+                source[j] = -1;
+                for (int k = 0; k < header->num_fields; k++) {
+                        if (strcmp(header->fields[k], columns[j]) == 0) {
+                                source[j] = k;
+                                break;
+                        }
+                }
+                if (source[j] < 0) {
+                        fprintf(stderr, "Unknown column: %s\n", columns[j]);
+                        failed = true;
+                } else if (source[j] + 1 > needed) {
+                        needed = source[j] + 1;
+                }
+        }
+
+        // Kept names are copied from the header's spans so their quotes
+        // survive; new names are quoted when they contain ',' or '"'.
+        _csv_spans_t names_in = { NULL, 0, 0 };
+        const char* header_line = reader->header_line ? reader->header_line : "";
+        failed = failed || !_csv_tokenize(header_line, header_line + strlen(header_line), 0, &names_in);
+        _csv_writer_t out;
+        memset(&out, 0, sizeof(out));
+        failed = failed || !_csv_writer_open(&out, out_path);
+        if (!failed) {
+                for (int j = 0; j < num_columns && !failed; j++) {
+                        _csv_span_t name;
+                        if (names && names[j]) {
+                                name.start = names[j];
+                                name.len = (int)strlen(names[j]);
+                                name.quoted = strpbrk(names[j], ",\"") != NULL;
+                        } else if (source[j] < names_in.count) {
+                                name = names_in.data[source[j]];
+                        } else {
+                                name.start = columns[j];
+                                name.len = (int)strlen(columns[j]);
+                                name.quoted = false;
+                        }
+                        failed = (j > 0 && !_csv_buf_append(&out.buf, ",", 1)) ||
+                                 !_csv_buf_append_span(&out.buf, &name);
+                }
+                failed = failed || !_csv_writer_line(&out, "", 0);
+        }
+        free(names_in.data);
+
+        long written = 0;
+        while (!failed && _csv_reader_next_spans(reader, needed)) {
+                const _csv_spans_t* spans = &reader->spans;
+                for (int j = 0; j < num_columns && !failed; j++) {
+                        failed = (j > 0 && !_csv_buf_append(&out.buf, ",", 1)) ||
+                                 (source[j] < spans->count && !_csv_buf_append_span(&out.buf, &spans->data[source[j]]));
+                }
+                failed = failed || !_csv_writer_line(&out, "", 0);
+                written++;
+        }
+
+        if (!_csv_writer_close(&out)) {
+                failed = true;
+        }
+        free(source);
+        csv_reader_close(&reader);
+        return failed ? -1 : written;
+}
+
+// -------------------------------------------------------------------------------------
+// Expressions
+// -------------------------------------------------------------------------------------
+
+#define _CSV_EXPR_BATCH 256
+
+typedef enum {
+        _CSV_VAL_NUM,       // double; NaN is null.
+        _CSV_VAL_STR,       // _csv_span_t
+        _CSV_VAL_BOOL       // uint8_t
+} _csv_val_type_t;
+
+typedef enum {
+        _CSV_OP_COL,
+        _CSV_OP_NUM,
+        _CSV_OP_STR,
+        _CSV_OP_BOOL,
+        _CSV_OP_TO_NUM,
+        _CSV_OP_ADD,
+        _CSV_OP_SUB,
+        _CSV_OP_MUL,
+        _CSV_OP_DIV,
+        _CSV_OP_MOD,
+        _CSV_OP_NEG,
+        _CSV_OP_ABS,
+        _CSV_OP_CMP_NUM,
+        _CSV_OP_CMP_STR,
+        _CSV_OP_AND,
+        _CSV_OP_OR,
+        _CSV_OP_NOT,
+        _CSV_OP_LEN,
+        _CSV_OP_CONTAINS,
+        _CSV_OP_STARTS_WITH,
+        _CSV_OP_ENDS_WITH
+} _csv_opcode_t;
+
+// One instruction: registers `a` and `b` in, register `dst` out. Every
+// instruction writes a fresh register, so the program is in SSA form.
+typedef struct {
+        uint8_t code;
+        uint8_t cmp;        // csv_cmp_t for comparisons.
+        int dst;
+        int a;
+        int b;
+        int imm;            // Column, constant index or boolean literal.
+} _csv_instr_t;
+
+struct csv_expr {
+        _csv_instr_t* code;
+        int num_code;
+        int cap_code;
+        double* nums;
+        _csv_span_t* strs;  // Point into `text`.
+        int num_consts;
+        char* text;         // Copy of the source with string literals unescaped in place.
+        int num_regs;
+        int result;
+        _csv_val_type_t type;
+        int max_col;        // Highest column referenced, or -1.
+};
+
+// Fills `out[0..n)` with the spans of column `col` for rows base..base+n-1.
+typedef void (*_csv_expr_load_fn)(void* ctx, int col, int base, int n, _csv_span_t* out);
+
+typedef struct {
+        int reg;
+        _csv_val_type_t type;
+} _csv_operand_t;
+
+typedef struct {
+        csv_expr_t* e;      // The program being emitted into.
+        const char* src;    // Start of the text, for error offsets.
+        const char* p;
+        char* const* header;
+        int num_cols;
+        bool failed;
+} _csv_parser_t;
+
+static
+_csv_operand_t
+_csv_expr_error(_csv_parser_t* ps,
+                const char* message)
+{
+        if (!ps->failed) {
+                fprintf(stderr, "Syntax error at offset %d: %s\n", (int)(ps->p - ps->src), message);
+                ps->failed = true;
+        }
+        _csv_operand_t none = { -1, _CSV_VAL_BOOL };
+        return none;
+}
+
+static
+_csv_operand_t
+_csv_expr_emit(_csv_parser_t* ps,
+               _csv_opcode_t code,
+               _csv_val_type_t type,
+               int a,
+               int b,
+               int imm,
+               int cmp)
+{
+        csv_expr_t* e = ps->e;
+        if (ps->failed) {
+                _csv_operand_t none = { -1, type };
+                return none;
+        }
+        if (e->num_code == e->cap_code) {
+                int cap = e->cap_code ? e->cap_code * 2 : 16;
+                _csv_instr_t* grown = (_csv_instr_t*)realloc(e->code, cap * sizeof(_csv_instr_t));
+                if (!grown) {
+                        return _csv_expr_error(ps, "out of memory");
+                }
+                e->code = grown;
+                e->cap_code = cap;
+        }
+        _csv_instr_t* in = &e->code[e->num_code++];
+        in->code = (uint8_t)code;
+        in->cmp = (uint8_t)cmp;
+        in->dst = e->num_regs++;
+        in->a = a;
+        in->b = b;
+        in->imm = imm;
+        _csv_operand_t out = { in->dst, type };
+        return out;
+}
+
+static
+int
+_csv_expr_add_const(_csv_parser_t* ps,
+                    double num,
+                    const char* str,
+                    int len)
+{
+        csv_expr_t* e = ps->e;
+        double* nums = (double*)realloc(e->nums, (e->num_consts + 1) * sizeof(double));
+        if (nums) {
+                e->nums = nums;
+        }
+        _csv_span_t* strs = (_csv_span_t*)realloc(e->strs, (e->num_consts + 1) * sizeof(_csv_span_t));
+        if (strs) {
+                e->strs = strs;
+        }
+        if (!nums || !strs) {
+                _csv_expr_error(ps, "out of memory");
+                return 0;
+        }
+        e->nums[e->num_consts] = num;
+        e->strs[e->num_consts].start = str;
+        e->strs[e->num_consts].len = len;
+        e->strs[e->num_consts].quoted = false;
+        return e->num_consts++;
+}
+
+static
+void
+_csv_expr_skip_ws(_csv_parser_t* ps)
+{
+        while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r') {
+                ps->p++;
+        }
+}
+
+static inline
+bool
+_csv_is_ident_char(char c)
+{
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Consumes `word` (case-insensitive) if it appears next as a whole word.
+static
+bool
+_csv_expr_keyword(_csv_parser_t* ps,
+                  const char* word)
+{
+        _csv_expr_skip_ws(ps);
+        size_t len = strlen(word);
+        for (size_t i = 0; i < len; i++) {
+                char c = ps->p[i];
+                if (c >= 'A' && c <= 'Z') {
+                        c = (char)(c - 'A' + 'a');
+                }
+                if (c != word[i]) {
+                        return false;
+                }
+        }
+        if (_csv_is_ident_char(ps->p[len])) {
+                return false;
+        }
+        ps->p += len;
+        return true;
+}
+
+// Consumes the punctuation `op` if it appears next.
+static
+bool
+_csv_expr_punct(_csv_parser_t* ps,
+                const char* op)
+{
+        _csv_expr_skip_ws(ps);
+        size_t len = strlen(op);
+        if (strncmp(ps->p, op, len) != 0) {
+                return false;
+        }
+        ps->p += len;
+        return true;
+}
+
+// Returns the register of an earlier instruction with the same opcode and
+// operands, or -1. Registers are never overwritten, so it can be reused.
+static
+int
+_csv_expr_find(const csv_expr_t* e,
+               _csv_opcode_t code,
+               int a,
+               int imm)
+{
+        for (int pc = 0; pc < e->num_code; pc++) {
+                const _csv_instr_t* in = &e->code[pc];
+                if (in->code == code && in->a == a && in->imm == imm) {
+                        return in->dst;
+                }
+        }
+        return -1;
+}
+
+static
+_csv_operand_t
+_csv_expr_as_num(_csv_parser_t* ps,
+                 _csv_operand_t x)
+{
+        if (x.type == _CSV_VAL_STR) {
+                _csv_operand_t num = { _csv_expr_find(ps->e, _CSV_OP_TO_NUM, x.reg, 0), _CSV_VAL_NUM };
+                return num.reg >= 0 ? num : _csv_expr_emit(ps, _CSV_OP_TO_NUM, _CSV_VAL_NUM, x.reg, -1, 0, 0);
+        }
+        if (x.type == _CSV_VAL_BOOL) {
+                return _csv_expr_error(ps, "expected a number, got a boolean");
+        }
+        return x;
+}
+
+static
+_csv_operand_t
+_csv_expr_as_bool(_csv_parser_t* ps,
+                  _csv_operand_t x)
+{
+        if (x.type != _CSV_VAL_BOOL) {
+                return _csv_expr_error(ps, "expected a boolean");
+        }
+        return x;
+}
+
+static
+_csv_operand_t
+_csv_expr_as_str(_csv_parser_t* ps,
+                 _csv_operand_t x)
+{
+        if (x.type != _CSV_VAL_STR) {
+                return _csv_expr_error(ps, "expected text");
+        }
+        return x;
+}
+
+static _csv_operand_t _csv_expr_parse_or(_csv_parser_t* ps);
+
+static
+_csv_operand_t
+_csv_expr_column(_csv_parser_t* ps,
+                 int col)
+{
+        if (col > ps->e->max_col) {
+                ps->e->max_col = col;
+        }
+        _csv_operand_t x = { _csv_expr_find(ps->e, _CSV_OP_COL, -1, col), _CSV_VAL_STR };
+        return x.reg >= 0 ? x : _csv_expr_emit(ps, _CSV_OP_COL, _CSV_VAL_STR, -1, -1, col, 0);
+}
+
+static
+_csv_operand_t
+_csv_expr_column_named(_csv_parser_t* ps,
+                       const char* name,
+                       size_t len)
+{
+        for (int k = 0; ps->header && k < ps->num_cols; k++) {
+                if (strlen(ps->header[k]) == len && memcmp(ps->header[k], name, len) == 0) {
+                        return _csv_expr_column(ps, k);
+                }
+        }
+        return _csv_expr_error(ps, "unknown column");
+}
+
+static
+_csv_operand_t
+_csv_expr_call(_csv_parser_t* ps,
+               const char* name,
+               size_t len)
+{
+        static const struct {
+                const char* name;
+                _csv_opcode_t code;
+                int arity;
+        } functions[] = {
+                { "len", _CSV_OP_LEN, 1 },
+                { "abs", _CSV_OP_ABS, 1 },
+                { "contains", _CSV_OP_CONTAINS, 2 },
+                { "starts_with", _CSV_OP_STARTS_WITH, 2 },
+                { "ends_with", _CSV_OP_ENDS_WITH, 2 },
+        };
+        int f = -1;
+        for (int i = 0; i < (int)(sizeof(functions) / sizeof(functions[0])); i++) {
+                if (strlen(functions[i].name) == len && strncmp(functions[i].name, name, len) == 0) {
+                        f = i;
+                }
+        }
+        if (f < 0) {
+                return _csv_expr_error(ps, "unknown function");
+        }
+        _csv_operand_t args[2];
+        for (int i = 0; i < functions[f].arity; i++) {
+                if (i > 0 && !_csv_expr_punct(ps, ",")) {
+                        return _csv_expr_error(ps, "expected ','");
+                }
+                args[i] = _csv_expr_parse_or(ps);
+        }
+        if (!_csv_expr_punct(ps, ")")) {
+                return _csv_expr_error(ps, "expected ')'");
+        }
+        switch (functions[f].code) {
+        case _CSV_OP_LEN:
+                args[0] = _csv_expr_as_str(ps, args[0]);
+                return _csv_expr_emit(ps, _CSV_OP_LEN, _CSV_VAL_NUM, args[0].reg, -1, 0, 0);
+        case _CSV_OP_ABS:
+                args[0] = _csv_expr_as_num(ps, args[0]);
+                return _csv_expr_emit(ps, _CSV_OP_ABS, _CSV_VAL_NUM, args[0].reg, -1, 0, 0);
+        default:
+                args[0] = _csv_expr_as_str(ps, args[0]);
+                args[1] = _csv_expr_as_str(ps, args[1]);
+                return _csv_expr_emit(ps, functions[f].code, _CSV_VAL_BOOL, args[0].reg, args[1].reg, 0, 0);
+        }
+}
+
+static
+_csv_operand_t
+_csv_expr_parse_primary(_csv_parser_t* ps)
+{
+        _csv_expr_skip_ws(ps);
+        const char* p = ps->p;
+        if (*p == '(') {
+                ps->p++;
+                _csv_operand_t x = _csv_expr_parse_or(ps);
+                if (!_csv_expr_punct(ps, ")")) {
+                        return _csv_expr_error(ps, "expected ')'");
+                }
+                return x;
+        }
+        if ((*p >= '0' && *p <= '9') || (*p == '.' && p[1] >= '0' && p[1] <= '9')) {
+                char* end;
+                double v = strtod(p, &end);
+                ps->p = end;
+                return _csv_expr_emit(ps, _CSV_OP_NUM, _CSV_VAL_NUM, -1, -1, _csv_expr_add_const(ps, v, NULL, 0), 0);
+        }
+        if (*p == '\'') {
+                // Unescape in place: the literal can only shrink.
+                char* text = (char*)p + 1;
+                char* out = text;
+                const char* q = p + 1;
+                for (;;) {
+                        if (!*q) {
+                                return _csv_expr_error(ps, "unterminated string");
+                        }
+                        if (*q == '\'') {
+                                if (q[1] != '\'') {
+                                        break;
+                                }
+                                q++;
+                        }
+                        *out++ = *q++;
+                }
+                ps->p = q + 1;
+                int k = _csv_expr_add_const(ps, 0.0, text, (int)(out - text));
+                return _csv_expr_emit(ps, _CSV_OP_STR, _CSV_VAL_STR, -1, -1, k, 0);
+        }
+        if (*p == '"') {
+                const char* end = strchr(p + 1, '"');
+                if (!end) {
+                        return _csv_expr_error(ps, "unterminated column name");
+                }
+                ps->p = end + 1;
+                return _csv_expr_column_named(ps, p + 1, (size_t)(end - p - 1));
+        }
+        if (*p == '$') {
+                char* end;
+                long col = strtol(p + 1, &end, 10);
+                if (end == p + 1 || col < 0 || (ps->header && col >= ps->num_cols)) {
+                        return _csv_expr_error(ps, "bad column number");
+                }
+                ps->p = end;
+                return _csv_expr_column(ps, (int)col);
+        }
+        if (_csv_is_ident_char(*p)) {
+                if (_csv_expr_keyword(ps, "true")) {
+                        return _csv_expr_emit(ps, _CSV_OP_BOOL, _CSV_VAL_BOOL, -1, -1, 1, 0);
+                }
+                if (_csv_expr_keyword(ps, "false")) {
+                        return _csv_expr_emit(ps, _CSV_OP_BOOL, _CSV_VAL_BOOL, -1, -1, 0, 0);
+                }
+                const char* end = p;
+                while (_csv_is_ident_char(*end)) {
+                        end++;
+                }
+                ps->p = end;
+                if (_csv_expr_punct(ps, "(")) {
+                        return _csv_expr_call(ps, p, (size_t)(end - p));
+                }
+                return _csv_expr_column_named(ps, p, (size_t)(end - p));
+        }
+        return _csv_expr_error(ps, *p ? "unexpected character" : "unexpected end of expression");
+}
+
+static
+_csv_operand_t
+_csv_expr_parse_unary(_csv_parser_t* ps)
+{
+        if (_csv_expr_punct(ps, "-")) {
+                _csv_operand_t x = _csv_expr_as_num(ps, _csv_expr_parse_unary(ps));
+                return _csv_expr_emit(ps, _CSV_OP_NEG, _CSV_VAL_NUM, x.reg, -1, 0, 0);
+        }
+        return _csv_expr_parse_primary(ps);
+}
+
+static
+_csv_operand_t
+_csv_expr_parse_mul(_csv_parser_t* ps)
+{
+        _csv_operand_t x = _csv_expr_parse_unary(ps);
+        for (;;) {
+                _csv_opcode_t code;
+                if (_csv_expr_punct(ps, "*")) {
+                        code = _CSV_OP_MUL;
+                } else if (_csv_expr_punct(ps, "/")) {
+                        code = _CSV_OP_DIV;
+                } else if (_csv_expr_punct(ps, "%")) {
+                        code = _CSV_OP_MOD;
+                } else {
+                        return x;
+                }
+                x = _csv_expr_as_num(ps, x);
+                _csv_operand_t y = _csv_expr_as_num(ps, _csv_expr_parse_unary(ps));
+                x = _csv_expr_emit(ps, code, _CSV_VAL_NUM, x.reg, y.reg, 0, 0);
+        }
+}
+
+static
+_csv_operand_t
+_csv_expr_parse_add(_csv_parser_t* ps)
+{
+        _csv_operand_t x = _csv_expr_parse_mul(ps);
+        for (;;) {
+                _csv_opcode_t code;
+                if (_csv_expr_punct(ps, "+")) {
+                        code = _CSV_OP_ADD;
+                } else if (_csv_expr_punct(ps, "-")) {
+                        code = _CSV_OP_SUB;
+                } else {
+                        return x;
+                }
+                x = _csv_expr_as_num(ps, x);
+                _csv_operand_t y = _csv_expr_as_num(ps, _csv_expr_parse_mul(ps));
+                x = _csv_expr_emit(ps, code, _CSV_VAL_NUM, x.reg, y.reg, 0, 0);
+        }
+}
+
+static
+_csv_operand_t
+_csv_expr_parse_cmp(_csv_parser_t* ps)
+{
+        _csv_operand_t x = _csv_expr_parse_add(ps);
+        // Two-character operators first, so "<=" is not read as "<".
+        static const struct {
+                const char* op;
+                csv_cmp_t cmp;
+        } ops[] = {
+                { "==", CSV_CMP_EQ }, { "!=", CSV_CMP_NE }, { "<>", CSV_CMP_NE },
+                { "<=", CSV_CMP_LE }, { ">=", CSV_CMP_GE }, { "=", CSV_CMP_EQ },
+                { "<", CSV_CMP_LT }, { ">", CSV_CMP_GT },
+        };
+        for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+                if (!_csv_expr_punct(ps, ops[i].op)) {
+                        continue;
+                }
+                _csv_operand_t y = _csv_expr_parse_add(ps);
+                if (x.type == _CSV_VAL_STR && y.type == _CSV_VAL_STR) {
+                        return _csv_expr_emit(ps, _CSV_OP_CMP_STR, _CSV_VAL_BOOL, x.reg, y.reg, 0, ops[i].cmp);
+                }
+                x = _csv_expr_as_num(ps, x);
+                y = _csv_expr_as_num(ps, y);
+                return _csv_expr_emit(ps, _CSV_OP_CMP_NUM, _CSV_VAL_BOOL, x.reg, y.reg, 0, ops[i].cmp);
+        }
+        return x;
+}
+
+static
+_csv_operand_t
+_csv_expr_parse_not(_csv_parser_t* ps)
+{
+        if (_csv_expr_keyword(ps, "not")) {
+                _csv_operand_t x = _csv_expr_as_bool(ps, _csv_expr_parse_not(ps));
+                return _csv_expr_emit(ps, _CSV_OP_NOT, _CSV_VAL_BOOL, x.reg, -1, 0, 0);
+        }
+        return _csv_expr_parse_cmp(ps);
+}
+
+static
+_csv_operand_t
+_csv_expr_parse_and(_csv_parser_t* ps)
+{
+        _csv_operand_t x = _csv_expr_parse_not(ps);
+        while (_csv_expr_keyword(ps, "and")) {
+                x = _csv_expr_as_bool(ps, x);
+                _csv_operand_t y = _csv_expr_as_bool(ps, _csv_expr_parse_not(ps));
+                x = _csv_expr_emit(ps, _CSV_OP_AND, _CSV_VAL_BOOL, x.reg, y.reg, 0, 0);
+        }
+        return x;
+}
+
+static
+_csv_operand_t
+_csv_expr_parse_or(_csv_parser_t* ps)
+{
+        _csv_operand_t x = _csv_expr_parse_and(ps);
+        while (_csv_expr_keyword(ps, "or")) {
+                x = _csv_expr_as_bool(ps, x);
+                _csv_operand_t y = _csv_expr_as_bool(ps, _csv_expr_parse_and(ps));
+                x = _csv_expr_emit(ps, _CSV_OP_OR, _CSV_VAL_BOOL, x.reg, y.reg, 0, 0);
+        }
+        return x;
+}
+
+csv_expr_t*
+csv_expr_compile(const char* text,
+                 char* const* header,
+                 int num_cols)
+{
+        if (!text) {
+                return NULL;
+        }
+        csv_expr_t* e = (csv_expr_t*)calloc(1, sizeof(csv_expr_t));
+        if (!e || !(e->text = _csv_strdup(text))) {
+                free(e);
+                return NULL;
+        }
+        e->max_col = -1;
+        _csv_parser_t ps = { e, e->text, e->text, header, num_cols, false };
+        _csv_operand_t x = _csv_expr_parse_or(&ps);
+        _csv_expr_skip_ws(&ps);
+        if (!ps.failed && *ps.p) {
+                _csv_expr_error(&ps, "unexpected input after expression");
+        }
+        if (ps.failed) {
+                csv_expr_free(&e);
+                return NULL;
+        }
+        e->result = x.reg;
+        e->type = x.type;
+        return e;
+}
+
+void
+csv_expr_free(csv_expr_t** expr_ptr)
+{
+        if (!expr_ptr || !*expr_ptr) {
+                return;
+        }
+        csv_expr_t* e = *expr_ptr;
+        free(e->code);
+        free(e->nums);
+        free(e->strs);
+        free(e->text);
+        free(e);
+        *expr_ptr = NULL;
+}
+
+// Parses a span as a double; spans are not NUL-terminated, so short ones are
+// copied to the stack first. Anything longer is not a plausible number.
+static
+bool
+_csv_parse_span_double(const _csv_span_t* span,
+                       double* out)
+{
+        char tmp[64];
+        if (span->len <= 0 || span->len >= (int)sizeof(tmp)) {
+                return false;
+        }
+        memcpy(tmp, span->start, span->len);
+        tmp[span->len] = 0;
+        return _csv_parse_double(tmp, out);
+}
+
+static
+bool
+_csv_parse_span_int64(const _csv_span_t* span,
+                      int64_t* out)
+{
+        char tmp[64];
+        if (span->len <= 0 || span->len >= (int)sizeof(tmp)) {
+                return false;
+        }
+        memcpy(tmp, span->start, span->len);
+        tmp[span->len] = 0;
+        return _csv_parse_int64(tmp, out);
+}
+
+static inline
+int
+_csv_span_cmp(const _csv_span_t* a,
+              const _csv_span_t* b)
+{
+        int n = a->len < b->len ? a->len : b->len;
+        int c = n > 0 ? memcmp(a->start, b->start, n) : 0;
+        return c != 0 ? c : (a->len > b->len) - (a->len < b->len);
+}
+
+// Compares two text values as numbers when both are numbers (so "9" < "10"),
+// and bytewise otherwise.
+static
+int
+_csv_text_cmp(const _csv_span_t* a,
+              const _csv_span_t* b)
+{
+        double x, y;
+        if (_csv_parse_span_double(a, &x) && _csv_parse_span_double(b, &y)) {
+                return (x > y) - (x < y);
+        }
+        return _csv_span_cmp(a, b);
+}
+
+static
+bool
+_csv_span_contains(const _csv_span_t* s,
+                   const _csv_span_t* t)
+{
+        if (t->len == 0) {
+                return true;
+        }
+        const char* end = s->start + s->len - t->len + 1;
+        for (const char* p = s->start; p < end; p++) {
+                p = (const char*)memchr(p, t->start[0], (size_t)(end - p));
+                if (!p) {
+                        return false;
+                }
+                if (memcmp(p, t->start, t->len) == 0) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+// Numeric comparison of two vectors. NaN (null) never compares true.
+static
+void
+_csv_cmp_num_vec(const double* x,
+                 const double* y,
+                 int n,
+                 csv_cmp_t op,
+                 uint8_t* out)
+{
+        switch (op) {
+        case CSV_CMP_EQ: for (int i = 0; i < n; i++) out[i] = x[i] == y[i]; break;
+        case CSV_CMP_NE: for (int i = 0; i < n; i++) out[i] = x[i] != y[i] && x[i] == x[i] && y[i] == y[i]; break;
+        case CSV_CMP_LT: for (int i = 0; i < n; i++) out[i] = x[i] < y[i]; break;
+        case CSV_CMP_LE: for (int i = 0; i < n; i++) out[i] = x[i] <= y[i]; break;
+        case CSV_CMP_GT: for (int i = 0; i < n; i++) out[i] = x[i] > y[i]; break;
+        case CSV_CMP_GE: for (int i = 0; i < n; i++) out[i] = x[i] >= y[i]; break;
+        }
+}
+
+static inline
+bool
+_csv_cmp_result(int c,
+                csv_cmp_t op)
+{
+        switch (op) {
+        case CSV_CMP_EQ: return c == 0;
+        case CSV_CMP_NE: return c != 0;
+        case CSV_CMP_LT: return c < 0;
+        case CSV_CMP_LE: return c <= 0;
+        case CSV_CMP_GT: return c > 0;
+        case CSV_CMP_GE: return c >= 0;
+        }
+        return false;
+}
+
+// Register storage for one evaluation: num_regs slots of one batch each.
+typedef struct {
+        unsigned char* mem;
+} _csv_expr_frame_t;
+
+#define _CSV_EXPR_SLOT (_CSV_EXPR_BATCH * sizeof(_csv_span_t))
+
+static
+bool
+_csv_expr_frame_init(_csv_expr_frame_t* frame,
+                     const csv_expr_t* e)
+{
+        frame->mem = (unsigned char*)malloc((size_t)(e->num_regs > 0 ? e->num_regs : 1) * _CSV_EXPR_SLOT);
+        return frame->mem != NULL;
+}
+
+static inline
+void*
+_csv_expr_reg(const _csv_expr_frame_t* frame,
+              int reg)
+{
+        return frame->mem + (size_t)reg * _CSV_EXPR_SLOT;
+}
+
+// Runs the program over rows base..base+n-1 (n <= _CSV_EXPR_BATCH). The
+// result is left in register e->result.
+static
+void
+_csv_expr_run(const csv_expr_t* e,
+              const _csv_expr_frame_t* frame,
+              _csv_expr_load_fn load,
+              void* ctx,
+              int base,
+              int n)
+{
+        for (int pc = 0; pc < e->num_code; pc++) {
+                const _csv_instr_t* in = &e->code[pc];
+                void* dst = _csv_expr_reg(frame, in->dst);
+                const void* ra = in->a >= 0 ? _csv_expr_reg(frame, in->a) : NULL;
+                const void* rb = in->b >= 0 ? _csv_expr_reg(frame, in->b) : NULL;
+                double* d = (double*)dst;
+                uint8_t* o = (uint8_t*)dst;
+                const double* x = (const double*)ra;
+                const double* y = (const double*)rb;
+                const uint8_t* p = (const uint8_t*)ra;
+                const uint8_t* q = (const uint8_t*)rb;
+                const _csv_span_t* s = (const _csv_span_t*)ra;
+                const _csv_span_t* t = (const _csv_span_t*)rb;
+                switch ((_csv_opcode_t)in->code) {
+                case _CSV_OP_COL:
+                        load(ctx, in->imm, base, n, (_csv_span_t*)dst);
+                        break;
+                case _CSV_OP_NUM:
+                        for (int i = 0; i < n; i++) d[i] = e->nums[in->imm];
+                        break;
+                case _CSV_OP_STR:
+                        for (int i = 0; i < n; i++) ((_csv_span_t*)dst)[i] = e->strs[in->imm];
+                        break;
+                case _CSV_OP_BOOL:
+                        memset(o, in->imm ? 1 : 0, (size_t)n);
+                        break;
+                case _CSV_OP_TO_NUM:
+                        for (int i = 0; i < n; i++) {
+                                if (!_csv_parse_span_double(&s[i], &d[i])) {
+                                        d[i] = NAN;
+                                }
+                        }
+                        break;
+                case _CSV_OP_ADD: for (int i = 0; i < n; i++) d[i] = x[i] + y[i]; break;
+                case _CSV_OP_SUB: for (int i = 0; i < n; i++) d[i] = x[i] - y[i]; break;
+                case _CSV_OP_MUL: for (int i = 0; i < n; i++) d[i] = x[i] * y[i]; break;
+                case _CSV_OP_DIV: for (int i = 0; i < n; i++) d[i] = x[i] / y[i]; break;
+                case _CSV_OP_MOD: for (int i = 0; i < n; i++) d[i] = fmod(x[i], y[i]); break;
+                case _CSV_OP_NEG: for (int i = 0; i < n; i++) d[i] = -x[i]; break;
+                case _CSV_OP_ABS: for (int i = 0; i < n; i++) d[i] = fabs(x[i]); break;
+                case _CSV_OP_CMP_NUM:
+                        _csv_cmp_num_vec(x, y, n, (csv_cmp_t)in->cmp, o);
+                        break;
+                case _CSV_OP_CMP_STR:
+                        for (int i = 0; i < n; i++) o[i] = _csv_cmp_result(_csv_text_cmp(&s[i], &t[i]), (csv_cmp_t)in->cmp);
+                        break;
+                case _CSV_OP_AND: for (int i = 0; i < n; i++) o[i] = p[i] & q[i]; break;
+                case _CSV_OP_OR: for (int i = 0; i < n; i++) o[i] = p[i] | q[i]; break;
+                case _CSV_OP_NOT: for (int i = 0; i < n; i++) o[i] = !p[i]; break;
+                case _CSV_OP_LEN: for (int i = 0; i < n; i++) d[i] = (double)s[i].len; break;
+                case _CSV_OP_CONTAINS:
+                        for (int i = 0; i < n; i++) o[i] = _csv_span_contains(&s[i], &t[i]);
+                        break;
+                case _CSV_OP_STARTS_WITH:
+                        for (int i = 0; i < n; i++) o[i] = t[i].len <= s[i].len && memcmp(s[i].start, t[i].start, t[i].len) == 0;
+                        break;
+                case _CSV_OP_ENDS_WITH:
+                        for (int i = 0; i < n; i++) o[i] = t[i].len <= s[i].len && memcmp(s[i].start + s[i].len - t[i].len, t[i].start, t[i].len) == 0;
+                        break;
+                }
+        }
+}
+
+static
+void
+_csv_expr_load_view(void* ctx,
+                    int col,
+                    int base,
+                    int n,
+                    _csv_span_t* out)
+{
+        const csv_view_t* view = (const csv_view_t*)ctx;
+        for (int i = 0; i < n; i++) {
+                const csv_row_t* row = _csv_view_row(view, base + i);
+                const char* field = col < row->num_fields ? row->fields[col] : "";
+                out[i].start = field;
+                out[i].len = (int)strlen(field);
+                out[i].quoted = false;
+        }
+}
+
+csv_view_t*
+csv_view_filter_expr(const csv_view_t* view,
+                     const csv_expr_t* expr)
+{
+        if (!view || !expr || expr->type != _CSV_VAL_BOOL) {
+                return NULL;
+        }
+        _csv_expr_frame_t frame;
+        if (!_csv_expr_frame_init(&frame, expr)) {
+                return NULL;
+        }
+        csv_view_t* out = _csv_view_empty_like(view);
+        if (!out) {
+                free(frame.mem);
+                return NULL;
+        }
+        const uint8_t* keep = (const uint8_t*)_csv_expr_reg(&frame, expr->result);
+        for (int base = 0; base < view->num_rows; base += _CSV_EXPR_BATCH) {
+                int n = view->num_rows - base < _CSV_EXPR_BATCH ? view->num_rows - base : _CSV_EXPR_BATCH;
+                _csv_expr_run(expr, &frame, _csv_expr_load_view, (void*)view, base, n);
+                for (int i = 0; i < n; i++) {
+                        out->rows[out->num_rows] = _csv_view_row_index(view, base + i);
+                        out->num_rows += keep[i]; // Branch-free compaction.
+                }
+        }
+        free(frame.mem);
+        return out;
+}
+
+csv_view_t*
+csv_filter_expr(const csv_document_t* doc,
+                const csv_expr_t* expr)
+{
+        if (!doc) {
+                return NULL;
+        }
+        csv_view_t all = _csv_view_identity(doc);
+        return csv_view_filter_expr(&all, expr);
+}
+
+csv_column_t*
+csv_view_eval(const csv_view_t* view,
+              const csv_expr_t* expr)
+{
+        if (!view || !expr || expr->type == _CSV_VAL_STR) {
+                return NULL;
+        }
+        _csv_expr_frame_t frame;
+        csv_column_t* column = (csv_column_t*)calloc(1, sizeof(csv_column_t));
+        if (!column || !_csv_expr_frame_init(&frame, expr)) {
+                free(column);
+                return NULL;
+        }
+        size_t n = (size_t)view->num_rows;
+        size_t words = (n + 63) / 64;
+        bool numeric = expr->type == _CSV_VAL_NUM;
+        column->type = numeric ? CSV_TYPE_DOUBLE : CSV_TYPE_INT64;
+        column->length = view->num_rows;
+        column->values = calloc(n ? n : 1, numeric ? sizeof(double) : sizeof(int64_t));
+        column->validity = (uint64_t*)calloc(words ? words : 1, sizeof(uint64_t));
+        if (!column->values || !column->validity) {
+                free(frame.mem);
+                csv_column_free(&column);
+                return NULL;
+        }
+
+        const void* result = _csv_expr_reg(&frame, expr->result);
+        for (int base = 0; base < view->num_rows; base += _CSV_EXPR_BATCH) {
+                int m = view->num_rows - base < _CSV_EXPR_BATCH ? view->num_rows - base : _CSV_EXPR_BATCH;
+                _csv_expr_run(expr, &frame, _csv_expr_load_view, (void*)view, base, m);
+                for (int i = 0; i < m; i++) {
+                        int k = base + i;
+                        if (!numeric) {
+                                ((int64_t*)column->values)[k] = ((const uint8_t*)result)[i];
+                                column->validity[k >> 6] |= 1ULL << (k & 63);
+                        } else if (!isnan(((const double*)result)[i])) {
+                                ((double*)column->values)[k] = ((const double*)result)[i];
+                                column->validity[k >> 6] |= 1ULL << (k & 63);
+                        } else {
+                                column->null_count++; // Stored as 0, as csv_column_build() does.
+                        }
+                }
+        }
+        free(frame.mem);
+
+        if (column->null_count == 0) {
+                free(column->validity);
+                column->validity = NULL;
+        }
+        return column;
+}
+
+// -------------------------------------------------------------------------------------
+// Queries
+// -------------------------------------------------------------------------------------
+
+typedef enum {
+        _CSV_AGG_NONE,
+        _CSV_AGG_COUNT_ALL,
+        _CSV_AGG_COUNT,
+        _CSV_AGG_SUM,
+        _CSV_AGG_AVG,
+        _CSV_AGG_MIN,
+        _CSV_AGG_MAX
+} _csv_agg_kind_t;
+
+typedef struct {
+        _csv_agg_kind_t agg;
+        _csv_operand_t value;       // In the select program; unused for count(*).
+        char* name;
+} _csv_query_item_t;
+
+typedef struct {
+        int item;
+        bool descending;
+} _csv_query_order_t;
+
+// A parsed query. WHERE and the select list compile to separate programs so
+// the select program only runs over rows that passed the filter.
+typedef struct {
+        char* text;                 // Shared by both programs' string constants.
+        csv_expr_t* where;
+        csv_expr_t* select;
+        _csv_operand_t where_value;
+        _csv_query_item_t* items;
+        int num_items;
+        _csv_operand_t* keys;
+        int num_keys;
+        _csv_query_order_t* order;
+        int num_order;
+        long limit;                 // -1 for none.
+        bool star;
+        bool grouped;
+} _csv_query_t;
+
+static
+void
+_csv_query_free(_csv_query_t* q)
+{
+        for (int i = 0; i < q->num_items; i++) {
+                free(q->items[i].name);
+        }
+        free(q->items);
+        free(q->keys);
+        free(q->order);
+        csv_expr_free(&q->where);
+        csv_expr_free(&q->select);
+        free(q->text);
+}
+
+// Reads a name after AS or in ORDER BY: a bare word or a "quoted" name.
+static
+char*
+_csv_query_name(_csv_parser_t* ps)
+{
+        _csv_expr_skip_ws(ps);
+        const char* p = ps->p;
+        const char* end;
+        if (*p == '"') {
+                p++;
+                end = strchr(p, '"');
+                if (!end) {
+                        _csv_expr_error(ps, "unterminated name");
+                        return NULL;
+                }
+                ps->p = end + 1;
+        } else {
+                end = p;
+                while (_csv_is_ident_char(*end)) {
+                        end++;
+                }
+                if (end == p) {
+                        _csv_expr_error(ps, "expected a name");
+                        return NULL;
+                }
+                ps->p = end;
+        }
+        char* name = (char*)malloc((size_t)(end - p) + 1);
+        if (name) {
+                memcpy(name, p, (size_t)(end - p));
+                name[end - p] = 0;
+        }
+        return name;
+}
+
+static
+bool
+_csv_query_parse_item(_csv_parser_t* ps,
+                      _csv_query_t* q,
+                      const char* sql)
+{
+        static const struct {
+                const char* name;
+                _csv_agg_kind_t agg;
+        } aggs[] = {
+                { "count", _CSV_AGG_COUNT }, { "sum", _CSV_AGG_SUM }, { "avg", _CSV_AGG_AVG },
+                { "min", _CSV_AGG_MIN }, { "max", _CSV_AGG_MAX },
+        };
+        if (!_csv_grow((void**)&q->items, q->num_items, sizeof(_csv_query_item_t))) {
+                return false;
+        }
+        _csv_query_item_t* item = &q->items[q->num_items++];
+        memset(item, 0, sizeof(*item));
+        _csv_expr_skip_ws(ps);
+        const char* start = ps->p;
+
+        for (int i = 0; i < (int)(sizeof(aggs) / sizeof(aggs[0])); i++) {
+                const char* save = ps->p;
+                if (!_csv_expr_keyword(ps, aggs[i].name)) {
+                        continue;
+                }
+                if (!_csv_expr_punct(ps, "(")) {
+                        ps->p = save; // A column that happens to be called e.g. "count".
+                        continue;
+                }
+                item->agg = aggs[i].agg;
+                if (item->agg == _CSV_AGG_COUNT && _csv_expr_punct(ps, "*")) {
+                        item->agg = _CSV_AGG_COUNT_ALL;
+                } else {
+                        item->value = _csv_expr_parse_or(ps);
+                        if (item->agg != _CSV_AGG_COUNT) {
+                                item->value = _csv_expr_as_num(ps, item->value);
+                        }
+                }
+                if (!_csv_expr_punct(ps, ")")) {
+                        _csv_expr_error(ps, "expected ')'");
+                }
+                q->grouped = true;
+                break;
+        }
+        if (item->agg == _CSV_AGG_NONE) {
+                item->value = _csv_expr_parse_or(ps);
+        }
+        if (ps->failed) {
+                return false;
+        }
+
+        const char* end = ps->p;
+        if (_csv_expr_keyword(ps, "as")) {
+                item->name = _csv_query_name(ps);
+                return item->name != NULL;
+        }
+        // Default name: the item's own text, without quotes around a column name.
+        size_t from = (size_t)(start - ps->src);
+        size_t len = (size_t)(end - start);
+        while (len > 0 && strchr(" \t\r\n", sql[from + len - 1])) {
+                len--;
+        }
+        if (len >= 2 && sql[from] == '"' && sql[from + len - 1] == '"') {
+                from++;
+                len -= 2;
+        }
+        item->name = (char*)malloc(len + 1);
+        if (!item->name) {
+                return false;
+        }
+        memcpy(item->name, sql + from, len);
+        item->name[len] = 0;
+        return true;
+}
+
+static
+bool
+_csv_query_parse_order(_csv_parser_t* ps,
+                       _csv_query_t* q)
+{
+        do {
+                if (!_csv_grow((void**)&q->order, q->num_order, sizeof(_csv_query_order_t))) {
+                        return false;
+                }
+                _csv_query_order_t* order = &q->order[q->num_order++];
+                _csv_expr_skip_ws(ps);
+                order->item = -1;
+                if (*ps->p >= '0' && *ps->p <= '9') {
+                        char* end;
+                        long pos = strtol(ps->p, &end, 10);
+                        ps->p = end;
+                        order->item = pos >= 1 && pos <= q->num_items ? (int)pos - 1 : -1;
+                } else {
+                        char* name = _csv_query_name(ps);
+                        if (!name) {
+                                return false;
+                        }
+                        for (int i = 0; i < q->num_items && order->item < 0; i++) {
+                                if (strcmp(q->items[i].name, name) == 0) {
+                                        order->item = i;
+                                }
+                        }
+                        free(name);
+                }
+                if (order->item < 0) {
+                        _csv_expr_error(ps, "ORDER BY must name an output column");
+                        return false;
+                }
+                order->descending = _csv_expr_keyword(ps, "desc");
+                if (!order->descending) {
+                        _csv_expr_keyword(ps, "asc");
+                }
+        } while (_csv_expr_punct(ps, ","));
+        return true;
+}
+
+static
+bool
+_csv_query_parse(_csv_query_t* q,
+                 const char* sql,
+                 char* const* header,
+                 int num_cols)
+{
+        memset(q, 0, sizeof(*q));
+        q->limit = -1;
+        q->text = _csv_strdup(sql);
+        q->where = (csv_expr_t*)calloc(1, sizeof(csv_expr_t));
+        q->select = (csv_expr_t*)calloc(1, sizeof(csv_expr_t));
+        if (!q->text || !q->where || !q->select) {
+                return false;
+        }
+        q->where->max_col = -1;
+        q->select->max_col = -1;
+        _csv_parser_t ps = { q->select, q->text, q->text, header, num_cols, false };
+
+        if (!_csv_expr_keyword(&ps, "select")) {
+                _csv_expr_error(&ps, "expected SELECT");
+                return false;
+        }
+        if (_csv_expr_punct(&ps, "*")) {
+                q->star = true;
+        } else {
+                do {
+                        if (!_csv_query_parse_item(&ps, q, sql)) {
+                                return false;
+                        }
+                } while (_csv_expr_punct(&ps, ","));
+        }
+        if (_csv_expr_keyword(&ps, "from")) {
+                char* table = _csv_query_name(&ps);
+                free(table);
+        }
+        if (_csv_expr_keyword(&ps, "where")) {
+                ps.e = q->where;
+                q->where_value = _csv_expr_as_bool(&ps, _csv_expr_parse_or(&ps));
+                ps.e = q->select;
+        } else {
+                csv_expr_free(&q->where);
+        }
+        if (_csv_expr_keyword(&ps, "group")) {
+                if (!_csv_expr_keyword(&ps, "by")) {
+                        _csv_expr_error(&ps, "expected BY");
+                        return false;
+                }
+                do {
+                        if (!_csv_grow((void**)&q->keys, q->num_keys, sizeof(_csv_operand_t))) {
+                                return false;
+                        }
+                        q->keys[q->num_keys++] = _csv_expr_parse_or(&ps);
+                } while (!ps.failed && _csv_expr_punct(&ps, ","));
+                q->grouped = true;
+        }
+        if (!ps.failed && _csv_expr_keyword(&ps, "order")) {
+                if (!_csv_expr_keyword(&ps, "by")) {
+                        _csv_expr_error(&ps, "expected BY");
+                        return false;
+                }
+                if (q->star) {
+                        _csv_expr_error(&ps, "ORDER BY needs named output columns");
+                        return false;
+                }
+                if (!_csv_query_parse_order(&ps, q)) {
+                        return false;
+                }
+        }
+        if (!ps.failed && _csv_expr_keyword(&ps, "limit")) {
+                _csv_expr_skip_ws(&ps);
+                char* end;
+                q->limit = strtol(ps.p, &end, 10);
+                if (end == ps.p || q->limit < 0) {
+                        _csv_expr_error(&ps, "expected a row count");
+                }
+                ps.p = end;
+        }
+        _csv_expr_punct(&ps, ";");
+        _csv_expr_skip_ws(&ps);
+        if (!ps.failed && *ps.p) {
+                _csv_expr_error(&ps, "unexpected input");
+        }
+        if (!ps.failed && q->star && q->grouped) {
+                _csv_expr_error(&ps, "SELECT * cannot be grouped");
+        }
+        return !ps.failed;
+}
+
+#define _CSV_QUERY_BATCH _CSV_EXPR_BATCH
+
+// Up to one batch of input lines and their field spans.
+typedef struct {
+        _csv_buf_t lines;
+        size_t line_off[_CSV_QUERY_BATCH];
+        int span_off[_CSV_QUERY_BATCH];
+        int span_count[_CSV_QUERY_BATCH];
+        _csv_spans_t spans;
+        int n;
+        const int* sel;             // Row of each evaluated position, or NULL.
+} _csv_query_batch_t;
+
+// Reads up to a batch of non-empty lines, then splits each into at most
+// `width` spans (all fields when width is 0, none when it is negative).
+static
+bool
+_csv_query_fill(_csv_query_batch_t* b,
+                csv_reader_t* reader,
+                int width)
+{
+        b->n = 0;
+        b->lines.len = 0;
+        while (b->n < _CSV_QUERY_BATCH && _csv_reader_line(reader)) {
+                b->line_off[b->n++] = b->lines.len;
+                if (!_csv_buf_append(&b->lines, reader->line.data, reader->line.len + 1)) {
+                        return false;
+                }
+        }
+
+        // Lines are tokenized once the arena stops moving.
+        _csv_find_fn find = _csv_get_kernel()->find;
+        b->spans.count = 0;
+        for (int r = 0; r < b->n; r++) {
+                const char* line = b->lines.data + b->line_off[r];
+                const char* end = line + strlen(line);
+                b->span_off[r] = b->spans.count;
+                while (width >= 0 && line < end && (width == 0 || b->spans.count - b->span_off[r] < width)) {
+                        if (b->spans.count == b->spans.cap) {
+                                int cap = b->spans.cap ? b->spans.cap * 2 : 1024;
+                                _csv_span_t* data = (_csv_span_t*)realloc(b->spans.data, cap * sizeof(_csv_span_t));
+                                if (!data) {
+                                        return false;
+                                }
+                                b->spans.data = data;
+                                b->spans.cap = cap;
+                        }
+                        line = _csv_next_span(line, end, find, &b->spans.data[b->spans.count++]);
+                }
+                b->span_count[r] = b->spans.count - b->span_off[r];
+        }
+        return true;
+}
+
+static
+void
+_csv_expr_load_batch(void* ctx,
+                     int col,
+                     int base,
+                     int n,
+                     _csv_span_t* out)
+{
+        const _csv_query_batch_t* b = (const _csv_query_batch_t*)ctx;
+        static const _csv_span_t empty = { "", 0, false };
+        for (int i = 0; i < n; i++) {
+                int r = b->sel ? b->sel[base + i] : base + i;
+                out[i] = col < b->span_count[r] ? b->spans.data[b->span_off[r] + col] : empty;
+        }
+}
+
+// Appends a number in its shortest form that reads back exactly.
+static
+bool
+_csv_buf_append_double(_csv_buf_t* buf,
+                       double v)
+{
+        char tmp[32];
+        if (v == floor(v) && fabs(v) < 1e15) {
+                snprintf(tmp, sizeof(tmp), "%.0f", v == 0 ? 0.0 : v);
+        } else {
+                snprintf(tmp, sizeof(tmp), "%.15g", v);
+                if (strtod(tmp, NULL) != v) {
+                        snprintf(tmp, sizeof(tmp), "%.17g", v);
                 }
-                printf("\n");
-                for (int i = 0; i < doc->num_cols; i++) {
-                        for(int j = 0; j < col_widths[i]; j++) {
-                                putchar('-');
+        }
+        return _csv_buf_append(buf, tmp, strlen(tmp));
+}
+
+// Appends value `i` of a register as text followed by a NUL. Null is "".
+static
+bool
+_csv_query_format(_csv_buf_t* buf,
+                  const _csv_expr_frame_t* frame,
+                  _csv_operand_t value,
+                  int i)
+{
+        const void* reg = _csv_expr_reg(frame, value.reg);
+        bool ok = true;
+        if (value.type == _CSV_VAL_STR) {
+                const _csv_span_t* s = &((const _csv_span_t*)reg)[i];
+                ok = _csv_buf_append(buf, s->start, s->len);
+        } else if (value.type == _CSV_VAL_BOOL) {
+                ok = ((const uint8_t*)reg)[i] ? _csv_buf_append(buf, "true", 4) : _csv_buf_append(buf, "false", 5);
+        } else if (!isnan(((const double*)reg)[i])) {
+                ok = _csv_buf_append_double(buf, ((const double*)reg)[i]);
+        }
+        return ok && _csv_buf_append(buf, "", 1);
+}
+
+// Appends a row whose fields are `n` NUL-terminated strings packed in `text`.
+static
+bool
+_csv_query_emit(csv_document_t* doc,
+                const char* text,
+                int n,
+                const char** fields)
+{
+        for (int k = 0; k < n; k++) {
+                fields[k] = text;
+                text += strlen(text) + 1;
+        }
+        return csv_append_row(doc, fields, n) == 0;
+}
+
+typedef struct {
+        long count;
+        double sum;
+        double min;
+        double max;
+} _csv_group_acc_t;
+
+// Per-group state: the serialized key and the text of the non-aggregate
+// items, taken from the group's first row, live in `arena`.
+typedef struct {
+        size_t key_off;
+        size_t key_len;
+        size_t first_off;
+        bool has_first;
+} _csv_group_t;
+
+typedef struct {
+        _csv_htab_t table;
+        _csv_buf_t arena;
+        _csv_group_t* groups;
+        _csv_group_acc_t* acc;      // num_items per group.
+        int count;
+} _csv_groups_t;
+
+static
+bool
+_csv_query_key(_csv_buf_t* key,
+               const _csv_query_t* q,
+               const _csv_expr_frame_t* frame,
+               int i)
+{
+        key->len = 0;
+        for (int k = 0; k < q->num_keys; k++) {
+                const void* reg = _csv_expr_reg(frame, q->keys[k].reg);
+                bool ok;
+                if (q->keys[k].type == _CSV_VAL_STR) {
+                        const _csv_span_t* s = &((const _csv_span_t*)reg)[i];
+                        ok = _csv_buf_append(key, (const char*)&s->len, sizeof(s->len)) &&
+                             _csv_buf_append(key, s->start, s->len);
+                } else if (q->keys[k].type == _CSV_VAL_BOOL) {
+                        ok = _csv_buf_append(key, (const char*)&((const uint8_t*)reg)[i], 1);
+                } else {
+                        double v = ((const double*)reg)[i];
+                        v = isnan(v) ? NAN : v + 0.0; // One bit pattern for null and for zero.
+                        ok = _csv_buf_append(key, (const char*)&v, sizeof(v));
+                }
+                if (!ok) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+static
+_csv_group_t*
+_csv_query_group(_csv_groups_t* g,
+                 const _csv_buf_t* key,
+                 int num_items)
+{
+        uint64_t hash = key->len > 0 ? _csv_hash_bytes(key->data, key->len, 0) : 0;
+        size_t cursor = _csv_htab_probe(&g->table, hash);
+        int64_t* slot;
+        while ((slot = _csv_htab_next(&g->table, hash, &cursor))) {
+                _csv_group_t* group = &g->groups[*slot];
+                if (group->key_len == key->len &&
+                    (key->len == 0 || memcmp(g->arena.data + group->key_off, key->data, key->len) == 0)) {
+                        return group;
+                }
+        }
+        if (!_csv_grow((void**)&g->groups, g->count, sizeof(_csv_group_t)) ||
+            !_csv_grow((void**)&g->acc, g->count * num_items + num_items - 1, sizeof(_csv_group_acc_t))) {
+                return NULL;
+        }
+        _csv_group_t* group = &g->groups[g->count];
+        group->key_off = g->arena.len;
+        group->key_len = key->len;
+        group->has_first = false;
+        for (int j = 0; j < num_items; j++) {
+                _csv_group_acc_t* acc = &g->acc[(size_t)g->count * num_items + j];
+                acc->count = 0;
+                acc->sum = 0.0;
+                acc->min = INFINITY;
+                acc->max = -INFINITY;
+        }
+        if ((key->len > 0 && !_csv_buf_append(&g->arena, key->data, key->len)) ||
+            !_csv_htab_insert(&g->table, hash, g->count)) {
+                return NULL;
+        }
+        g->count++;
+        return group;
+}
+
+// Folds row `i` of the batch into its group.
+static
+bool
+_csv_query_accumulate(_csv_groups_t* g,
+                      const _csv_query_t* q,
+                      const _csv_expr_frame_t* frame,
+                      int i,
+                      _csv_buf_t* key)
+{
+        if (!_csv_query_key(key, q, frame, i)) {
+                return false;
+        }
+        _csv_group_t* group = _csv_query_group(g, key, q->num_items);
+        if (!group) {
+                return false;
+        }
+        if (!group->has_first) {
+                group->first_off = g->arena.len;
+                group->has_first = true;
+                for (int j = 0; j < q->num_items; j++) {
+                        if (q->items[j].agg == _CSV_AGG_NONE && !_csv_query_format(&g->arena, frame, q->items[j].value, i)) {
+                                return false;
                         }
-                        printf("-+-");
                 }
-                printf("\n");
         }
-        
-        // Print rows
-        for (int i = 0; i < doc->num_rows; i++) {
-                for (int j = 0; j < doc->rows[i]->num_fields; j++) {
-                        if (j < doc->num_cols) {
-                                printf("%-*s | ", col_widths[j], doc->rows[i]->fields[j]);
+        _csv_group_acc_t* acc = &g->acc[(size_t)(group - g->groups) * q->num_items];
+        for (int j = 0; j < q->num_items; j++) {
+                const _csv_query_item_t* item = &q->items[j];
+                if (item->agg == _CSV_AGG_NONE) {
+                        continue;
+                }
+                if (item->agg == _CSV_AGG_COUNT_ALL) {
+                        acc[j].count++;
+                        continue;
+                }
+                const void* reg = _csv_expr_reg(frame, item->value.reg);
+                if (item->agg == _CSV_AGG_COUNT) {
+                        if (item->value.type == _CSV_VAL_STR) {
+                                acc[j].count += ((const _csv_span_t*)reg)[i].len > 0;
+                        } else if (item->value.type == _CSV_VAL_NUM) {
+                                acc[j].count += !isnan(((const double*)reg)[i]);
+                        } else {
+                                acc[j].count++;
                         }
+                        continue;
+                }
+                double v = ((const double*)reg)[i];
+                if (!isnan(v)) {
+                        acc[j].count++;
+                        acc[j].sum += v;
+                        acc[j].min = v < acc[j].min ? v : acc[j].min;
+                        acc[j].max = v > acc[j].max ? v : acc[j].max;
                 }
-                printf("\n");
         }
+        return true;
+}
 
-        free(col_widths);
+// Appends one output row per group, in order of first appearance.
+static
+bool
+_csv_query_emit_groups(csv_document_t* doc,
+                       const _csv_groups_t* g,
+                       const _csv_query_t* q,
+                       const char** fields)
+{
+        _csv_buf_t row = { NULL, 0, 0 };
+        bool ok = true;
+        for (int gi = 0; gi < g->count && ok; gi++) {
+                const _csv_group_t* group = &g->groups[gi];
+                const _csv_group_acc_t* acc = &g->acc[(size_t)gi * q->num_items];
+                // A global aggregate over no rows has no first row: its items are empty.
+                const char* first = group->has_first ? g->arena.data + group->first_off : NULL;
+                row.len = 0;
+                for (int j = 0; j < q->num_items && ok; j++) {
+                        const _csv_query_item_t* item = &q->items[j];
+                        if (item->agg == _CSV_AGG_NONE) {
+                                if (first) {
+                                        size_t len = strlen(first);
+                                        ok = _csv_buf_append(&row, first, len);
+                                        first += len + 1;
+                                }
+                        } else if (item->agg == _CSV_AGG_COUNT_ALL || item->agg == _CSV_AGG_COUNT) {
+                                ok = _csv_buf_append_double(&row, (double)acc[j].count);
+                        } else if (acc[j].count > 0) {
+                                double v = item->agg == _CSV_AGG_SUM ? acc[j].sum
+                                         : item->agg == _CSV_AGG_AVG ? acc[j].sum / (double)acc[j].count
+                                         : item->agg == _CSV_AGG_MIN ? acc[j].min
+                                         : acc[j].max;
+                                ok = _csv_buf_append_double(&row, v);
+                        }
+                        ok = ok && _csv_buf_append(&row, "", 1);
+                }
+                ok = ok && _csv_query_emit(doc, row.data, q->num_items, fields);
+        }
+        _csv_buf_free(&row);
+        return ok;
+}
+
+// Applies ORDER BY and LIMIT to the finished result.
+static
+csv_document_t*
+_csv_query_finish(csv_document_t* doc,
+                  const _csv_query_t* q)
+{
+        if (q->num_order == 0 && (q->limit < 0 || q->limit >= doc->num_rows)) {
+                return doc;
+        }
+        csv_view_t* view = csv_view_create(doc, NULL, 0);
+        bool ok = view != NULL;
+        // Stable sorts from the least significant key give the full order.
+        for (int k = q->num_order - 1; k >= 0 && ok; k--) {
+                int col = q->order[k].item;
+                const _csv_query_item_t* item = &q->items[col];
+                csv_type_t type = CSV_TYPE_DOUBLE;
+                if (item->agg == _CSV_AGG_NONE && item->value.type != _CSV_VAL_NUM) {
+                        // Text sorts as numbers only if every value is one.
+                        for (int i = 0; i < doc->num_rows && type == CSV_TYPE_DOUBLE; i++) {
+                                double v;
+                                if (item->value.type == _CSV_VAL_BOOL || !_csv_parse_double(csv_field(doc, i, col), &v)) {
+                                        type = CSV_TYPE_STRING;
+                                }
+                        }
+                }
+                ok = csv_view_sort(view, col, type, q->order[k].descending) == 0;
+        }
+        if (ok && q->limit >= 0 && q->limit < view->num_rows) {
+                view->num_rows = (int)q->limit; // Keeps a prefix of either view form.
+        }
+        csv_document_t* out = ok ? csv_view_materialize(view) : NULL;
+        csv_view_free(&view);
+        csv_free(&doc);
+        return out;
+}
+
+csv_document_t*
+csv_query(const char* path,
+          const char* sql)
+{
+        if (!path || !sql) {
+                return NULL;
+        }
+        csv_reader_t* reader = csv_reader_open(path, true);
+        if (!reader) {
+                return NULL;
+        }
+        const csv_row_t* header = csv_reader_header(reader);
+        char* const* names = header ? header->fields : NULL;
+        int num_cols = header ? header->num_fields : 0;
+
+        _csv_query_t q;
+        bool ok = _csv_query_parse(&q, sql, names, num_cols);
+        int width = q.star ? num_cols : q.num_items;
+        csv_document_t* doc = ok ? (csv_document_t*)calloc(1, sizeof(csv_document_t)) : NULL;
+        if (doc) {
+                doc->header = (char**)calloc(width > 0 ? width : 1, sizeof(char*));
+        }
+        ok = doc && doc->header;
+        for (int k = 0; ok && k < width; k++) {
+                doc->header[k] = _csv_strdup(q.star ? names[k] : q.items[k].name);
+                ok = doc->header[k] != NULL;
+                doc->num_cols = k + 1;
+        }
+
+        // Projection pushdown: tokenize only up to the last referenced column.
+        int needed = q.select ? q.select->max_col : -1;
+        if (q.where && q.where->max_col > needed) {
+                needed = q.where->max_col;
+        }
+        int tokenize = q.star ? 0 : (needed >= 0 ? needed + 1 : -1);
+
+        _csv_query_batch_t* batch = ok ? (_csv_query_batch_t*)calloc(1, sizeof(_csv_query_batch_t)) : NULL;
+        _csv_expr_frame_t where_frame = { NULL };
+        _csv_expr_frame_t select_frame = { NULL };
+        int* sel = (int*)malloc(_CSV_QUERY_BATCH * sizeof(int));
+        const char** fields = (const char**)malloc((width > 0 ? width : 1) * sizeof(char*));
+        _csv_buf_t text = { NULL, 0, 0 };
+        _csv_groups_t groups;
+        memset(&groups, 0, sizeof(groups));
+        ok = ok && batch && sel && fields && _csv_expr_frame_init(&select_frame, q.select) &&
+             (!q.where || _csv_expr_frame_init(&where_frame, q.where)) &&
+             (!q.grouped || _csv_htab_init(&groups.table, 1024));
+        if (ok && q.grouped && q.num_keys == 0) {
+                // Aggregates without GROUP BY give one row, even for no input.
+                _csv_buf_t none = { NULL, 0, 0 };
+                ok = _csv_query_group(&groups, &none, q.num_items) != NULL;
+        }
+
+        // Rows can stop early only when neither sorting nor grouping needs them all.
+        long wanted = q.num_order == 0 && !q.grouped ? q.limit : -1;
+        while (ok && (wanted < 0 || doc->num_rows < wanted)) {
+                if (!_csv_query_fill(batch, reader, tokenize)) {
+                        ok = false;
+                        break;
+                }
+                if (batch->n == 0) {
+                        break;
+                }
+                int m = batch->n;
+                batch->sel = NULL;
+                if (q.where) {
+                        // The filter runs on the raw spans; survivors are compacted into `sel`.
+                        _csv_expr_run(q.where, &where_frame, _csv_expr_load_batch, batch, 0, batch->n);
+                        const uint8_t* keep = (const uint8_t*)_csv_expr_reg(&where_frame, q.where_value.reg);
+                        m = 0;
+                        for (int r = 0; r < batch->n; r++) {
+                                sel[m] = r;
+                                m += keep[r];
+                        }
+                        batch->sel = sel;
+                }
+                _csv_expr_run(q.select, &select_frame, _csv_expr_load_batch, batch, 0, m);
+
+                for (int i = 0; i < m && ok; i++) {
+                        if (q.grouped) {
+                                ok = _csv_query_accumulate(&groups, &q, &select_frame, i, &text);
+                                continue;
+                        }
+                        if (wanted >= 0 && doc->num_rows >= wanted) {
+                                break;
+                        }
+                        text.len = 0;
+                        int n = width;
+                        if (q.star) {
+                                int r = batch->sel ? batch->sel[i] : i;
+                                n = batch->span_count[r] < width ? batch->span_count[r] : width;
+                                for (int k = 0; k < n && ok; k++) {
+                                        const _csv_span_t* s = &batch->spans.data[batch->span_off[r] + k];
+                                        ok = _csv_buf_append(&text, s->start, s->len) && _csv_buf_append(&text, "", 1);
+                                }
+                        } else {
+                                for (int k = 0; k < n && ok; k++) {
+                                        ok = _csv_query_format(&text, &select_frame, q.items[k].value, i);
+                                }
+                        }
+                        ok = ok && _csv_query_emit(doc, text.data, n, fields);
+                }
+        }
+        if (ok && q.grouped) {
+                ok = _csv_query_emit_groups(doc, &groups, &q, fields);
+        }
+        if (ok) {
+                doc = _csv_query_finish(doc, &q);
+        } else {
+                csv_free(&doc);
+        }
+
+        if (batch) {
+                _csv_buf_free(&batch->lines);
+                free(batch->spans.data);
+                free(batch);
+        }
+        _csv_htab_free(&groups.table);
+        _csv_buf_free(&groups.arena);
+        free(groups.groups);
+        free(groups.acc);
+        free(where_frame.mem);
+        free(select_frame.mem);
+        free(sel);
+        free(fields);
+        _csv_buf_free(&text);
+        _csv_query_free(&q);
+        csv_reader_close(&reader);
+        return doc;
+}
+
+// -------------------------------------------------------------------------------------
+// Schemas
+// -------------------------------------------------------------------------------------
+
+// Read state for csv_read_typed(). STRING values are gathered in `text` and
+// their offsets in the column's values until the column is finished.
+typedef struct {
+        const csv_schema_t* schema;
+        csv_table_t* table;
+        int* fields;            // Line field index of each schema column.
+        _csv_buf_t* text;       // Per-column STRING storage.
+        int cap;                // Row capacity of every column.
+        csv_violation_fn on_violation;
+        void* ctx;
+        _csv_buf_t scratch;     // The NUL-terminated value of a violation.
+} _csv_typed_t;
+
+static inline
+size_t
+_csv_typed_size(csv_type_t type)
+{
+        return type == CSV_TYPE_DOUBLE ? sizeof(double) : type == CSV_TYPE_STRING ? sizeof(size_t) : sizeof(int64_t);
+}
+
+// Doubles the row capacity of every column.
+static
+bool
+_csv_typed_grow(_csv_typed_t* t)
+{
+        if (t->cap == 0x7fffffff) {
+                return false; // Column lengths are ints.
+        }
+        int cap = t->cap == 0 ? 1024 : t->cap < 0x40000000 ? t->cap * 2 : 0x7fffffff;
+        size_t old_words = ((size_t)t->cap + 63) / 64;
+        size_t words = ((size_t)cap + 63) / 64;
+        for (int c = 0; c < t->table->num_columns; c++) {
+                csv_column_t* col = t->table->columns[c];
+                void* values = realloc(col->values, (size_t)cap * _csv_typed_size(col->type));
+                if (!values) {
+                        return false;
+                }
+                col->values = values;
+                uint64_t* validity = (uint64_t*)realloc(col->validity, words * sizeof(uint64_t));
+                if (!validity) {
+                        return false;
+                }
+                memset(validity + old_words, 0, (words - old_words) * sizeof(uint64_t));
+                col->validity = validity;
+        }
+        t->cap = cap;
+        return true;
+}
+
+// Reports a violation of column `c`. Returns false if the callback asked to stop.
+static
+bool
+_csv_typed_report(_csv_typed_t* t,
+                  const csv_reader_t* reader,
+                  csv_violation_kind_t kind,
+                  int c,
+                  const _csv_span_t* span)
+{
+        t->table->num_violations++;
+        if (!t->on_violation) {
+                return true;
+        }
+        csv_violation_t v;
+        v.kind = kind;
+        v.column = c;
+        v.row = t->table->num_rows;
+        v.offset = reader->line_offset + (long)reader->line.len;
+        t->scratch.len = 0;
+        if (span) {
+                v.offset = reader->line_offset + (long)(span->start - reader->line.data) - (span->quoted ? 1 : 0);
+                if (!_csv_buf_append(&t->scratch, span->start, (size_t)span->len)) {
+                        return false;
+                }
+        }
+        if (!_csv_buf_append(&t->scratch, "", 1)) {
+                return false;
+        }
+        v.value = t->scratch.data;
+        return t->on_violation(&v, t->ctx);
+}
+
+// Checks and converts the field of column `c` in the current row. Returns
+// false on allocation failure or when the callback asked to stop.
+static
+bool
+_csv_typed_field(_csv_typed_t* t,
+                 const csv_reader_t* reader,
+                 int c)
+{
+        const csv_schema_column_t* def = &t->schema->columns[c];
+        csv_column_t* col = t->table->columns[c];
+        int i = t->table->num_rows;
+        int f = t->fields[c];
+        const _csv_span_t* span = f < reader->spans.count ? &reader->spans.data[f] : NULL;
+
+        if (!span || span->len == 0) {
+                if (def->type == CSV_TYPE_STRING) {
+                        ((size_t*)col->values)[i] = 0;
+                } else {
+                        ((int64_t*)col->values)[i] = 0; // Also 0.0 for doubles.
+                }
+                col->null_count++;
+                return def->nullable || _csv_typed_report(t, reader, CSV_VIOLATION_NULL, c, span);
+        }
+
+        csv_violation_kind_t kind = CSV_VIOLATION_TYPE;
+        bool ok = def->max_length <= 0 || span->len <= def->max_length;
+        if (!ok) {
+                kind = CSV_VIOLATION_LENGTH;
+        } else if (def->enum_values) {
+                ok = false;
+                for (int k = 0; k < def->num_enum_values && !ok; k++) {
+                        ok = strlen(def->enum_values[k]) == (size_t)span->len &&
+                             memcmp(def->enum_values[k], span->start, span->len) == 0;
+                }
+                kind = CSV_VIOLATION_ENUM;
+        }
+        if (ok) {
+                kind = CSV_VIOLATION_TYPE;
+                switch (def->type) {
+                case CSV_TYPE_INT64:
+                        ok = _csv_parse_span_int64(span, &((int64_t*)col->values)[i]);
+                        break;
+                case CSV_TYPE_DOUBLE:
+                        ok = _csv_parse_span_double(span, &((double*)col->values)[i]);
+                        break;
+                case CSV_TYPE_BOOL:
+                        ok = _csv_parse_bool(span->start, (size_t)span->len, &((int64_t*)col->values)[i]);
+                        break;
+                default:
+                        ((size_t*)col->values)[i] = t->text[c].len + 1; // 0 is null.
+                        if (!_csv_buf_append(&t->text[c], span->start, (size_t)span->len) ||
+                            !_csv_buf_append(&t->text[c], "", 1)) {
+                                return false;
+                        }
+                        break;
+                }
+        }
+        if (ok) {
+                col->validity[i >> 6] |= 1ULL << (i & 63);
+                return true;
+        }
+        if (def->type == CSV_TYPE_STRING) {
+                ((size_t*)col->values)[i] = 0;
+        } else {
+                ((int64_t*)col->values)[i] = 0;
+        }
+        col->null_count++;
+        return _csv_typed_report(t, reader, kind, c, span);
+}
+
+// Trims a column to its length and gives STRING columns their final form:
+// one block holding the pointer array followed by the text.
+static
+bool
+_csv_typed_finish(csv_column_t* col,
+                  const _csv_buf_t* text)
+{
+        if (col->type == CSV_TYPE_STRING) {
+                size_t n = (size_t)col->length;
+                char** block = (char**)malloc(n * sizeof(char*) + text->len + 1);
+                if (!block) {
+                        return false;
+                }
+                char* base = (char*)(block + n);
+                if (text->len > 0) {
+                        memcpy(base, text->data, text->len);
+                }
+                const size_t* offsets = (const size_t*)col->values;
+                for (size_t i = 0; i < n; i++) {
+                        block[i] = offsets[i] ? base + offsets[i] - 1 : NULL;
+                }
+                free(col->values);
+                col->values = block;
+        }
+        if (col->null_count == 0) {
+                free(col->validity);
+                col->validity = NULL;
+        }
+        return true;
+}
+
+csv_table_t*
+csv_read_typed(const char* file_path,
+               bool has_header,
+               const csv_schema_t* schema,
+               csv_violation_fn on_violation,
+               void* ctx)
+{
+        if (!file_path || !schema || schema->num_columns <= 0 || !schema->columns) {
+                return NULL;
+        }
+        for (int c = 0; c < schema->num_columns; c++) {
+                if ((unsigned)schema->columns[c].type > CSV_TYPE_BOOL) {
+                        return NULL;
+                }
+        }
+        csv_reader_t* reader = csv_reader_open(file_path, has_header);
+        if (!reader) {
+                return NULL;
+        }
+
+        int n = schema->num_columns;
+        _csv_typed_t t;
+        memset(&t, 0, sizeof(t));
+        t.schema = schema;
+        t.on_violation = on_violation;
+        t.ctx = ctx;
+        t.table = (csv_table_t*)calloc(1, sizeof(csv_table_t));
+        t.fields = (int*)malloc(n * sizeof(int));
+        t.text = (_csv_buf_t*)calloc(n, sizeof(_csv_buf_t));
+        bool ok = t.table && t.fields && t.text;
+        if (ok) {
+                t.table->columns = (csv_column_t**)calloc(n, sizeof(csv_column_t*));
+                ok = t.table->columns != NULL;
+        }
+        for (int c = 0; c < n && ok; c++) {
+                t.table->columns[c] = (csv_column_t*)calloc(1, sizeof(csv_column_t));
+                ok = t.table->columns[c] != NULL;
+                if (ok) {
+                        t.table->columns[c]->type = schema->columns[c].type;
+                        t.table->num_columns++;
+                }
+        }
+
+        // Bind each column to its field, by header name or by position.
+        const csv_row_t* header = csv_reader_header(reader);
+        int width = 0;
+        for (int c = 0; c < n && ok; c++) {
+                const char* name = schema->columns[c].name;
+                t.fields[c] = c;
+                if (name) {
+                        t.fields[c] = -1;
+                        for (int j = 0; header && j < header->num_fields && t.fields[c] < 0; j++) {
+                                if (strcmp(header->fields[j], name) == 0) {
+                                        t.fields[c] = j;
+                                }
+                        }
+                        if (t.fields[c] < 0) {
+                                fprintf(stderr, "Unknown column: %s\n", name);
+                                ok = false;
+                        }
+                }
+                if (ok && t.fields[c] + 1 > width) {
+                        width = t.fields[c] + 1;
+                }
+        }
+
+        while (ok && _csv_reader_next_spans(reader, width)) {
+                if (t.table->num_rows == t.cap && !_csv_typed_grow(&t)) {
+                        ok = false;
+                        break;
+                }
+                for (int c = 0; c < n && ok; c++) {
+                        ok = _csv_typed_field(&t, reader, c);
+                }
+                t.table->num_rows++;
+        }
+        for (int c = 0; c < t.table->num_columns && ok; c++) {
+                t.table->columns[c]->length = t.table->num_rows;
+                ok = _csv_typed_finish(t.table->columns[c], &t.text[c]);
+        }
+
+        if (!ok) {
+                csv_table_free(&t.table);
+        }
+        for (int c = 0; t.text && c < n; c++) {
+                _csv_buf_free(&t.text[c]);
+        }
+        free(t.text);
+        free(t.fields);
+        _csv_buf_free(&t.scratch);
+        csv_reader_close(&reader);
+        return t.table;
 }
 
 void
-csv_info(const csv_document_t* doc)
+csv_table_free(csv_table_t** table_ptr)
 {
-        if (!doc) {
-                printf("CSV Document is NULL.\n");
+        if (!table_ptr || !*table_ptr) {
                 return;
         }
-        printf("--- CSV Info ---\n");
-        printf("Rows:    %d\n", doc->num_rows);
-        printf("Columns: %d\n", doc->num_cols);
-        printf("Header:  %s\n", doc->header ? "Yes" : "No");
-        printf("----------------\n");
+        csv_table_t* table = *table_ptr;
+        for (int c = 0; c < table->num_columns; c++) {
+                csv_column_free(&table->columns[c]);
+        }
+        free(table->columns);
+        free(table);
+        *table_ptr = NULL;
+}
+
+// -------------------------------------------------------------------------------------
+// Schema Inference
+// -------------------------------------------------------------------------------------
+
+#define _CSV_INFER_MIN_CONFIDENCE 0.95
+#define _CSV_HLL_BITS 10 // 1024 registers: about 3% standard error.
+
+// Per-column counters for one inference pass.
+typedef struct {
+        long values;            // Non-empty values.
+        long as_bool;
+        long as_int;
+        long as_double;
+        uint8_t hll[1 << _CSV_HLL_BITS];
+} _csv_infer_t;
+
+static
+void
+_csv_hll_add(uint8_t* hll,
+             uint64_t hash)
+{
+        size_t j = (size_t)(hash >> (64 - _CSV_HLL_BITS));
+        uint64_t rest = hash << _CSV_HLL_BITS;
+        int rank = rest ? _csv_clz64(rest) + 1 : 64 - _CSV_HLL_BITS + 1;
+        if (rank > hll[j]) {
+                hll[j] = (uint8_t)rank;
+        }
+}
+
+static
+long
+_csv_hll_estimate(const uint8_t* hll)
+{
+        const double m = (double)(1 << _CSV_HLL_BITS);
+        double sum = 0.0;
+        int zeros = 0;
+        for (int j = 0; j < 1 << _CSV_HLL_BITS; j++) {
+                sum += ldexp(1.0, -hll[j]);
+                zeros += hll[j] == 0;
+        }
+        double e = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+        if (e <= 2.5 * m && zeros > 0) {
+                e = m * log(m / zeros); // Linear counting is exact-ish for small sets.
+        }
+        return (long)(e + 0.5);
+}
+
+// Folds one field (NULL if missing) into column `c` of the report.
+static
+bool
+_csv_infer_value(csv_column_info_t* info,
+                 _csv_infer_t* acc,
+                 const _csv_span_t* span)
+{
+        if (!span || span->len == 0) {
+                info->null_count++;
+                return true;
+        }
+        acc->values++;
+        int64_t i;
+        double d;
+        // Text that cannot start a number skips both strto* calls.
+        char first = span->start[0];
+        bool numeric = (first >= '0' && first <= '9') || first == '-' || first == '+' || first == '.' || first == ' ';
+        bool is_int = numeric && _csv_parse_span_int64(span, &i);
+        acc->as_bool += _csv_parse_bool(span->start, (size_t)span->len, &i);
+        acc->as_int += is_int;
+        acc->as_double += is_int || (numeric && _csv_parse_span_double(span, &d)); // Every int is a double.
+        _csv_hll_add(acc->hll, _csv_hash_bytes(span->start, (size_t)span->len, 0));
+        if (span->len > info->max_length) {
+                info->max_length = span->len;
+        }
+
+        if (info->num_examples < 3) {
+                for (int k = 0; k < info->num_examples; k++) {
+                        if (strlen(info->examples[k]) == (size_t)span->len &&
+                            memcmp(info->examples[k], span->start, span->len) == 0) {
+                                return true;
+                        }
+                }
+                char* example = (char*)malloc((size_t)span->len + 1);
+                if (!example) {
+                        return false;
+                }
+                memcpy(example, span->start, span->len);
+                example[span->len] = 0;
+                info->examples[info->num_examples++] = example;
+        }
+        return true;
+}
+
+// Picks the narrowest type most values parse as.
+static
+void
+_csv_infer_finish(csv_column_info_t* info,
+                  const _csv_infer_t* acc)
+{
+        const long counts[3] = { acc->as_bool, acc->as_int, acc->as_double };
+        const csv_type_t types[3] = { CSV_TYPE_BOOL, CSV_TYPE_INT64, CSV_TYPE_DOUBLE };
+        info->type = CSV_TYPE_STRING;
+        info->confidence = acc->values > 0 ? 1.0 : 0.0;
+        for (int k = 0; k < 3 && acc->values > 0; k++) {
+                double share = (double)counts[k] / (double)acc->values;
+                if (share >= _CSV_INFER_MIN_CONFIDENCE) {
+                        info->type = types[k];
+                        info->confidence = share;
+                        break;
+                }
+        }
+        info->nullable = info->null_count > 0;
+        info->distinct_estimate = acc->values > 0 ? _csv_hll_estimate(acc->hll) : 0;
+        if (info->distinct_estimate > acc->values) {
+                info->distinct_estimate = acc->values;
+        }
+}
+
+csv_schema_report_t*
+csv_infer_schema(const char* file_path,
+                 int sample_rows)
+{
+        if (!file_path || sample_rows < 0) {
+                return NULL;
+        }
+        csv_reader_t* reader = csv_reader_open(file_path, true);
+        if (!reader) {
+                return NULL;
+        }
+        const csv_row_t* header = csv_reader_header(reader);
+        int n = header ? header->num_fields : 0;
+        csv_schema_report_t* report = (csv_schema_report_t*)calloc(1, sizeof(csv_schema_report_t));
+        _csv_infer_t* acc = (_csv_infer_t*)calloc(n > 0 ? n : 1, sizeof(_csv_infer_t));
+        bool ok = report && acc;
+        if (ok) {
+                report->columns = (csv_column_info_t*)calloc(n > 0 ? n : 1, sizeof(csv_column_info_t));
+                ok = report->columns != NULL;
+        }
+        for (int c = 0; c < n && ok; c++) {
+                report->columns[c].name = _csv_strdup(header->fields[c]);
+                ok = report->columns[c].name != NULL;
+                report->num_columns++;
+        }
+
+        while (ok && (sample_rows == 0 || report->rows_sampled < sample_rows) && _csv_reader_next_spans(reader, n)) {
+                report->rows_sampled++;
+                for (int c = 0; c < n && ok; c++) {
+                        const _csv_span_t* span = c < reader->spans.count ? &reader->spans.data[c] : NULL;
+                        ok = _csv_infer_value(&report->columns[c], &acc[c], span);
+                }
+        }
+
+        csv_schema_column_t* schema = ok ? (csv_schema_column_t*)calloc(n > 0 ? n : 1, sizeof(csv_schema_column_t)) : NULL;
+        ok = ok && schema;
+        for (int c = 0; c < n && ok; c++) {
+                _csv_infer_finish(&report->columns[c], &acc[c]);
+                schema[c].name = report->columns[c].name;
+                schema[c].type = report->columns[c].type;
+                schema[c].nullable = report->columns[c].nullable;
+        }
+        if (ok) {
+                report->schema.columns = schema;
+                report->schema.num_columns = n;
+        } else {
+                free(schema);
+                csv_schema_report_free(&report);
+        }
+        free(acc);
+        csv_reader_close(&reader);
+        return report;
+}
+
+void
+csv_schema_report_free(csv_schema_report_t** report_ptr)
+{
+        if (!report_ptr || !*report_ptr) {
+                return;
+        }
+        csv_schema_report_t* report = *report_ptr;
+        for (int c = 0; c < report->num_columns; c++) {
+                free(report->columns[c].name);
+                for (int k = 0; k < report->columns[c].num_examples; k++) {
+                        free(report->columns[c].examples[k]);
+                }
+        }
+        free(report->columns);
+        free((void*)report->schema.columns);
+        free(report);
+        *report_ptr = NULL;
 }
 
 #endif // CSVIEW_IMPLEMENTATION
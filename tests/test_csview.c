@@ -0,0 +1,439 @@
+/*
+ * Regression driver for csview.h.
+ *
+ * Build and run from the repository root:
+ *
+ *     cc -std=c99 -D_POSIX_C_SOURCE=200809L -g -fsanitize=address,undefined \
+ *         tests/test_csview.c -o test_csview -lpthread -lm && ./test_csview
+ *
+ *     cc -std=c99 -D_POSIX_C_SOURCE=200809L -g -fsanitize=thread \
+ *         tests/test_csview.c -o test_csview_tsan -lpthread -lm && ./test_csview_tsan
+ *
+ * It includes the implementation directly so it can reach the internal
+ * kernels. Temporary files are created in the working directory and removed.
+ * Exits with 0 when every check passes.
+ */
+
+#define CSVIEW_IMPLEMENTATION
+#include "../csview.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                     \
+        do {                                                                            \
+                if (!(cond)) {                                                          \
+                        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+                        failures++;                                                     \
+                }                                                                       \
+        } while (0)
+
+// -------------------------------------------------------------------------------------
+// Helpers
+// -------------------------------------------------------------------------------------
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64*: deterministic across platforms, so failures reproduce.
+static
+uint64_t
+rng_next(void)
+{
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static
+int
+rng_below(int n)
+{
+        return (int)(rng_next() % (uint64_t)n);
+}
+
+static
+bool
+write_file(const char* path,
+           const char* text)
+{
+        FILE* f = fopen(path, "wb");
+        if (!f) {
+                return false;
+        }
+        bool ok = fputs(text, f) != EOF;
+        return fclose(f) == 0 && ok;
+}
+
+// Returns true if both files exist and hold the same bytes.
+static
+bool
+same_file(const char* a,
+          const char* b)
+{
+        FILE* fa = fopen(a, "rb");
+        FILE* fb = fopen(b, "rb");
+        bool same = fa && fb;
+        while (same) {
+                int ca = fgetc(fa);
+                int cb = fgetc(fb);
+                same = ca == cb;
+                if (ca == EOF) {
+                        break;
+                }
+        }
+        if (fa) {
+                fclose(fa);
+        }
+        if (fb) {
+                fclose(fb);
+        }
+        return same;
+}
+
+// The kernels usable on this CPU; the scalar reference is not listed.
+static
+int
+available_kernels(const _csv_kernel_t** kernels)
+{
+        int n = 0;
+        kernels[n++] = &_csv_kernel_swar;
+#ifdef _CSV_X86
+        unsigned features = csv_cpu_features();
+        if (features & CSV_CPU_SSE42) {
+                kernels[n++] = &_csv_kernel_sse42;
+        }
+        if (features & CSV_CPU_AVX2) {
+                kernels[n++] = &_csv_kernel_avx2;
+        }
+        if (features & CSV_CPU_AVX512) {
+                kernels[n++] = &_csv_kernel_avx512;
+        }
+#endif
+#ifdef _CSV_NEON
+        if (csv_cpu_features() & CSV_CPU_NEON) {
+                kernels[n++] = &_csv_kernel_neon;
+        }
+#endif
+        return n;
+}
+
+// -------------------------------------------------------------------------------------
+// Kernels
+// -------------------------------------------------------------------------------------
+
+// Every find kernel must agree with the scalar loop for any length and
+// alignment, including matches in the tail bytes past the last full vector.
+static
+void
+test_find_kernels(void)
+{
+        static const char alphabet[] = "ab,\"\n\r";
+        static const char targets[] = { ',', '"', '\n', 'z' };
+        const _csv_kernel_t* kernels[8];
+        int num_kernels = available_kernels(kernels);
+        char buf[512];
+
+        for (int iter = 0; iter < 20000; iter++) {
+                int start = rng_below(64);
+                int len = rng_below((int)sizeof(buf) - 64);
+                // Sparse inputs exercise the skip-ahead path, dense ones the match path.
+                int density = 1 + rng_below(64);
+                for (int i = 0; i < start + len; i++) {
+                        buf[i] = rng_below(density) == 0 ? alphabet[rng_below(6)] : 'a';
+                }
+                const char* p = buf + start;
+                const char* end = p + len;
+                char c = targets[rng_below(4)];
+                const char* expected = _csv_find_scalar(p, end, c);
+                for (int k = 0; k < num_kernels; k++) {
+                        const char* got = kernels[k]->find(p, end, c);
+                        if (got != expected) {
+                                fprintf(stderr, "find %s: start %d len %d '%c': got %d, expected %d\n",
+                                        kernels[k]->name, start, len, c, (int)(got - p), (int)(expected - p));
+                                failures++;
+                        }
+                }
+        }
+}
+
+static
+void
+test_scan_kernels(void)
+{
+        static const csv_cmp_t ops[] = { CSV_CMP_EQ, CSV_CMP_NE, CSV_CMP_LT, CSV_CMP_LE, CSV_CMP_GT, CSV_CMP_GE };
+        const _csv_kernel_t* kernels[8];
+        int num_kernels = available_kernels(kernels);
+        double f64[300];
+        int64_t i64[300];
+        uint64_t want[5];
+        uint64_t got[5];
+
+        for (int iter = 0; iter < 5000; iter++) {
+                int n = rng_below(300);
+                int spread = 1 + rng_below(1000);
+                for (int i = 0; i < n; i++) {
+                        // Integral doubles keep every partial sum exact, so lane
+                        // order cannot change the result.
+                        f64[i] = (double)(rng_below(2 * spread) - spread);
+                        i64[i] = (int64_t)(rng_next() >> rng_below(64));
+                        if (rng_below(8) == 0) {
+                                i64[i] = rng_below(2) ? INT64_MAX : INT64_MIN;
+                        }
+                }
+                csv_cmp_t op = ops[rng_below(6)];
+                double tf = n > 0 && rng_below(2) ? f64[rng_below(n)] : (double)(rng_below(2 * spread) - spread);
+                int64_t ti = n > 0 && rng_below(2) ? i64[rng_below(n)] : (int64_t)rng_next();
+
+                _csv_agg_acc_t ref_f, ref_i;
+                _csv_agg_init(&ref_f);
+                _csv_agg_init(&ref_i);
+                _csv_agg_f64_scalar(f64, n, &ref_f);
+                _csv_agg_i64_scalar(i64, n, &ref_i);
+
+                for (int k = 0; k < num_kernels; k++) {
+                        const _csv_kernel_t* kernel = kernels[k];
+                        _csv_agg_acc_t acc;
+                        _csv_agg_init(&acc);
+                        kernel->agg_f64(f64, n, &acc);
+                        CHECK(acc.count == ref_f.count && acc.sum == ref_f.sum &&
+                              acc.min == ref_f.min && acc.max == ref_f.max);
+                        _csv_agg_init(&acc);
+                        kernel->agg_i64(i64, n, &acc);
+                        CHECK(acc.count == ref_i.count && acc.int_sum == ref_i.int_sum &&
+                              acc.int_min == ref_i.int_min && acc.int_max == ref_i.int_max);
+
+                        size_t words = ((size_t)n + 63) / 64;
+                        _csv_cmp_f64_scalar(f64, n, op, tf, want);
+                        memset(got, 0xA5, sizeof(got));
+                        kernel->cmp_f64(f64, n, op, tf, got);
+                        CHECK(memcmp(got, want, words * sizeof(uint64_t)) == 0);
+                        _csv_cmp_i64_scalar(i64, n, op, ti, want);
+                        memset(got, 0xA5, sizeof(got));
+                        kernel->cmp_i64(i64, n, op, ti, got);
+                        CHECK(memcmp(got, want, words * sizeof(uint64_t)) == 0);
+                }
+        }
+}
+
+// -------------------------------------------------------------------------------------
+// Thread Pool & Versioned Publish
+// -------------------------------------------------------------------------------------
+
+typedef struct {
+        csv_pool_t* pool;
+        long total;
+} sum_job_t;
+
+static
+void
+add_index(void* arg,
+          int index)
+{
+        sum_job_t* job = (sum_job_t*)arg;
+        _csv_atomic_fetch_add_long(&job->total, index);
+}
+
+// Each outer task runs a nested parallel_for from inside the pool.
+static
+void
+nested_sum(void* arg,
+           int index)
+{
+        (void)index;
+        sum_job_t* job = (sum_job_t*)arg;
+        csv_pool_parallel_for(job->pool, 100, add_index, job);
+}
+
+enum { PUBLISHES = 200, READS = 2000 };
+
+typedef struct {
+        csv_versioned_t* versioned;
+        long torn;
+} publish_job_t;
+
+// Task 0 publishes PUBLISHES new versions, each with one more row than the
+// last; the others read. Every version's last row holds its own row index,
+// so a reader can tell a torn or freed document from a valid one.
+static
+void
+publish_or_read(void* arg,
+                int index)
+{
+        publish_job_t* job = (publish_job_t*)arg;
+        char text[32];
+        if (index == 0) {
+                for (int i = 0; i < PUBLISHES; i++) {
+                        csv_snapshot_t snap = csv_snapshot_acquire(job->versioned);
+                        csv_document_t* next = csv_derive(snap.doc);
+                        csv_snapshot_release(job->versioned, &snap);
+                        snprintf(text, sizeof(text), "%d", next ? next->num_rows : 0);
+                        const char* fields[] = { text };
+                        if (!next || csv_append_row(next, fields, 1) != 0) {
+                                _csv_atomic_fetch_add_long(&job->torn, 1);
+                                csv_free(&next);
+                                return;
+                        }
+                        csv_versioned_publish(job->versioned, next);
+                }
+                return;
+        }
+        int seen = 0;
+        for (int i = 0; i < READS; i++) {
+                csv_snapshot_t snap = csv_snapshot_acquire(job->versioned);
+                int rows = snap.doc->num_rows;
+                snprintf(text, sizeof(text), "%d", rows - 1);
+                const char* last = csv_field(snap.doc, rows - 1, 0);
+                if (rows < seen || !last || strcmp(last, text) != 0) {
+                        _csv_atomic_fetch_add_long(&job->torn, 1);
+                }
+                seen = rows;
+                csv_snapshot_release(job->versioned, &snap);
+        }
+}
+
+static
+void
+test_pool_and_publish(void)
+{
+        csv_pool_t* pool = csv_pool_create(4);
+        CHECK(pool != NULL);
+        if (!pool) {
+                return;
+        }
+
+        sum_job_t sum = { pool, 0 };
+        csv_pool_parallel_for(pool, 10000, add_index, &sum);
+        CHECK(sum.total == 10000L * 9999 / 2);
+        sum.total = 0;
+        csv_pool_parallel_for(pool, 16, nested_sum, &sum);
+        CHECK(sum.total == 16L * (100 * 99 / 2));
+
+        CHECK(write_file("test_csview_versions.csv", "n\n0\n"));
+        csv_document_t* initial = csv_read("test_csview_versions.csv", true);
+        CHECK(initial != NULL);
+        if (initial) {
+                publish_job_t job = { csv_versioned_create(initial), 0 };
+                CHECK(job.versioned != NULL);
+                if (job.versioned) {
+                        csv_pool_parallel_for(pool, 6, publish_or_read, &job);
+                        CHECK(job.torn == 0);
+                        csv_snapshot_t snap = csv_snapshot_acquire(job.versioned);
+                        CHECK(snap.doc->num_rows == 1 + PUBLISHES);
+                        csv_snapshot_release(job.versioned, &snap);
+                        csv_versioned_free(&job.versioned);
+                }
+        }
+        remove("test_csview_versions.csv");
+        csv_pool_destroy(&pool);
+}
+
+// -------------------------------------------------------------------------------------
+// Parallel Write
+// -------------------------------------------------------------------------------------
+
+// csv_write_parallel() must produce the same bytes as csv_write(), with a
+// pool and serially, across several chunks and with fields that need quoting.
+static
+void
+test_write_parallel(void)
+{
+        static const char* const samples[] = { "", "plain", "with,comma", "say \"\"hi\"\"", "x" };
+        FILE* f = fopen("test_csview_in.csv", "wb");
+        CHECK(f != NULL);
+        if (!f) {
+                return;
+        }
+        fputs("id,text,value\n", f);
+        for (int i = 0; i < 20000; i++) {
+                int s = rng_below(5);
+                bool quote = s == 2 || s == 3;
+                fprintf(f, "%d,%s%s%s,%d\n", i, quote ? "\"" : "", samples[s], quote ? "\"" : "", rng_below(1000000));
+        }
+        fclose(f);
+
+        csv_pool_t* pool = csv_pool_create(4);
+        csv_executor_t exec = csv_pool_executor(pool);
+        csv_document_t* doc = csv_read("test_csview_in.csv", true);
+        CHECK(pool != NULL && doc != NULL);
+        if (pool && doc) {
+                CHECK(csv_write(doc, "test_csview_serial.csv") == 0);
+                CHECK(csv_write_parallel(doc, "test_csview_pool.csv", &exec) == 0);
+                CHECK(csv_write_parallel(doc, "test_csview_inline.csv", NULL) == 0);
+                CHECK(same_file("test_csview_serial.csv", "test_csview_pool.csv"));
+                CHECK(same_file("test_csview_serial.csv", "test_csview_inline.csv"));
+        }
+        csv_free(&doc);
+        csv_pool_destroy(&pool);
+        remove("test_csview_in.csv");
+        remove("test_csview_serial.csv");
+        remove("test_csview_pool.csv");
+        remove("test_csview_inline.csv");
+}
+
+// -------------------------------------------------------------------------------------
+// Queries
+// -------------------------------------------------------------------------------------
+
+// Returns true if column 0 of `doc` lists exactly `expected`, in order.
+static
+bool
+column_is(const csv_document_t* doc,
+          const char* const* expected,
+          int count)
+{
+        if (!doc || doc->num_rows != count) {
+                return false;
+        }
+        for (int i = 0; i < count; i++) {
+                const char* field = csv_field(doc, i, 0);
+                if (!field || strcmp(field, expected[i]) != 0) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+// Two numeric columns compare as numbers ("9" < "10"); text that is not
+// numeric on both sides still compares bytewise.
+static
+void
+test_query_column_compare(void)
+{
+        CHECK(write_file("test_csview_query.csv",
+                         "name,cost,price\n"
+                         "x,1,2\n"
+                         "z,9,10\n"
+                         "y,5,3\n"
+                         "w,abc,abd\n"
+                         "v,2.5,10\n"
+                         "u,-4,-40\n"));
+        static const char* const cheaper[] = { "v", "w", "x", "z" };
+        static const char* const dearer[] = { "u", "y" };
+
+        csv_document_t* doc = csv_query("test_csview_query.csv", "SELECT name WHERE cost < price ORDER BY name");
+        CHECK(column_is(doc, cheaper, 4));
+        csv_free(&doc);
+        doc = csv_query("test_csview_query.csv", "SELECT name WHERE price > cost ORDER BY name");
+        CHECK(column_is(doc, cheaper, 4));
+        csv_free(&doc);
+        doc = csv_query("test_csview_query.csv", "SELECT name WHERE cost > price ORDER BY name");
+        CHECK(column_is(doc, dearer, 2));
+        csv_free(&doc);
+        remove("test_csview_query.csv");
+}
+
+int
+main(void)
+{
+        test_find_kernels();
+        test_scan_kernels();
+        test_pool_and_publish();
+        test_write_parallel();
+        test_query_column_compare();
+        if (failures) {
+                fprintf(stderr, "%d check(s) failed\n", failures);
+                return 1;
+        }
+        printf("all tests passed (kernel: %s)\n", csv_kernel_name());
+        return 0;
+}